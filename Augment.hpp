@@ -0,0 +1,159 @@
+#ifndef _AUGMENT_H_
+#define _AUGMENT_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <vector>
+#include "tbb/tbb.h"
+#include "Data.hpp"
+#include "Params.hpp"
+#include "Simd.hpp"
+#include "Tensor.hpp"
+
+///===--------------------------------------------------------------------===///
+/// Data augmentation.
+///
+/// Each training image is warped by a random shift and rotation about its
+/// centre and an elastic distortion, a field of random displacements smoothed
+/// by a Gaussian, as in Simard et al., "Best practices for convolutional
+/// neural networks applied to visual document analysis". The warp of an image
+/// depends only on the seed of the epoch and the position of the image in
+/// it, so each epoch sees new variants, none of them stored, and a resumed
+/// run sees the same ones. The images of a minibatch are warped in parallel.
+///===--------------------------------------------------------------------===///
+class Augmenter {
+  unsigned inputX, inputY;
+  float maxShift;
+  float maxRotation; // In radians.
+  float elasticAlpha;
+  std::vector<float> gaussian; // The taps of the smoothing filter.
+  // Four planes of scratch space for each image of a minibatch.
+  Tensor scratch;
+  unsigned long numImages = 0;
+  double ms = 0.0;
+
+  /// Convolve each column of a width x height plane with the Gaussian,
+  /// taking the plane to be zero outside its bounds, and write the result
+  /// transposed. Each tap is applied to all the rows it reaches at once.
+  void smoothColumns(const float *in, float *temp, float *out, unsigned width,
+                     unsigned height) const {
+    int radius = gaussian.size() / 2;
+    std::fill_n(temp, width * height, 0.0f);
+    for (int k = -radius; k <= radius; ++k) {
+      int begin = std::max(0, -k);
+      int end = std::min(int(height), int(height) - k);
+      if (begin < end) {
+        simd::kernels().axpy(gaussian[k + radius], &in[(begin + k) * width],
+                             &temp[begin * width], (end - begin) * width);
+      }
+    }
+    for (unsigned y = 0; y < height; ++y) {
+      for (unsigned x = 0; x < width; ++x) {
+        out[(x * height) + y] = temp[(y * width) + x];
+      }
+    }
+  }
+
+  /// Convolve a plane with the Gaussian in two dimensions, using two more
+  /// planes as scratch space.
+  void smooth(float *plane, float *temp, float *transposed) const {
+    smoothColumns(plane, temp, transposed, inputX, inputY);
+    smoothColumns(transposed, temp, plane, inputY, inputX);
+  }
+
+  /// Warp one image in place, with the generator of its position.
+  void warp(float *image, float *planes, std::minstd_rand &engine) const {
+    unsigned size = inputX * inputY;
+    float *mapX = planes;
+    float *mapY = planes + size;
+    float *fieldX = planes + (2 * size);
+    float *fieldY = planes + (3 * size);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    float angle = maxRotation * unit(engine);
+    float shiftX = maxShift * unit(engine);
+    float shiftY = maxShift * unit(engine);
+    if (elasticAlpha != 0.0f) {
+      for (unsigned i = 0; i < size; ++i) {
+        fieldX[i] = unit(engine);
+        fieldY[i] = unit(engine);
+      }
+      smooth(fieldX, mapX, mapY);
+      smooth(fieldY, mapX, mapY);
+    }
+    // Each output pixel is sampled from the input at the point the inverse
+    // transform maps it to.
+    float cosine = std::cos(angle);
+    float sine = std::sin(angle);
+    float centreX = (inputX - 1) / 2.0f;
+    float centreY = (inputY - 1) / 2.0f;
+    for (unsigned y = 0; y < inputY; ++y) {
+      float dy = y - centreY - shiftY;
+      for (unsigned x = 0; x < inputX; ++x) {
+        float dx = x - centreX - shiftX;
+        mapX[(y * inputX) + x] = (cosine * dx) + (sine * dy) + centreX;
+        mapY[(y * inputX) + x] = (cosine * dy) - (sine * dx) + centreY;
+      }
+    }
+    const simd::Kernels &kernels = simd::kernels();
+    if (elasticAlpha != 0.0f) {
+      kernels.axpy(elasticAlpha, fieldX, mapX, size);
+      kernels.axpy(elasticAlpha, fieldY, mapY, size);
+    }
+    std::copy_n(image, size, fieldX);
+    kernels.warp(fieldX, inputX, inputY, mapX, mapY, image, size);
+  }
+
+public:
+  Augmenter(const Params &params, unsigned mbSize, unsigned inputX,
+            unsigned inputY) :
+      inputX(inputX), inputY(inputY), maxShift(params.augmentShift),
+      maxRotation(params.augmentRotation * std::acos(-1.0f) / 180.0f),
+      elasticAlpha(params.elasticAlpha) {
+    if (isEnabled()) {
+      scratch = Tensor(mbSize * 4 * inputX * inputY);
+    }
+    if (elasticAlpha != 0.0f) {
+      // Truncate the Gaussian at three standard deviations, and normalise it.
+      float sigma = params.elasticSigma;
+      int radius = std::max(1, int(std::ceil(3.0f * sigma)));
+      float total = 0.0f;
+      for (int k = -radius; k <= radius; ++k) {
+        gaussian.push_back(std::exp(-(k * k) / (2.0f * sigma * sigma)));
+        total += gaussian.back();
+      }
+      for (float &tap : gaussian) {
+        tap /= total;
+      }
+    }
+  }
+
+  bool isEnabled() const {
+    return maxShift != 0.0f || maxRotation != 0.0f || elasticAlpha != 0.0f;
+  }
+
+  /// Warp the images of a minibatch whose first image is at the given
+  /// position in the epoch of the given seed.
+  void apply(Minibatch &batch, uint32_t seed, unsigned position) {
+    auto start = std::chrono::high_resolution_clock::now();
+    unsigned mbSize = batch.labels.size();
+    unsigned size = inputX * inputY;
+    float *images = batch.images.data();
+    float *planes = scratch.data();
+    tbb::parallel_for(0u, mbSize, [=](unsigned mb) {
+      std::seed_seq sequence = {seed, position + mb};
+      std::minstd_rand engine(sequence);
+      warp(&images[mb * size], &planes[mb * 4 * size], engine);
+    });
+    auto end = std::chrono::high_resolution_clock::now();
+    numImages += mbSize;
+    ms += std::chrono::duration<double, std::milli>(end - start).count();
+  }
+
+  unsigned long getNumImages() const { return numImages; }
+  double getImagesPerSec() const { return ms ? numImages * 1000.0 / ms : 0.0; }
+};
+
+#endif
@@ -0,0 +1,207 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Model.hpp"
+
+///===--------------------------------------------------------------------===///
+/// Training checkpoints.
+///
+/// A checkpoint holds everything needed to continue a run of SGD exactly as
+/// if it had not stopped: the position in the run, the seeds of the shuffles
+/// made so far, the state of the random number generator and the network as
+/// a model. The file is a header, the seeds, the generator state and then the
+/// model, which starts on a 64-byte boundary.
+///===--------------------------------------------------------------------===///
+namespace checkpoint {
+
+constexpr uint32_t magicNumber = 0x54504b43; // "CKPT"
+constexpr uint32_t version = 4;
+
+struct Header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t mbSize;
+  uint32_t accumulationSteps;
+  uint32_t numTrainingImages;
+  uint32_t epoch;
+  uint32_t nextImage;
+  uint32_t numSeeds;
+  uint32_t generatorStateSize;
+  uint32_t numReplicas;
+  uint32_t numProcesses;
+  uint32_t reserved; // Zero.
+  uint64_t modelOffset;
+  uint64_t modelSize;
+};
+
+static_assert(sizeof(Header) % 8 == 0, "Header should not need padding");
+
+/// The state of a run of SGD between two updates of the weights.
+struct State {
+  unsigned mbSize = 0;
+  unsigned accumulationSteps = 0; // Minibatches in each update, per replica.
+  unsigned numReplicas = 0;
+  unsigned numProcesses = 0;
+  unsigned numTrainingImages = 0;
+  unsigned epoch = 0;      // The epoch to continue.
+  unsigned nextImage = 0;  // The first image of the next minibatch.
+  // The seed of the shuffle of each epoch so far. The current epoch has been
+  // shuffled if there is one more seed than completed epochs.
+  std::vector<uint32_t> shuffleSeeds;
+  std::string generatorState; // Written with operator<<.
+  model::Buffer model;
+};
+
+inline void write(const State &state, const char *filename) {
+  Header header = {};
+  header.magic = magicNumber;
+  header.version = version;
+  header.mbSize = state.mbSize;
+  header.accumulationSteps = state.accumulationSteps;
+  header.numReplicas = state.numReplicas;
+  header.numProcesses = state.numProcesses;
+  header.numTrainingImages = state.numTrainingImages;
+  header.epoch = state.epoch;
+  header.nextImage = state.nextImage;
+  header.numSeeds = state.shuffleSeeds.size();
+  header.generatorStateSize = state.generatorState.size();
+  header.modelOffset =
+      model::alignOffset(sizeof(Header) +
+                         (header.numSeeds * sizeof(uint32_t)) +
+                         header.generatorStateSize);
+  header.modelSize = state.model.size();
+  uint64_t padding = header.modelOffset - sizeof(Header) -
+                     (header.numSeeds * sizeof(uint32_t)) -
+                     header.generatorStateSize;
+  // Write a temporary file and rename it, so a crash while writing leaves the
+  // previous checkpoint intact.
+  std::string tempName = std::string(filename) + ".tmp";
+  std::ofstream file;
+  file.open(tempName, std::ios::binary | std::ios::out | std::ios::trunc);
+  if (!file.good()) {
+    std::cout << "Error opening file " << tempName << '\n';
+    std::exit(1);
+  }
+  file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+  file.write(reinterpret_cast<const char*>(state.shuffleSeeds.data()),
+             header.numSeeds * sizeof(uint32_t));
+  file.write(state.generatorState.data(), header.generatorStateSize);
+  file.write(std::string(padding, '\0').data(), padding);
+  file.write(state.model.data(), state.model.size());
+  file.close();
+  if (!file.good() || std::rename(tempName.c_str(), filename) != 0) {
+    std::cout << "Error writing file " << filename << '\n';
+    std::exit(1);
+  }
+}
+
+inline State read(const char *filename) {
+  std::ifstream file;
+  file.open(filename, std::ios::binary | std::ios::in | std::ios::ate);
+  if (!file.good()) {
+    std::cout << "Error opening file " << filename << '\n';
+    std::exit(1);
+  }
+  uint64_t size = file.tellg();
+  file.seekg(0);
+  auto check = [filename](bool condition, const char *reason) {
+    if (!condition) {
+      std::cout << "Invalid checkpoint " << filename << ": " << reason << '\n';
+      std::exit(1);
+    }
+  };
+  Header header;
+  check(size >= sizeof(Header) &&
+        file.read(reinterpret_cast<char*>(&header), sizeof(Header)),
+        "truncated header");
+  check(header.magic == magicNumber, "bad magic number");
+  check(header.version == version, "unsupported version");
+  check(header.modelOffset % model::alignment == 0 &&
+        header.modelOffset >= sizeof(Header) +
+                              (uint64_t(header.numSeeds) * sizeof(uint32_t)) +
+                              header.generatorStateSize &&
+        header.modelOffset <= size &&
+        header.modelSize == size - header.modelOffset, "size mismatch");
+  State state;
+  state.mbSize = header.mbSize;
+  state.accumulationSteps = header.accumulationSteps;
+  state.numReplicas = header.numReplicas;
+  state.numProcesses = header.numProcesses;
+  state.numTrainingImages = header.numTrainingImages;
+  state.epoch = header.epoch;
+  state.nextImage = header.nextImage;
+  state.shuffleSeeds.resize(header.numSeeds);
+  state.generatorState.resize(header.generatorStateSize);
+  state.model.resize(header.modelSize);
+  file.read(reinterpret_cast<char*>(state.shuffleSeeds.data()),
+            header.numSeeds * sizeof(uint32_t));
+  file.read(&state.generatorState[0], header.generatorStateSize);
+  file.seekg(header.modelOffset);
+  file.read(state.model.data(), header.modelSize);
+  check(file.good(), "read failed");
+  return state;
+}
+
+/// Writes checkpoints to one file on a background thread, so training only
+/// waits for a write if the previous one has not finished. Records how long
+/// the writes take.
+class AsyncWriter {
+  std::string filename;
+  std::thread thread;
+  State pending;
+  unsigned numWrites = 0;
+  double totalWriteMs = 0.0;
+  double maxWriteMs = 0.0;
+
+public:
+  explicit AsyncWriter(std::string filename) : filename(filename) {}
+
+  ~AsyncWriter() { wait(); }
+
+  AsyncWriter(const AsyncWriter&) = delete;
+  AsyncWriter &operator=(const AsyncWriter&) = delete;
+
+  /// Start writing a checkpoint, after any previous one is written.
+  void write(State state) {
+    wait();
+    pending = std::move(state);
+    thread = std::thread([this] {
+      auto start = std::chrono::high_resolution_clock::now();
+      checkpoint::write(pending, filename.c_str());
+      auto end = std::chrono::high_resolution_clock::now();
+      double ms =
+          std::chrono::duration<double, std::milli>(end - start).count();
+      ++numWrites;
+      totalWriteMs += ms;
+      maxWriteMs = std::max(maxWriteMs, ms);
+    });
+  }
+
+  /// Wait for the last checkpoint to be written.
+  void wait() {
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+
+  // The statistics are only complete after wait().
+  unsigned getNumWrites() const { return numWrites; }
+  double getMeanWriteMs() const {
+    return numWrites ? totalWriteMs / numWrites : 0.0;
+  }
+  double getMaxWriteMs() const { return maxWriteMs; }
+};
+
+} // End namespace checkpoint.
+
+#endif
@@ -0,0 +1,381 @@
+#ifndef _CONV_H_
+#define _CONV_H_
+
+#include <algorithm>
+#include <cstring>
+#include "tbb/tbb.h"
+
+///===--------------------------------------------------------------------===///
+/// Lowering of a minibatch convolution onto matrix multiplication.
+///
+/// Inputs are a minibatch of [z][y][x] volumes and kernels are kernelX wide,
+/// kernelY high and as deep as the input, applied with stride 1 and no
+/// padding. The column matrix has one row for each kernel offset (c, b, a),
+/// ordered as the weights [z][y][x], and one column for each image and output
+/// position, ordered [mb][y][x]. The convolution of every image with every
+/// kernel is then a single product of the [fm][z][y][x] weight matrix with the
+/// column matrix.
+///===--------------------------------------------------------------------===///
+namespace conv {
+
+/// Copy each input receptive field into a column of cols.
+inline void im2col(const float *in, unsigned numImages,
+                   unsigned inputX, unsigned inputY, unsigned inputZ,
+                   unsigned kernelX, unsigned kernelY, float *cols) {
+  unsigned outputX = inputX - kernelX + 1;
+  unsigned outputY = inputY - kernelY + 1;
+  unsigned inputSize = inputX * inputY * inputZ;
+  unsigned numCols = numImages * outputX * outputY;
+  // Each row of the column matrix is independent.
+  tbb::parallel_for(0u, inputZ * kernelY * kernelX, [=](unsigned k) {
+    unsigned a = k % kernelX;
+    unsigned b = (k / kernelX) % kernelY;
+    unsigned c = k / (kernelX * kernelY);
+    float *col = &cols[k * numCols];
+    for (unsigned mb = 0; mb < numImages; ++mb) {
+      for (unsigned y = 0; y < outputY; ++y) {
+        const float *inRow =
+          &in[(mb * inputSize) + (((c * inputY) + y + b) * inputX) + a];
+        std::copy(inRow, inRow + outputX, col);
+        col += outputX;
+      }
+    }
+  });
+}
+
+/// The adjoint of im2col: accumulate each column of cols back into the input
+/// positions of its receptive field.
+inline void col2im(const float *cols, unsigned numImages,
+                   unsigned inputX, unsigned inputY, unsigned inputZ,
+                   unsigned kernelX, unsigned kernelY, float *in) {
+  unsigned outputX = inputX - kernelX + 1;
+  unsigned outputY = inputY - kernelY + 1;
+  unsigned numCols = numImages * outputX * outputY;
+  // Each input channel of each image is written by a single task.
+  tbb::parallel_for(0u, numImages * inputZ, [=](unsigned i) {
+    unsigned mb = i / inputZ;
+    unsigned c = i % inputZ;
+    float *inChannel = &in[i * inputX * inputY];
+    std::fill(inChannel, inChannel + (inputX * inputY), 0.0f);
+    for (unsigned b = 0; b < kernelY; ++b) {
+      for (unsigned a = 0; a < kernelX; ++a) {
+        unsigned k = (((c * kernelY) + b) * kernelX) + a;
+        const float *col = &cols[(k * numCols) + (mb * outputX * outputY)];
+        for (unsigned y = 0; y < outputY; ++y) {
+          float *inRow = &inChannel[((y + b) * inputX) + a];
+          for (unsigned x = 0; x < outputX; ++x) {
+            inRow[x] += col[x];
+          }
+          col += outputX;
+        }
+      }
+    }
+  });
+}
+
+///===--------------------------------------------------------------------===///
+/// Winograd minimal filtering F(m x m, 3 x 3).
+///
+/// Each m x m tile of the output is computed from an alpha x alpha tile of the
+/// input, alpha = m + 2, as A^T.[(G.g.G^T) * (B^T.d.B)].A, where * is the
+/// element-wise product. Summing over the input channels in the transformed
+/// domain turns the element-wise products into alpha^2 independent matrix
+/// multiplies of the [fm][z] transformed filters with the [z][tile]
+/// transformed inputs, so transformed data is laid out [xi][nu][row][col].
+/// Tiles are ordered [mb][y][x] and overlap by two elements. The transforms
+/// are specialised on the tile size so that their constant matrices are
+/// folded into the code.
+///===--------------------------------------------------------------------===///
+template <unsigned m>
+struct Winograd;
+
+/// F(2x2, 3x3): 16 multiplies per 4 outputs, instead of 36.
+template <>
+struct Winograd<2> {
+  static constexpr unsigned alpha = 4;
+  static const float *BT() {
+    static const float BT[] = { 1,  0, -1,  0,
+                                0,  1,  1,  0,
+                                0, -1,  1,  0,
+                                0,  1,  0, -1 };
+    return BT;
+  }
+  static const float *G() {
+    static const float G[] = { 1.0f,  0.0f, 0.0f,
+                               0.5f,  0.5f, 0.5f,
+                               0.5f, -0.5f, 0.5f,
+                               0.0f,  0.0f, 1.0f };
+    return G;
+  }
+  static const float *AT() {
+    static const float AT[] = { 1, 1,  1,  0,
+                                0, 1, -1, -1 };
+    return AT;
+  }
+};
+
+/// F(4x4, 3x3): 36 multiplies per 16 outputs, instead of 144.
+template <>
+struct Winograd<4> {
+  static constexpr unsigned alpha = 6;
+  static const float *BT() {
+    static const float BT[] = { 4,  0, -5,  0, 1, 0,
+                                0, -4, -4,  1, 1, 0,
+                                0,  4, -4, -1, 1, 0,
+                                0, -2, -1,  2, 1, 0,
+                                0,  2, -1, -2, 1, 0,
+                                0,  4,  0, -5, 0, 1 };
+    return BT;
+  }
+  static const float *G() {
+    static const float G[] = {  1.0f / 4,   0.0f,      0.0f,
+                               -1.0f / 6,  -1.0f / 6, -1.0f / 6,
+                               -1.0f / 6,   1.0f / 6, -1.0f / 6,
+                                1.0f / 24,  1.0f / 12, 1.0f / 6,
+                                1.0f / 24, -1.0f / 12, 1.0f / 6,
+                                0.0f,       0.0f,      1.0f };
+    return G;
+  }
+  static const float *AT() {
+    static const float AT[] = { 1, 1,  1, 1,  1, 0,
+                                0, 1, -1, 2, -2, 0,
+                                0, 1,  1, 4,  4, 0,
+                                0, 1, -1, 8, -8, 1 };
+    return AT;
+  }
+};
+
+/// The number of m x m tiles covering a minibatch of outputX x outputY
+/// outputs.
+inline unsigned numWinogradTiles(unsigned m, unsigned numImages,
+                                 unsigned outputX, unsigned outputY) {
+  return numImages * ((outputX + m - 1) / m) * ((outputY + m - 1) / m);
+}
+
+/// Choose the tile size that needs the fewest element-wise products for an
+/// outputX x outputY convolution, accounting for partial tiles at the edges.
+inline unsigned chooseWinogradTile(unsigned outputX, unsigned outputY) {
+  unsigned costF2 = 4 * 4 * numWinogradTiles(2, 1, outputX, outputY);
+  unsigned costF4 = 6 * 6 * numWinogradTiles(4, 1, outputX, outputY);
+  return costF4 <= costF2 ? 4 : 2;
+}
+
+/// The data transforms process a group of consecutive tiles of one channel
+/// together, one tile per vector lane.
+constexpr unsigned numLanes = 8;
+typedef float Lanes __attribute__((vector_size(numLanes * sizeof(float))));
+
+/// out = L.X.L^T, where L is rows x cols, or given as its cols x rows
+/// transpose when trans is set, and X is cols x cols. Zero coefficients of a
+/// constant L are skipped.
+template <unsigned rows, unsigned cols, bool trans, typename T>
+inline void sandwich(const float *L, const T *X, T *out) {
+  auto l = [=](unsigned i, unsigned k) {
+    return trans ? L[(k * rows) + i] : L[(i * cols) + k];
+  };
+  T tmp[rows * cols];
+  for (unsigned i = 0; i < rows; ++i) {
+    for (unsigned j = 0; j < cols; ++j) {
+      T sum = T();
+      for (unsigned k = 0; k < cols; ++k) {
+        if (l(i, k) != 0.0f) {
+          sum += l(i, k) * X[(k * cols) + j];
+        }
+      }
+      tmp[(i * cols) + j] = sum;
+    }
+  }
+  for (unsigned i = 0; i < rows; ++i) {
+    for (unsigned j = 0; j < rows; ++j) {
+      T sum = T();
+      for (unsigned k = 0; k < cols; ++k) {
+        if (l(j, k) != 0.0f) {
+          sum += tmp[(i * cols) + k] * l(j, k);
+        }
+      }
+      out[(i * rows) + j] = sum;
+    }
+  }
+}
+
+/// Copy the first n lanes of a vector to or from memory.
+inline void storeLanes(const Lanes &v, unsigned n, float *dst) {
+  if (n == numLanes) {
+    std::memcpy(dst, &v, sizeof(Lanes));
+  } else {
+    for (unsigned l = 0; l < n; ++l) {
+      dst[l] = v[l];
+    }
+  }
+}
+
+inline void loadLanes(const float *src, unsigned n, Lanes &v) {
+  if (n == numLanes) {
+    std::memcpy(&v, src, sizeof(Lanes));
+  } else {
+    v = Lanes{};
+    for (unsigned l = 0; l < n; ++l) {
+      v[l] = src[l];
+    }
+  }
+}
+
+/// Transform the 3x3 [fm][z][y][x] filters into G.g.G^T, laid out
+/// [xi][nu][fm][z]. When flip is set, produce instead the filters of the
+/// transposed convolution, laid out [xi][nu][z][fm] and rotated by 180
+/// degrees.
+template <unsigned m>
+inline void winogradFilters(const float *weights,
+                            unsigned numFMs, unsigned depth, bool flip,
+                            float *U) {
+  constexpr unsigned alpha = Winograd<m>::alpha;
+  tbb::parallel_for(0u, numFMs * depth, [=](unsigned i) {
+    unsigned fm = i / depth;
+    unsigned c = i % depth;
+    float g[3 * 3], u[alpha * alpha];
+    for (unsigned j = 0; j < 3 * 3; ++j) {
+      g[j] = weights[(i * 3 * 3) + (flip ? 8 - j : j)];
+    }
+    sandwich<alpha, 3, false>(Winograd<m>::G(), g, u);
+    unsigned index = flip ? (c * numFMs) + fm : i;
+    for (unsigned k = 0; k < alpha * alpha; ++k) {
+      U[(k * numFMs * depth) + index] = u[k];
+    }
+  });
+}
+
+/// Transform the input tiles of a minibatch of [z][y][x] inputs into
+/// B^T.d.B, laid out [xi][nu][z][tile]. The tiles cover an outputX x outputY
+/// output and are offset by -pad, with positions outside the input read as
+/// zero.
+template <unsigned m>
+inline void winogradInputs(const float *in, unsigned numImages,
+                           unsigned inputX, unsigned inputY, unsigned depth,
+                           unsigned pad, unsigned outputX, unsigned outputY,
+                           float *V) {
+  constexpr unsigned alpha = Winograd<m>::alpha;
+  unsigned tilesX = (outputX + m - 1) / m;
+  unsigned tilesPerImage = tilesX * ((outputY + m - 1) / m);
+  unsigned numTiles = numImages * tilesPerImage;
+  tbb::parallel_for(0u, numImages * depth, [=](unsigned i) {
+    unsigned mb = i / depth;
+    unsigned c = i % depth;
+    const float *channel = &in[i * inputX * inputY];
+    for (unsigned t0 = 0; t0 < tilesPerImage; t0 += numLanes) {
+      unsigned lanes = std::min(numLanes, tilesPerImage - t0);
+      Lanes d[alpha * alpha] = {}, v[alpha * alpha];
+      for (unsigned l = 0; l < lanes; ++l) {
+        int y0 = int(((t0 + l) / tilesX) * m) - int(pad);
+        int x0 = int(((t0 + l) % tilesX) * m) - int(pad);
+        bool interior = y0 >= 0 && y0 + alpha <= inputY &&
+                        x0 >= 0 && x0 + alpha <= inputX;
+        for (unsigned r = 0; r < alpha; ++r) {
+          for (unsigned s = 0; s < alpha; ++s) {
+            int y = y0 + int(r);
+            int x = x0 + int(s);
+            if (interior || (y >= 0 && y < int(inputY) &&
+                             x >= 0 && x < int(inputX))) {
+              d[(r * alpha) + s][l] = channel[(y * inputX) + x];
+            }
+          }
+        }
+      }
+      sandwich<alpha, alpha, false>(Winograd<m>::BT(), d, v);
+      float *dst = &V[(c * numTiles) + (mb * tilesPerImage) + t0];
+      for (unsigned k = 0; k < alpha * alpha; ++k) {
+        storeLanes(v[k], lanes, &dst[k * depth * numTiles]);
+      }
+    }
+  });
+}
+
+/// Transform the [xi][nu][fm][tile] products back into A^T.M.A output tiles
+/// and write the parts of them within the [mb][fm][y][x] output.
+template <unsigned m>
+inline void winogradOutputs(const float *M, unsigned numImages,
+                            unsigned numFMs, unsigned outputX,
+                            unsigned outputY, float *out) {
+  constexpr unsigned alpha = Winograd<m>::alpha;
+  unsigned tilesX = (outputX + m - 1) / m;
+  unsigned tilesPerImage = tilesX * ((outputY + m - 1) / m);
+  unsigned numTiles = numImages * tilesPerImage;
+  tbb::parallel_for(0u, numImages * numFMs, [=](unsigned i) {
+    unsigned mb = i / numFMs;
+    unsigned fm = i % numFMs;
+    float *channel = &out[i * outputX * outputY];
+    for (unsigned t0 = 0; t0 < tilesPerImage; t0 += numLanes) {
+      unsigned lanes = std::min(numLanes, tilesPerImage - t0);
+      const float *src = &M[(fm * numTiles) + (mb * tilesPerImage) + t0];
+      Lanes mt[alpha * alpha], y[m * m];
+      for (unsigned k = 0; k < alpha * alpha; ++k) {
+        loadLanes(&src[k * numFMs * numTiles], lanes, mt[k]);
+      }
+      sandwich<m, alpha, false>(Winograd<m>::AT(), mt, y);
+      for (unsigned l = 0; l < lanes; ++l) {
+        unsigned y0 = ((t0 + l) / tilesX) * m;
+        unsigned x0 = ((t0 + l) % tilesX) * m;
+        for (unsigned r = 0; r < m && y0 + r < outputY; ++r) {
+          for (unsigned s = 0; s < m && x0 + s < outputX; ++s) {
+            channel[((y0 + r) * outputX) + x0 + s] = y[(r * m) + s][l];
+          }
+        }
+      }
+    }
+  });
+}
+
+/// The adjoint of winogradOutputs: transform m x m tiles of the
+/// [mb][fm][y][x] output errors, zero beyond the output, into A.E.A^T, laid
+/// out [xi][nu][fm][tile].
+template <unsigned m>
+inline void winogradErrors(const float *errors, unsigned numImages,
+                           unsigned numFMs, unsigned outputX,
+                           unsigned outputY, float *E) {
+  constexpr unsigned alpha = Winograd<m>::alpha;
+  unsigned tilesX = (outputX + m - 1) / m;
+  unsigned tilesPerImage = tilesX * ((outputY + m - 1) / m);
+  unsigned numTiles = numImages * tilesPerImage;
+  tbb::parallel_for(0u, numImages * numFMs, [=](unsigned i) {
+    unsigned mb = i / numFMs;
+    unsigned fm = i % numFMs;
+    const float *channel = &errors[i * outputX * outputY];
+    for (unsigned t0 = 0; t0 < tilesPerImage; t0 += numLanes) {
+      unsigned lanes = std::min(numLanes, tilesPerImage - t0);
+      Lanes e[m * m] = {}, et[alpha * alpha];
+      for (unsigned l = 0; l < lanes; ++l) {
+        unsigned y0 = ((t0 + l) / tilesX) * m;
+        unsigned x0 = ((t0 + l) % tilesX) * m;
+        for (unsigned r = 0; r < m && y0 + r < outputY; ++r) {
+          for (unsigned s = 0; s < m && x0 + s < outputX; ++s) {
+            e[(r * m) + s][l] = channel[((y0 + r) * outputX) + x0 + s];
+          }
+        }
+      }
+      sandwich<alpha, m, true>(Winograd<m>::AT(), e, et);
+      float *dst = &E[(fm * numTiles) + (mb * tilesPerImage) + t0];
+      for (unsigned k = 0; k < alpha * alpha; ++k) {
+        storeLanes(et[k], lanes, &dst[k * numFMs * numTiles]);
+      }
+    }
+  });
+}
+
+/// The adjoint of winogradFilters: transform the [xi][nu][fm][z] filter
+/// gradients back into G^T.dU.G, laid out as the [fm][z][y][x] filters.
+template <unsigned m>
+inline void winogradFilterGradients(const float *dU,
+                                    unsigned numFMs, unsigned depth,
+                                    float *dW) {
+  constexpr unsigned alpha = Winograd<m>::alpha;
+  tbb::parallel_for(0u, numFMs * depth, [=](unsigned i) {
+    float du[alpha * alpha];
+    for (unsigned k = 0; k < alpha * alpha; ++k) {
+      du[k] = dU[(k * numFMs * depth) + i];
+    }
+    sandwich<3, alpha, true>(Winograd<m>::G(), du, &dW[i * 3 * 3]);
+  });
+}
+
+} // End namespace conv.
+
+#endif
@@ -1,104 +1,250 @@
 #ifndef _DATA_H_
 #define _DATA_H_
 
-#include <cassert>
+#include <algorithm>
+#include <array>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
 #include <vector>
+#include "tbb/tbb.h"
+#include "Gzip.hpp"
+#include "MappedFile.hpp"
 #include "Params.hpp"
+#include "Tensor.hpp"
 
-using Image = std::vector<float>;
+/// The value of each pixel byte, scaled to between 0 (white) and 1 (black).
+inline const float *getPixelValues() {
+  static const std::array<float, 256> values = [] {
+    std::array<float, 256> values;
+    for (unsigned pixel = 0; pixel < 256; ++pixel) {
+      values[pixel] = static_cast<float>(pixel) / 255.0;
+    }
+    return values;
+  }();
+  return values.data();
+}
 
-class Data {
+/// A view of an image in a dataset file: one byte per pixel, row by row.
+class Image {
+  const uint8_t *pixels;
+  unsigned numPixels;
 
-  static constexpr bool debug = false;
-  static constexpr unsigned imageHeight = 28;
-  static constexpr unsigned imageWidth = 28;
+public:
+  Image(const uint8_t *pixels, unsigned numPixels) :
+      pixels(pixels), numPixels(numPixels) {}
+  const uint8_t *data() const { return pixels; }
+  unsigned size() const { return numPixels; }
+  /// Write the scaled value of each pixel.
+  void copyTo(float *values) const {
+    const float *pixelValues = getPixelValues();
+    for (unsigned i = 0; i < numPixels; ++i) {
+      values[i] = pixelValues[pixels[i]];
+    }
+  }
+};
 
-  std::vector<uint8_t> trainingLabels;
-  std::vector<uint8_t> testLabels;
-  std::vector<uint8_t> validationLabels;
-  std::vector<Image>   trainingImages;
-  std::vector<Image>   testImages;
-  std::vector<Image>   validationImages;
+/// A minibatch gathered from a dataset, staged for the input layer.
+struct Minibatch {
+  Tensor images; // [mb][y][x], the scaled pixels of each image.
+  std::vector<uint8_t> labels;
 
-  static void readLabels(const char *filename,
-                         std::vector<uint8_t> &labels) {
-    std::ifstream file;
-    file.open(filename, std::ios::binary | std::ios::in);
-    if (!file.good()) {
-      std::cout << "Error opening file " << filename << '\n';
-      std::exit(1);
-    }
-    std::cout << "Reading labels: " << filename << "\n";
-    uint32_t magicNumber, numItems;
-    file.read(reinterpret_cast<char*>(&magicNumber), 4);
-    file.read(reinterpret_cast<char*>(&numItems), 4);
-    magicNumber = __builtin_bswap32(magicNumber);
-    numItems = __builtin_bswap32(numItems);
-    if (debug) {
-      std::cout << "Magic number: " << magicNumber << "\n";
-      std::cout << "Num items:    " << numItems << "\n";
-    }
-    for (unsigned i = 0; i < numItems; ++i) {
-      uint8_t label;
-      file.read(reinterpret_cast<char*>(&label), 1);
-      labels.push_back(label);
+  Minibatch(unsigned mbSize, unsigned imageSize) :
+      images(mbSize * imageSize), labels(mbSize) {}
+
+  /// Gather the images and labels at the given indices.
+  void gather(const std::vector<Image> &dataImages,
+              const std::vector<uint8_t> &dataLabels,
+              const unsigned *indices) {
+    unsigned mbSize = labels.size();
+    unsigned imageSize = images.size() / mbSize;
+    for (unsigned mb = 0; mb < mbSize; ++mb) {
+      dataImages[indices[mb]].copyTo(&images[mb * imageSize]);
+      labels[mb] = dataLabels[indices[mb]];
     }
-    file.close();
   }
+};
+
+///===--------------------------------------------------------------------===///
+/// IDX files.
+///
+/// A label file is a header of two big-endian words, the magic number and
+/// the number of labels, then a byte per label. An image file is a header of
+/// four, the magic number, the number of images and the number of rows and
+/// columns in each, then a byte per pixel, image by image and row by row.
+///===--------------------------------------------------------------------===///
+namespace idx {
+
+constexpr bool debug = false;
+constexpr uint32_t labelsMagic = 0x801;
+constexpr uint32_t imagesMagic = 0x803;
+constexpr unsigned labelsHeaderSize = 8;
+constexpr unsigned imagesHeaderSize = 16;
+constexpr unsigned imageHeight = 28;
+constexpr unsigned imageWidth = 28;
+constexpr unsigned imageSize = imageHeight * imageWidth;
+
+inline void check(bool condition, const char *filename, const char *reason) {
+  if (!condition) {
+    std::cout << "Invalid IDX file " << filename << ": " << reason << '\n';
+    std::exit(1);
+  }
+}
 
-  static void readImages(const char *filename,
-                         std::vector<Image> &images) {
-    std::ifstream file;
-    file.open(filename, std::ios::binary | std::ios::in);
-    if (!file.good()) {
-      std::cout << "Error opening file " << filename << '\n';
-      std::exit(1);
-    }
-    std::cout << "Reading images: " << filename << "\n";
-    uint32_t magicNumber, numImages, numRows, numCols;
-    file.read(reinterpret_cast<char*>(&magicNumber), 4);
-    file.read(reinterpret_cast<char*>(&numImages), 4);
-    file.read(reinterpret_cast<char*>(&numRows), 4);
-    file.read(reinterpret_cast<char*>(&numCols), 4);
-    magicNumber = __builtin_bswap32(magicNumber);
-    numImages = __builtin_bswap32(numImages);
-    numRows = __builtin_bswap32(numRows);
-    numCols = __builtin_bswap32(numCols);
-    if (debug) {
-      std::cout << "Magic number: " << magicNumber << "\n";
-      std::cout << "Num images:   " << numImages << "\n";
-      std::cout << "Num rows:     " << numRows << "\n";
-      std::cout << "Num cols:     " << numCols << "\n";
-    }
-    assert(numRows == imageHeight && numCols == imageWidth &&
-           "unexpected image size");
-    for (unsigned i = 0; i < numImages; ++i) {
-      Image image(numRows*numCols);
-      for (unsigned j = 0; j < numRows; ++j) {
-        for (unsigned k = 0; k < numCols; ++k) {
-          uint8_t pixel;
-          file.read(reinterpret_cast<char*>(&pixel), 1);
-          // Scale the pixel value to between 0 (white) and 1 (black).
-          float value = static_cast<float>(pixel) / 255.0;
-          image[(j*numRows)+k] = value;
-        }
-      }
-      images.push_back(image);
+/// Read big-endian header word i.
+inline uint32_t readField(const char *header, unsigned i) {
+  uint32_t field;
+  std::memcpy(&field, header + (i * 4), 4);
+  return __builtin_bswap32(field);
+}
+
+/// Check the header of a label file of fileSize bytes, and return the number
+/// of labels.
+inline uint32_t checkLabelsHeader(const char *header, uint64_t fileSize,
+                                  const char *filename) {
+  check(fileSize >= labelsHeaderSize, filename, "truncated header");
+  uint32_t magicNumber = readField(header, 0);
+  uint32_t numItems = readField(header, 1);
+  if (debug) {
+    std::cout << "Magic number: " << magicNumber << "\n";
+    std::cout << "Num items:    " << numItems << "\n";
+  }
+  check(magicNumber == labelsMagic, filename, "not a label file");
+  check(fileSize - labelsHeaderSize == numItems, filename, "size mismatch");
+  return numItems;
+}
+
+/// Check the header of an image file of fileSize bytes, and return the number
+/// of images.
+inline uint32_t checkImagesHeader(const char *header, uint64_t fileSize,
+                                  const char *filename) {
+  check(fileSize >= imagesHeaderSize, filename, "truncated header");
+  uint32_t magicNumber = readField(header, 0);
+  uint32_t numImages = readField(header, 1);
+  uint32_t numRows = readField(header, 2);
+  uint32_t numCols = readField(header, 3);
+  if (debug) {
+    std::cout << "Magic number: " << magicNumber << "\n";
+    std::cout << "Num images:   " << numImages << "\n";
+    std::cout << "Num rows:     " << numRows << "\n";
+    std::cout << "Num cols:     " << numCols << "\n";
+  }
+  check(magicNumber == imagesMagic, filename, "not an image file");
+  check(numRows == imageHeight && numCols == imageWidth, filename,
+        "unexpected image size");
+  check((fileSize - imagesHeaderSize) / imageSize == numImages &&
+        (fileSize - imagesHeaderSize) % imageSize == 0, filename,
+        "size mismatch");
+  return numImages;
+}
+
+/// The contents of an IDX file, mapped into memory, or inflated into memory
+/// if the file is gzipped.
+class File {
+  std::unique_ptr<MappedFile> mapped;
+  std::vector<char> inflated;
+
+public:
+  explicit File(const std::string &filename) {
+    if (gzip::isCompressed(filename)) {
+      inflated = gzip::inflateFile(filename.c_str());
+    } else {
+      mapped.reset(new MappedFile(filename.c_str()));
     }
-    file.close();
   }
+  const char *getData() const {
+    return mapped ? mapped->getData() : inflated.data();
+  }
+  size_t getSize() const {
+    return mapped ? mapped->getSize() : inflated.size();
+  }
+};
+
+/// The file of the given name or, if there is none, its gzipped version.
+inline std::string locate(const std::string &filename) {
+  if (!std::ifstream(filename).good() &&
+      std::ifstream(filename + ".gz").good()) {
+    return filename + ".gz";
+  }
+  return filename;
+}
+
+inline void readLabels(const std::string &filename,
+                       std::vector<uint8_t> &labels) {
+  // Write each line whole, since files may be read in parallel.
+  std::cout << "Reading labels: " + filename + "\n";
+  File file(filename);
+  uint32_t numItems =
+      checkLabelsHeader(file.getData(), file.getSize(), filename.c_str());
+  auto data =
+      reinterpret_cast<const uint8_t*>(file.getData() + labelsHeaderSize);
+  labels.assign(data, data + numItems);
+}
+
+/// Read an image file, which must outlive the views of its images.
+inline std::unique_ptr<File> readImages(const std::string &filename,
+                                        std::vector<Image> &images) {
+  std::cout << "Reading images: " + filename + "\n";
+  std::unique_ptr<File> file(new File(filename));
+  uint32_t numImages =
+      checkImagesHeader(file->getData(), file->getSize(), filename.c_str());
+  auto data =
+      reinterpret_cast<const uint8_t*>(file->getData() + imagesHeaderSize);
+  images.reserve(numImages);
+  for (unsigned i = 0; i < numImages; ++i) {
+    images.emplace_back(&data[i * imageSize], imageSize);
+  }
+  return file;
+}
+
+} // End namespace idx.
+
+class PermutedSet;
+
+/// The MNIST training, validation and test sets. The IDX files are already a
+/// packed array of bytes per image, so uncompressed files, as get-mnist.sh
+/// leaves, are mapped and used in place. Where only the gzipped files are
+/// present they are inflated into memory, in parallel, each time the data is
+/// loaded, which takes tens of milliseconds rather than one or two.
+class Data {
+  // The images are views of the contents of the image files.
+  std::unique_ptr<idx::File> trainingFile;
+  std::unique_ptr<idx::File> testFile;
+  std::vector<uint8_t> trainingLabels;
+  std::vector<uint8_t> testLabels;
+  std::vector<uint8_t> validationLabels;
+  std::vector<Image>   trainingImages;
+  std::vector<Image>   testImages;
+  std::vector<Image>   validationImages;
 
 public:
+  /// The order in which training visits the training set.
+  using TrainingSet = PermutedSet;
+
   Data(Params params) {
-    // Labels.
-    readLabels("train-labels-idx1-ubyte", trainingLabels);
-    readLabels("t10k-labels-idx1-ubyte", testLabels);
-    //Images.
-    readImages("train-images-idx3-ubyte", trainingImages);
-    readImages("t10k-images-idx3-ubyte", testImages);
+    // Labels and images.
+    tbb::parallel_invoke(
+      [&] {
+        idx::readLabels(idx::locate("train-labels-idx1-ubyte"),
+                        trainingLabels);
+      },
+      [&] {
+        idx::readLabels(idx::locate("t10k-labels-idx1-ubyte"), testLabels);
+      },
+      [&] {
+        trainingFile = idx::readImages(idx::locate("train-images-idx3-ubyte"),
+                                       trainingImages);
+      },
+      [&] {
+        testFile = idx::readImages(idx::locate("t10k-images-idx3-ubyte"),
+                                   testImages);
+      });
     // Reduce number of training images and use them for test (for debugging).
     trainingLabels.erase(trainingLabels.begin() + params.numTrainingImages,
                          trainingLabels.end());
@@ -118,12 +264,57 @@ public:
     trainingImages.erase(trainingImages.end() - params.numValidationImages,
                          trainingImages.end());
   }
-  std::vector<Image>   &getTrainingImages()   { return trainingImages; }
-  std::vector<uint8_t> &getTrainingLabels()   { return trainingLabels; }
-  std::vector<Image>   &getValidationImages() { return validationImages; }
-  std::vector<uint8_t> &getValidationLabels() { return validationLabels; }
-  std::vector<Image>   &getTestImages()       { return testImages; }
-  std::vector<uint8_t> &getTestLabels()       { return testLabels; }
+  unsigned getNumTrainingImages() const { return trainingImages.size(); }
+  const std::vector<Image> &getTrainingImages() const {
+    return trainingImages;
+  }
+  const std::vector<uint8_t> &getTrainingLabels() const {
+    return trainingLabels;
+  }
+  const std::vector<Image> &getValidationImages() const {
+    return validationImages;
+  }
+  const std::vector<uint8_t> &getValidationLabels() const {
+    return validationLabels;
+  }
+  const std::vector<Image> &getTestImages() const { return testImages; }
+  const std::vector<uint8_t> &getTestLabels() const { return testLabels; }
+};
+
+/// The training set of a Data, visited in the order of a permutation of its
+/// indices. Each shuffle permutes the previous order.
+class PermutedSet {
+  const std::vector<Image> &images;
+  const std::vector<uint8_t> &labels;
+  std::vector<unsigned> order;
+  unsigned position;
+
+public:
+  explicit PermutedSet(const Data &data) :
+      images(data.getTrainingImages()), labels(data.getTrainingLabels()),
+      order(images.size()), position(0) {
+    std::iota(order.begin(), order.end(), 0);
+  }
+
+  unsigned size() const { return order.size(); }
+
+  /// Start an epoch in a new order.
+  void shuffle(uint32_t seed) {
+    std::shuffle(order.begin(), order.end(), std::default_random_engine(seed));
+    position = 0;
+  }
+
+  /// Move to an image in the order of the epoch.
+  void seek(unsigned image) { position = image; }
+
+  /// Pass over the next numImages images.
+  void skip(unsigned numImages) { position += numImages; }
+
+  /// Gather the next minibatch.
+  void gather(Minibatch &batch) {
+    batch.gather(images, labels, &order[position]);
+    position += batch.labels.size();
+  }
 };
 
 #endif
@@ -0,0 +1,236 @@
+#ifndef _FFT_H_
+#define _FFT_H_
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <vector>
+
+///===--------------------------------------------------------------------===///
+/// Two-dimensional fast Fourier transforms of real n x n signals.
+///
+/// n is a power of two. Since the signals are real, only the n x (n / 2 + 1)
+/// half of each spectrum is stored, with the real and imaginary parts held in
+/// separate planes so that products of spectra vectorise. Transforms are
+/// computed with an iterative radix-2 FFT over rows, then columns.
+///===--------------------------------------------------------------------===///
+namespace fft {
+
+typedef std::complex<float> Complex;
+
+/// The smallest power of two that is at least size.
+inline unsigned transformSize(unsigned size) {
+  unsigned n = 1;
+  while (n < size) {
+    n *= 2;
+  }
+  return n;
+}
+
+/// The number of complex elements in the half spectrum of an n x n signal.
+inline unsigned spectrumSize(unsigned n) {
+  return n * ((n / 2) + 1);
+}
+
+/// Twiddle factors and bit-reversal permutation for transforms of size n.
+struct Plan {
+  unsigned n = 0;
+  std::vector<float> twiddles[2]; // exp(-+2 pi i k / n), forward and inverse.
+  std::vector<unsigned> reversed;
+
+  void init(unsigned size) {
+    n = size;
+    double pi = std::acos(-1.0);
+    for (unsigned inverse = 0; inverse < 2; ++inverse) {
+      twiddles[inverse].resize(n);
+      for (unsigned k = 0; k < n / 2; ++k) {
+        double angle = (inverse ? 2.0 : -2.0) * pi * k / n;
+        twiddles[inverse][2 * k] = std::cos(angle);
+        twiddles[inverse][(2 * k) + 1] = std::sin(angle);
+      }
+    }
+    reversed.resize(n);
+    for (unsigned i = 0, j = 0; i < n; ++i) {
+      reversed[i] = j;
+      unsigned bit = n >> 1;
+      for (; j & bit; bit >>= 1) {
+        j ^= bit;
+      }
+      j ^= bit;
+    }
+  }
+};
+
+/// In-place transform of n complex values, without normalisation.
+inline void fft(Complex *data, unsigned n, bool inverse) {
+  // Plans are cached per thread for the last size.
+  static thread_local Plan plan;
+  if (plan.n != n) {
+    plan.init(n);
+  }
+  const unsigned *reversed = plan.reversed.data();
+  for (unsigned i = 0; i < n; ++i) {
+    if (i < reversed[i]) {
+      std::swap(data[i], data[reversed[i]]);
+    }
+  }
+  // Butterflies, with the complex arithmetic written out to avoid the
+  // special-value handling of std::complex multiplication.
+  const float *w = plan.twiddles[inverse].data();
+  float *d = reinterpret_cast<float*>(data);
+  for (unsigned len = 2; len <= n; len *= 2) {
+    unsigned half = len / 2;
+    unsigned step = n / len;
+    for (unsigned i = 0; i < n; i += len) {
+      for (unsigned k = 0; k < half; ++k) {
+        float wr = w[2 * k * step];
+        float wi = w[(2 * k * step) + 1];
+        float *u = &d[2 * (i + k)];
+        float *v = &d[2 * (i + k + half)];
+        float vr = (v[0] * wr) - (v[1] * wi);
+        float vi = (v[0] * wi) + (v[1] * wr);
+        v[0] = u[0] - vr;
+        v[1] = u[1] - vi;
+        u[0] += vr;
+        u[1] += vi;
+      }
+    }
+  }
+}
+
+/// In-place transform down the columns of n rows of width complex values,
+/// held as separate real and imaginary planes. Whole rows are combined at
+/// each step, so the arithmetic vectorises across the columns.
+inline void fftColumns(float *re, float *im, unsigned n, unsigned width,
+                       bool inverse) {
+  static thread_local Plan plan;
+  if (plan.n != n) {
+    plan.init(n);
+  }
+  const unsigned *reversed = plan.reversed.data();
+  for (unsigned i = 0; i < n; ++i) {
+    if (i < reversed[i]) {
+      std::swap_ranges(&re[i * width], &re[(i + 1) * width],
+                       &re[reversed[i] * width]);
+      std::swap_ranges(&im[i * width], &im[(i + 1) * width],
+                       &im[reversed[i] * width]);
+    }
+  }
+  const float *w = plan.twiddles[inverse].data();
+  for (unsigned len = 2; len <= n; len *= 2) {
+    unsigned half = len / 2;
+    unsigned step = n / len;
+    for (unsigned i = 0; i < n; i += len) {
+      for (unsigned k = 0; k < half; ++k) {
+        float wr = w[2 * k * step];
+        float wi = w[(2 * k * step) + 1];
+        float *uRe = &re[(i + k) * width];
+        float *uIm = &im[(i + k) * width];
+        float *vRe = &re[(i + k + half) * width];
+        float *vIm = &im[(i + k + half) * width];
+        for (unsigned j = 0; j < width; ++j) {
+          float vr = (vRe[j] * wr) - (vIm[j] * wi);
+          float vi = (vRe[j] * wi) + (vIm[j] * wr);
+          vRe[j] = uRe[j] - vr;
+          vIm[j] = uIm[j] - vi;
+          uRe[j] += vr;
+          uIm[j] += vi;
+        }
+      }
+    }
+  }
+}
+
+/// Transform an inX x inY real signal, zero padded to n x n, into a half
+/// spectrum of n rows of n / 2 + 1 elements.
+inline void forward2D(const float *in, unsigned inX, unsigned inY,
+                      unsigned n, float *spectrum) {
+  unsigned h = (n / 2) + 1;
+  float *re = spectrum;
+  float *im = spectrum + (n * h);
+  static thread_local std::vector<Complex> row;
+  row.resize(n);
+  // Transform pairs of real rows together as the real and imaginary parts of
+  // one complex row, then separate their spectra using their symmetry. Rows
+  // beyond the signal transform to zero.
+  for (unsigned y = 0; y < inY; y += 2) {
+    const float *a = &in[y * inX];
+    const float *b = y + 1 < inY ? &in[(y + 1) * inX] : nullptr;
+    for (unsigned x = 0; x < n; ++x) {
+      row[x] = Complex(x < inX ? a[x] : 0.0f,
+                       x < inX && b ? b[x] : 0.0f);
+    }
+    fft(row.data(), n, false);
+    for (unsigned u = 0; u < h; ++u) {
+      Complex z = row[u];
+      Complex zc = std::conj(row[(n - u) % n]);
+      re[(y * h) + u] = 0.5f * (z.real() + zc.real());
+      im[(y * h) + u] = 0.5f * (z.imag() + zc.imag());
+      if (b) {
+        // (z - zc) / 2i.
+        re[((y + 1) * h) + u] = 0.5f * (z.imag() - zc.imag());
+        im[((y + 1) * h) + u] = 0.5f * (zc.real() - z.real());
+      }
+    }
+  }
+  std::fill(&re[inY * h], &re[n * h], 0.0f);
+  std::fill(&im[inY * h], &im[n * h], 0.0f);
+  fftColumns(re, im, n, h, false);
+}
+
+/// Inverse transform a half spectrum and write the outX x outY window of the
+/// real signal that starts at (offsetX, offsetY).
+inline void inverse2D(const float *spectrum, unsigned n,
+                      unsigned offsetX, unsigned offsetY,
+                      unsigned outX, unsigned outY, float *out) {
+  unsigned h = (n / 2) + 1;
+  static thread_local std::vector<float> planes;
+  static thread_local std::vector<Complex> row;
+  planes.assign(spectrum, spectrum + (2 * n * h));
+  row.resize(n);
+  float *re = planes.data();
+  float *im = planes.data() + (n * h);
+  fftColumns(re, im, n, h, true);
+  // Each row is now the half spectrum of a real signal. Inverse transform
+  // pairs of them together as the real and imaginary parts of one signal.
+  float scale = 1.0f / (n * n);
+  for (unsigned y = 0; y < outY; y += 2) {
+    unsigned a = (offsetY + y) * h;
+    bool pair = y + 1 < outY;
+    unsigned b = pair ? a + h : a;
+    for (unsigned u = 0; u < h; ++u) {
+      // A + iB, and its mirror conj(A) + i conj(B).
+      Complex ca(re[a + u], im[a + u]);
+      Complex cb = pair ? Complex(re[b + u], im[b + u]) : Complex();
+      row[u] = Complex(ca.real() - cb.imag(), ca.imag() + cb.real());
+      if (u > 0 && u < n / 2) {
+        row[n - u] = Complex(ca.real() + cb.imag(), cb.real() - ca.imag());
+      }
+    }
+    fft(row.data(), n, true);
+    for (unsigned x = 0; x < outX; ++x) {
+      out[(y * outX) + x] = row[offsetX + x].real() * scale;
+      if (pair) {
+        out[((y + 1) * outX) + x] = row[offsetX + x].imag() * scale;
+      }
+    }
+  }
+}
+
+/// acc += a * b, or a * conj(b), element-wise over spectra of size elements.
+inline void multiplyAccumulate(const float *a, const float *b, bool conjugate,
+                               unsigned size, float *acc) {
+  const float *aRe = a, *aIm = a + size;
+  const float *bRe = b, *bIm = b + size;
+  float *accRe = acc, *accIm = acc + size;
+  float sign = conjugate ? -1.0f : 1.0f;
+  for (unsigned i = 0; i < size; ++i) {
+    float bi = sign * bIm[i];
+    accRe[i] += (aRe[i] * bRe[i]) - (aIm[i] * bi);
+    accIm[i] += (aRe[i] * bi) + (aIm[i] * bRe[i]);
+  }
+}
+
+} // End namespace fft.
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef _GEMM_H_
+#define _GEMM_H_
+
+#include <algorithm>
+#include "tbb/tbb.h"
+#include "Simd.hpp"
+#include "Tensor.hpp"
+
+///===--------------------------------------------------------------------===///
+/// Single-precision general matrix multiply.
+///
+/// Computes C = alpha * op(A) * op(B) + beta * C for row-major matrices, where
+/// op(A) is M x K, op(B) is K x N and C is M x N. Follows the usual
+/// Goto-style decomposition: C is partitioned into blocks that are processed
+/// in parallel, the K dimension is split into panels, the panels of A and B
+/// are packed into contiguous slivers of MR rows and NR columns (padding the
+/// edges with zeros), and a register-tiled micro-kernel, compiled for the
+/// instruction set of the CPU, accumulates each MR x NR tile of C.
+///===--------------------------------------------------------------------===///
+namespace gemm {
+
+// Micro-kernel tile: MR rows of A by NR columns of B.
+using simd::MR;
+using simd::NR;
+// Cache blocking of C and the K dimension.
+constexpr unsigned MC = 64;
+constexpr unsigned NC = 256;
+constexpr unsigned KC = 256;
+
+/// Pack an mc x kc block of op(A) into slivers of MR rows, each stored
+/// column by column.
+inline void packA(bool transA, const float *A, unsigned lda,
+                  unsigned i0, unsigned mc, unsigned p0, unsigned kc,
+                  float *packed) {
+  for (unsigned ir = 0; ir < mc; ir += MR) {
+    unsigned mr = std::min(MR, mc - ir);
+    for (unsigned p = 0; p < kc; ++p) {
+      for (unsigned i = 0; i < MR; ++i) {
+        unsigned row = i0 + ir + i;
+        unsigned col = p0 + p;
+        *packed++ = i >= mr ? 0.0f
+                            : transA ? A[(col * lda) + row]
+                                     : A[(row * lda) + col];
+      }
+    }
+  }
+}
+
+/// Pack a kc x nc block of op(B) into slivers of NR columns, each stored row
+/// by row.
+inline void packB(bool transB, const float *B, unsigned ldb,
+                  unsigned p0, unsigned kc, unsigned j0, unsigned nc,
+                  float *packed) {
+  for (unsigned jr = 0; jr < nc; jr += NR) {
+    unsigned nr = std::min(NR, nc - jr);
+    for (unsigned p = 0; p < kc; ++p) {
+      for (unsigned j = 0; j < NR; ++j) {
+        unsigned row = p0 + p;
+        unsigned col = j0 + jr + j;
+        *packed++ = j >= nr ? 0.0f
+                            : transB ? B[(col * ldb) + row]
+                                     : B[(row * ldb) + col];
+      }
+    }
+  }
+}
+
+/// C = alpha * op(A) * op(B) + beta * C.
+inline void sgemm(bool transA, bool transB,
+                  unsigned M, unsigned N, unsigned K,
+                  float alpha, const float *A, unsigned lda,
+                  const float *B, unsigned ldb,
+                  float beta, float *C, unsigned ldc) {
+  // Partition C into blocks of whole tiles.
+  unsigned rowTiles = (M + MR - 1) / MR;
+  unsigned colTiles = (N + NR - 1) / NR;
+  auto microKernel = simd::kernels().microKernel;
+  tbb::parallel_for(
+    tbb::blocked_range2d<unsigned>(0, rowTiles, MC / MR, 0, colTiles, NC / NR),
+    [=](const tbb::blocked_range2d<unsigned> &r) {
+      static thread_local Tensor packedA, packedB;
+      unsigned i0 = r.rows().begin() * MR;
+      unsigned mc = std::min(r.rows().end() * MR, M) - i0;
+      unsigned j0 = r.cols().begin() * NR;
+      unsigned nc = std::min(r.cols().end() * NR, N) - j0;
+      packedA.resize(r.rows().size() * MR * KC);
+      packedB.resize(r.cols().size() * NR * KC);
+      for (unsigned p0 = 0; p0 < K; p0 += KC) {
+        unsigned kc = std::min(KC, K - p0);
+        // Only the first panel scales the existing contents of C.
+        float panelBeta = p0 == 0 ? beta : 1.0f;
+        packA(transA, A, lda, i0, mc, p0, kc, packedA.data());
+        packB(transB, B, ldb, p0, kc, j0, nc, packedB.data());
+        for (unsigned jr = 0; jr < nc; jr += NR) {
+          for (unsigned ir = 0; ir < mc; ir += MR) {
+            microKernel(kc, &packedA[ir * kc], &packedB[jr * kc],
+                        alpha, panelBeta,
+                        &C[((i0 + ir) * ldc) + j0 + jr], ldc,
+                        std::min(MR, mc - ir), std::min(NR, nc - jr));
+          }
+        }
+      }
+    });
+}
+
+/// A batch of independent products C[i] = alpha * op(A[i]) * op(B[i]) +
+/// beta * C[i], where consecutive matrices of each operand are separated by
+/// the given strides.
+inline void sgemmBatched(unsigned count, bool transA, bool transB,
+                         unsigned M, unsigned N, unsigned K,
+                         float alpha, const float *A, unsigned strideA,
+                         unsigned lda,
+                         const float *B, unsigned strideB, unsigned ldb,
+                         float beta, float *C, unsigned strideC,
+                         unsigned ldc) {
+  tbb::parallel_for(0u, count, [=](unsigned i) {
+    sgemm(transA, transB, M, N, K,
+          alpha, &A[i * strideA], lda, &B[i * strideB], ldb,
+          beta, &C[i * strideC], ldc);
+  });
+}
+
+} // End namespace gemm.
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef _GZIP_H_
+#define _GZIP_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "MappedFile.hpp"
+
+///===--------------------------------------------------------------------===///
+/// Gzipped files.
+///
+/// A gzipped file is either inflated into memory in one go, sized by the
+/// length recorded at its end, or read sequentially through zlib's buffered
+/// reader, which also reads files that are not compressed.
+///===--------------------------------------------------------------------===///
+namespace gzip {
+
+// The most zlib is given at once, since its counts are 32 bits.
+constexpr uint64_t maxChunk = 1u << 30;
+
+inline bool isCompressed(const std::string &filename) {
+  return filename.size() > 3 &&
+         filename.compare(filename.size() - 3, 3, ".gz") == 0;
+}
+
+inline void check(bool condition, const char *filename, const char *reason) {
+  if (!condition) {
+    std::cout << "Invalid gzip file " << filename << ": " << reason << '\n';
+    std::exit(1);
+  }
+}
+
+/// Inflate a whole gzip file, of one or more members, into memory.
+inline std::vector<char> inflateFile(const char *filename) {
+  MappedFile file(filename);
+  auto in = reinterpret_cast<const uint8_t*>(file.getData());
+  uint64_t inSize = file.getSize();
+  check(inSize >= 18, filename, "truncated");
+  // The length of the last member, modulo 2^32, which is the length of the
+  // whole for a file of one member under 4 GB.
+  const uint8_t *footer = &in[inSize - 4];
+  uint32_t lastSize = footer[0] | (footer[1] << 8) | (footer[2] << 16) |
+                      (uint32_t(footer[3]) << 24);
+  std::vector<char> out(std::max<uint32_t>(lastSize, 1));
+  z_stream stream = {};
+  check(inflateInit2(&stream, 15 + 16) == Z_OK, filename, "zlib error");
+  uint64_t consumed = 0;
+  uint64_t produced = 0;
+  while (true) {
+    if (stream.avail_in == 0) {
+      stream.next_in = const_cast<Bytef*>(&in[consumed]);
+      stream.avail_in = std::min(maxChunk, inSize - consumed);
+      consumed += stream.avail_in;
+    }
+    if (produced == out.size()) {
+      out.resize(out.size() * 2);
+    }
+    uInt space = std::min(maxChunk, uint64_t(out.size() - produced));
+    stream.next_out = reinterpret_cast<Bytef*>(&out[produced]);
+    stream.avail_out = space;
+    int status = inflate(&stream, Z_NO_FLUSH);
+    produced += space - stream.avail_out;
+    if (status == Z_STREAM_END) {
+      if (stream.avail_in == 0 && consumed == inSize) {
+        break;
+      }
+      // Another member follows.
+      inflateReset(&stream);
+      continue;
+    }
+    check(status == Z_OK ||
+          (status == Z_BUF_ERROR &&
+           (stream.avail_in != 0 || consumed != inSize)),
+          filename, status == Z_BUF_ERROR ? "truncated" : "corrupt data");
+  }
+  inflateEnd(&stream);
+  out.resize(produced);
+  return out;
+}
+
+/// A file read from start to end, which is inflated if it is gzipped.
+class Reader {
+  gzFile file;
+
+public:
+  explicit Reader(const std::string &filename) {
+    file = gzopen(filename.c_str(), "rb");
+    if (!file) {
+      std::cout << "Error opening file " << filename << '\n';
+      std::exit(1);
+    }
+    gzbuffer(file, 1 << 20);
+  }
+
+  ~Reader() { gzclose(file); }
+
+  Reader(const Reader&) = delete;
+  Reader &operator=(const Reader&) = delete;
+
+  /// Read the next size bytes, or return false if the file ends first.
+  bool read(void *data, uint64_t size) {
+    auto bytes = static_cast<char*>(data);
+    while (size) {
+      unsigned chunk = std::min(maxChunk, size);
+      if (gzread(file, bytes, chunk) != int(chunk)) {
+        return false;
+      }
+      bytes += chunk;
+      size -= chunk;
+    }
+    return true;
+  }
+};
+
+} // End namespace gzip.
+
+#endif
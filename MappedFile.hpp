@@ -0,0 +1,46 @@
+#ifndef _MAPPED_FILE_H_
+#define _MAPPED_FILE_H_
+
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// A read-only mapping of a whole file. Its pages are read on first use, and
+/// the kernel is asked to read ahead since the whole file will be used.
+class MappedFile {
+  void *data;
+  size_t size;
+
+public:
+  explicit MappedFile(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0) {
+      std::cout << "Error opening file " << filename << '\n';
+      std::exit(1);
+    }
+    size = status.st_size;
+    data = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED) {
+      std::cout << "Error mapping file " << filename << '\n';
+      std::exit(1);
+    }
+    madvise(data, size, MADV_WILLNEED);
+  }
+
+  ~MappedFile() { munmap(data, size); }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile &operator=(const MappedFile&) = delete;
+
+  const char *getData() const { return static_cast<const char*>(data); }
+  size_t getSize() const { return size; }
+};
+
+#endif
@@ -0,0 +1,230 @@
+#ifndef _MODEL_H_
+#define _MODEL_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <initializer_list>
+#include <iostream>
+#include <vector>
+#include <boost/align/aligned_allocator.hpp>
+
+///===--------------------------------------------------------------------===///
+/// Binary model files.
+///
+/// A model is a header, then a descriptor of each layer, then the weights and
+/// bias of each layer. Each of those parameter blobs starts on a 64-byte
+/// boundary, so a file that is mapped into memory can be used in place, with
+/// no copies. Values are stored in the byte order of the machine that wrote
+/// them; the magic number does not match on a machine of the other order.
+///===--------------------------------------------------------------------===///
+namespace model {
+
+constexpr uint32_t magicNumber = 0x4c444f4d; // "MODL"
+constexpr uint32_t version = 1;
+constexpr unsigned alignment = 64;
+
+enum class LayerKind : uint32_t {
+  FullyConnected,
+  Conv,
+  MaxPool
+};
+
+/// The non linearity applied by a layer.
+enum class Activation : uint32_t {
+  None,
+  Sigmoid,
+  ReLU,
+  SoftMax,
+  Other // Cannot be saved.
+};
+
+struct Header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t inputX;
+  uint32_t inputY;
+  uint32_t numLayers;
+  uint32_t reserved;
+  uint64_t size; // Of the whole model, in bytes.
+};
+
+/// The shape of a layer and the byte offsets of its parameters, which are
+/// laid out as in the layer. The dimensions of each kind of layer are:
+///   FullyConnected: layerSize, prevSize
+///   Conv:           kernelX, kernelY, inputX, inputY, inputZ, numFMs
+///   MaxPool:        poolX, poolY, inputX, inputY, inputZ
+struct LayerDescriptor {
+  LayerKind kind;
+  Activation activation;
+  uint32_t dims[6];
+  uint64_t weightsOffset;
+  uint64_t numWeights;
+  uint64_t biasOffset;
+  uint64_t numBias;
+};
+
+static_assert(sizeof(Header) % 8 == 0 && sizeof(LayerDescriptor) % 8 == 0,
+              "Model structures should not need padding");
+
+/// Whether two layers have the same kind, activation and dimensions.
+inline bool sameShape(const LayerDescriptor &a, const LayerDescriptor &b) {
+  return a.kind == b.kind && a.activation == b.activation &&
+         std::equal(a.dims, a.dims + 6, b.dims) &&
+         a.numWeights == b.numWeights && a.numBias == b.numBias;
+}
+
+/// A model held in memory.
+using Buffer =
+    std::vector<char, boost::alignment::aligned_allocator<char, alignment>>;
+
+inline uint64_t alignOffset(uint64_t offset) {
+  return ((offset + alignment - 1) / alignment) * alignment;
+}
+
+/// Collects the layers of a network and lays them out as a model.
+class Writer {
+  struct Entry {
+    LayerDescriptor descriptor;
+    const float *weights;
+    const float *bias;
+  };
+  uint32_t inputX, inputY;
+  std::vector<Entry> layers;
+
+public:
+  Writer(unsigned inputX, unsigned inputY) : inputX(inputX), inputY(inputY) {}
+
+  /// Add a layer. Its parameters are read when the model is laid out.
+  void addLayer(LayerKind kind, Activation activation,
+                std::initializer_list<unsigned> dims,
+                const float *weights, uint64_t numWeights,
+                const float *bias, uint64_t numBias) {
+    if (activation == Activation::Other) {
+      std::cout << "Error: cannot save a layer with a custom activation\n";
+      std::exit(1);
+    }
+    Entry entry = {};
+    entry.descriptor.kind = kind;
+    entry.descriptor.activation = activation;
+    std::copy(dims.begin(), dims.end(), entry.descriptor.dims);
+    entry.descriptor.numWeights = numWeights;
+    entry.descriptor.numBias = numBias;
+    entry.weights = weights;
+    entry.bias = bias;
+    layers.push_back(entry);
+  }
+
+  Buffer getBuffer() const {
+    // Place the parameters after the descriptors.
+    std::vector<LayerDescriptor> descriptors;
+    uint64_t offset = sizeof(Header) +
+                      (layers.size() * sizeof(LayerDescriptor));
+    for (auto &layer : layers) {
+      LayerDescriptor descriptor = layer.descriptor;
+      descriptor.weightsOffset = offset = alignOffset(offset);
+      offset += descriptor.numWeights * sizeof(float);
+      descriptor.biasOffset = offset = alignOffset(offset);
+      offset += descriptor.numBias * sizeof(float);
+      descriptors.push_back(descriptor);
+    }
+    Header header = {};
+    header.magic = magicNumber;
+    header.version = version;
+    header.inputX = inputX;
+    header.inputY = inputY;
+    header.numLayers = layers.size();
+    header.size = offset;
+    Buffer buffer(offset, 0);
+    std::copy_n(reinterpret_cast<const char*>(&header), sizeof(Header),
+                buffer.data());
+    std::copy_n(reinterpret_cast<const char*>(descriptors.data()),
+                descriptors.size() * sizeof(LayerDescriptor),
+                &buffer[sizeof(Header)]);
+    for (unsigned i = 0; i < layers.size(); ++i) {
+      const LayerDescriptor &descriptor = descriptors[i];
+      std::copy_n(layers[i].weights, descriptor.numWeights,
+                  reinterpret_cast<float*>(&buffer[descriptor.weightsOffset]));
+      std::copy_n(layers[i].bias, descriptor.numBias,
+                  reinterpret_cast<float*>(&buffer[descriptor.biasOffset]));
+    }
+    return buffer;
+  }
+
+  void write(const char *filename) const {
+    Buffer buffer = getBuffer();
+    std::ofstream file;
+    file.open(filename, std::ios::binary | std::ios::out | std::ios::trunc);
+    if (!file.good()) {
+      std::cout << "Error opening file " << filename << '\n';
+      std::exit(1);
+    }
+    file.write(buffer.data(), buffer.size());
+    if (!file.good()) {
+      std::cout << "Error writing file " << filename << '\n';
+      std::exit(1);
+    }
+    file.close();
+  }
+};
+
+/// A view of a model in memory, checked to be one this version can read.
+class Reader {
+  const char *data;
+
+  static void check(bool condition, const char *name, const char *reason) {
+    if (!condition) {
+      std::cout << "Invalid model " << name << ": " << reason << '\n';
+      std::exit(1);
+    }
+  }
+
+  static bool inBounds(uint64_t offset, uint64_t count, uint64_t size) {
+    return offset <= size && count <= (size - offset) / sizeof(float);
+  }
+
+public:
+  /// Check the size bytes at data, which must be aligned, and name the model
+  /// as name in any errors.
+  Reader(const char *data, uint64_t size, const char *name) : data(data) {
+    check(size >= sizeof(Header), name, "truncated header");
+    const Header &header = getHeader();
+    check(header.magic == magicNumber, name, "bad magic number");
+    check(header.version == version, name, "unsupported version");
+    check(header.size == size, name, "size mismatch");
+    check(header.numLayers > 0 &&
+          header.numLayers <= (size - sizeof(Header)) / sizeof(LayerDescriptor),
+          name, "bad layer count");
+    for (unsigned i = 0; i < header.numLayers; ++i) {
+      const LayerDescriptor &layer = getLayer(i);
+      check(layer.kind <= LayerKind::MaxPool &&
+            layer.activation < Activation::Other, name, "bad layer");
+      check(layer.weightsOffset % alignment == 0 &&
+            layer.biasOffset % alignment == 0 &&
+            inBounds(layer.weightsOffset, layer.numWeights, size) &&
+            inBounds(layer.biasOffset, layer.numBias, size),
+            name, "parameters out of bounds");
+    }
+  }
+
+  const Header &getHeader() const {
+    return *reinterpret_cast<const Header*>(data);
+  }
+
+  const LayerDescriptor &getLayer(unsigned i) const {
+    return reinterpret_cast<const LayerDescriptor*>(data + sizeof(Header))[i];
+  }
+
+  const float *getWeights(unsigned i) const {
+    return reinterpret_cast<const float*>(data + getLayer(i).weightsOffset);
+  }
+
+  const float *getBias(unsigned i) const {
+    return reinterpret_cast<const float*>(data + getLayer(i).biasOffset);
+  }
+};
+
+} // End namespace model.
+
+#endif
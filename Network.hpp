@@ -1,7 +1,6 @@
 #ifndef _NETWORK_H_
 #define _NETWORK_H_
 
-#include <boost/multi_array.hpp>
 #include <algorithm>
 #include <cassert>
 #include <chrono>
@@ -11,14 +10,29 @@
 #include <ctime>
 #include <limits>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <numeric>
 #include <memory>
 #include <random>
+#include <sstream>
+#include <tuple>
+#include <type_traits>
 #include <vector>
 #include "tbb/tbb.h"
+#include "Augment.hpp"
+#include "Checkpoint.hpp"
+#include "Conv.hpp"
 #include "Data.hpp"
+#include "Fft.hpp"
+#include "Gemm.hpp"
+#include "MappedFile.hpp"
+#include "Model.hpp"
 #include "Params.hpp"
+#include "Prefetch.hpp"
+#include "Replicas.hpp"
+#include "Tensor.hpp"
+#include "Transport.hpp"
 
 #ifdef NDEBUG
 #define UNREACHABLE() __builtin_unreachable()
@@ -29,7 +43,10 @@
 /// Sigmoid activation function.
 struct Sigmoid {
   static float compute(float z) { return 1.0f / (1.0f + std::exp(-z)); }
-  static float deriv(float z) { return compute(z) * (1.0f - compute(z)); }
+  static float deriv(float z) {
+    float a = compute(z);
+    return a * (1.0f - a);
+  }
 };
 
 /// Rectified linear activation function.
@@ -38,6 +55,83 @@ struct ReLU {
   static float deriv(float z) { return z > 0.0f ? 1.0f : 0.0f; }
 };
 
+///===--------------------------------------------------------------------===///
+/// Batch forms of the activation and cost functions, applied to whole layer
+/// buffers. The activation and cost functions of the library have vectorised
+/// versions, and any others are applied element by element.
+///===--------------------------------------------------------------------===///
+
+/// Apply an activation function to n weighted inputs.
+template<float (*activationFn)(float)>
+inline void applyActivation(const float *weightedInputs, float *activations,
+                            unsigned n) {
+  for (unsigned i = 0; i < n; ++i) {
+    activations[i] = activationFn(weightedInputs[i]);
+  }
+}
+
+template<>
+inline void applyActivation<Sigmoid::compute>(const float *weightedInputs,
+                                              float *activations, unsigned n) {
+  simd::kernels().sigmoid(weightedInputs, activations, n);
+}
+
+template<>
+inline void applyActivation<ReLU::compute>(const float *weightedInputs,
+                                           float *activations, unsigned n) {
+  simd::kernels().relu(weightedInputs, activations, n);
+}
+
+/// Normalise the exponentials of the n weighted inputs of one image.
+inline void applySoftMax(const float *weightedInputs, float *activations,
+                         unsigned n) {
+  simd::kernels().softmax(weightedInputs, activations, n);
+}
+
+/// The identifier of an activation function in a saved model.
+template<float (*activationFn)(float)>
+struct ActivationOf {
+  static constexpr model::Activation value = model::Activation::Other;
+};
+
+template<>
+struct ActivationOf<Sigmoid::compute> {
+  static constexpr model::Activation value = model::Activation::Sigmoid;
+};
+
+template<>
+struct ActivationOf<ReLU::compute> {
+  static constexpr model::Activation value = model::Activation::ReLU;
+};
+
+/// Multiply n backwards errors by the activation derivative of the weighted
+/// inputs. The derivatives of the library's functions are computed from the
+/// activations of the forward pass.
+template<float (*activationFnDeriv)(float)>
+inline void applyActivationDeriv(const float *bwdError,
+                                 const float *weightedInputs,
+                                 const float *, float *errors, unsigned n) {
+  for (unsigned i = 0; i < n; ++i) {
+    errors[i] = bwdError[i] * activationFnDeriv(weightedInputs[i]);
+  }
+}
+
+template<>
+inline void applyActivationDeriv<Sigmoid::deriv>(const float *bwdError,
+                                                 const float *,
+                                                 const float *activations,
+                                                 float *errors, unsigned n) {
+  simd::kernels().sigmoidBackward(bwdError, activations, errors, n);
+}
+
+template<>
+inline void applyActivationDeriv<ReLU::deriv>(const float *bwdError,
+                                              const float *,
+                                              const float *activations,
+                                              float *errors, unsigned n) {
+  simd::kernels().reluBackward(bwdError, activations, errors, n);
+}
+
 template<float (*activationFnDeriv)(float)>
 struct QuadraticCost {
   static float compute(float activation, float label) {
@@ -58,6 +152,22 @@ struct CrossEntropyCost {
   }
 };
 
+/// The total cost of n output activations against a one-hot label.
+template<float (*costFn)(float, float)>
+inline float applyCost(const float *activations, unsigned label, unsigned n) {
+  float cost = 0.0f;
+  for (unsigned j = 0; j < n; ++j) {
+    cost += costFn(activations[j], label == j ? 1.0f : 0.0f);
+  }
+  return cost;
+}
+
+template<>
+inline float applyCost<CrossEntropyCost::compute>(const float *activations,
+                                                  unsigned label, unsigned n) {
+  return simd::kernels().crossEntropy(activations, label, n);
+}
+
 /// Helper functions for conversions between 1D and 3D coordinates.
 static inline unsigned getX(unsigned index, unsigned dimX) {
   return index % dimX;
@@ -73,520 +183,579 @@ static inline unsigned getIndex(unsigned x, unsigned y, unsigned z,
   return ((dimX * dimY) * z) + (dimX * y) + x;
 }
 
-template<unsigned mbSize>
-struct Neuron {
-  /// Each neuron in the network can be indexed by a one- or three-dimensional
-  /// coordinate, and stores a weighted input, an activation and an error.
-  /// x and y are coordinates in the 2D image plane, z indexes depth.
-  unsigned index, x, y, z;
-  float weightedInputs[mbSize];
-  float activations[mbSize];
-  float errors[mbSize];
-  Neuron(unsigned index) : index(index) {}
-  Neuron(unsigned x, unsigned y, unsigned z) : x(x), y(y), z(z) {}
+/// Run fn(begin, end) in parallel over blocks of the iterations [0, n), each
+/// of which costs the given work, so that each task does at least grainSize
+/// work.
+template <typename Fn>
+inline void parallelFor(unsigned n, unsigned work, unsigned grainSize,
+                        const Fn &fn) {
+  unsigned grain = std::max(1u, grainSize / std::max(1u, work));
+  tbb::parallel_for(tbb::blocked_range<unsigned>(0, n, grain),
+                    [&fn](const tbb::blocked_range<unsigned> &r) {
+                      fn(r.begin(), r.end());
+                    });
+}
+
+/// Sum the vectors of size elements accumulated by fn(begin, end, sum) over
+/// blocks of the iterations [0, n), each of which costs the given work. The
+/// blocks, and the order in which their sums are combined, depend only on
+/// the grain size, so the result is the same for any number of threads.
+template <typename Fn>
+inline Tensor parallelSum(unsigned n, unsigned work, unsigned grainSize,
+                          unsigned size, const Fn &fn) {
+  unsigned grain = std::max(1u, grainSize / std::max(1u, work));
+  return tbb::parallel_deterministic_reduce(
+    tbb::blocked_range<unsigned>(0, n, grain), Tensor(size, 0.0f),
+    [&fn](const tbb::blocked_range<unsigned> &r, Tensor sum) {
+      fn(r.begin(), r.end(), sum.data());
+      return sum;
+    },
+    [size](Tensor a, const Tensor &b) {
+      simd::kernels().axpy(1.0f, b.data(), a.data(), size);
+      return a;
+    });
+}
+
+///===--------------------------------------------------------------------===///
+/// Inference stages.
+///
+/// A trained network is frozen into stages that read their parameters from
+/// a model held by the inference network. Each stage computes the
+/// activations of a batch of any number of images from those of the previous
+/// stage, both laid out [image][z][y][x]. The bias is added as part of the
+/// weighted input product and the non linearity is applied in place, so no
+/// weighted inputs are kept.
+///===--------------------------------------------------------------------===///
+
+/// A batch form of a non linearity, applied to n values of one image.
+typedef void (*BatchActivationFn)(const float *weightedInputs,
+                                  float *activations, unsigned n);
+
+inline BatchActivationFn getBatchActivationFn(model::Activation activation) {
+  switch (activation) {
+  case model::Activation::Sigmoid: return applyActivation<Sigmoid::compute>;
+  case model::Activation::ReLU:    return applyActivation<ReLU::compute>;
+  case model::Activation::SoftMax: return applySoftMax;
+  default:                         UNREACHABLE();
+  }
+}
+
+class InferenceStage {
+public:
+  virtual ~InferenceStage() {}
+  /// The number of activations of each image.
+  virtual unsigned size() const = 0;
+  /// Compute the activations out of n images from their inputs in.
+  virtual void feedForward(const float *in, float *out, unsigned n) const = 0;
+};
+
+/// A fully-connected or softmax layer.
+class FullyConnectedStage : public InferenceStage {
+  unsigned layerSize;
+  unsigned prevSize;
+  unsigned grainSize;
+  const float *weights; // [neuron][input]
+  const float *bias;
+  BatchActivationFn activate;
+
+public:
+  FullyConnectedStage(unsigned layerSize, unsigned prevSize,
+                      const float *weights, const float *bias,
+                      BatchActivationFn activate, unsigned grainSize) :
+      layerSize(layerSize), prevSize(prevSize), grainSize(grainSize),
+      weights(weights), bias(bias), activate(activate) {}
+
+  unsigned size() const override { return layerSize; }
+
+  void feedForward(const float *in, float *out, unsigned n) const override {
+    // Start each image from the bias and accumulate the product onto it.
+    for (unsigned i = 0; i < n; ++i) {
+      std::copy(bias, bias + layerSize, &out[i * layerSize]);
+    }
+    gemm::sgemm(false, true, n, layerSize, prevSize,
+                1.0f, in, prevSize, weights, prevSize,
+                1.0f, out, layerSize);
+    parallelFor(n, layerSize, grainSize, [=](unsigned begin, unsigned end) {
+      for (unsigned i = begin; i < end; ++i) {
+        activate(&out[i * layerSize], &out[i * layerSize], layerSize);
+      }
+    });
+  }
+};
+
+/// A convolutional layer, computed by lowering groups of images onto a column
+/// matrix.
+class ConvStage : public InferenceStage {
+  // The minimum number of columns of each product, so that it is wide enough
+  // for the multiply to run efficiently.
+  static constexpr unsigned minCols = 512;
+  unsigned kernelX, kernelY;
+  unsigned inputX, inputY, inputZ;
+  unsigned numFMs;
+  unsigned outputX, outputY;
+  const float *weights; // [fm][z][y][x]
+  const float *bias;
+  BatchActivationFn activate;
+
+public:
+  ConvStage(unsigned kernelX, unsigned kernelY,
+            unsigned inputX, unsigned inputY, unsigned inputZ,
+            unsigned numFMs, const float *weights, const float *bias,
+            BatchActivationFn activate) :
+      kernelX(kernelX), kernelY(kernelY),
+      inputX(inputX), inputY(inputY), inputZ(inputZ), numFMs(numFMs),
+      outputX(inputX - kernelX + 1), outputY(inputY - kernelY + 1),
+      weights(weights), bias(bias), activate(activate) {}
+
+  unsigned size() const override { return outputX * outputY * numFMs; }
+
+  void feedForward(const float *in, float *out, unsigned n) const override {
+    unsigned kernelSize = kernelX * kernelY * inputZ;
+    unsigned outputSize = outputX * outputY;
+    unsigned groupSize = (minCols + outputSize - 1) / outputSize;
+    unsigned numGroups = (n + groupSize - 1) / groupSize;
+    tbb::parallel_for(0u, numGroups, [=](unsigned group) {
+      static thread_local Tensor cols, fmOutputs;
+      unsigned first = group * groupSize;
+      unsigned count = std::min(groupSize, n - first);
+      unsigned numCols = count * outputSize;
+      cols.resize(kernelSize * numCols);
+      fmOutputs.resize(numFMs * numCols);
+      // Each row of the product, [fm][image][y][x], starts from the bias.
+      for (unsigned fm = 0; fm < numFMs; ++fm) {
+        std::fill(&fmOutputs[fm * numCols], &fmOutputs[(fm + 1) * numCols],
+                  bias[fm]);
+      }
+      // Keep this thread from lowering another group into the same buffers
+      // while it waits inside the parallel loops of the product.
+      tbb::this_task_arena::isolate([&] {
+        conv::im2col(&in[first * inputX * inputY * inputZ], count,
+                     inputX, inputY, inputZ, kernelX, kernelY, cols.data());
+        gemm::sgemm(false, false, numFMs, numCols, kernelSize,
+                    1.0f, weights, kernelSize, cols.data(), numCols,
+                    1.0f, fmOutputs.data(), numCols);
+      });
+      // Apply the non linearity while reordering to [image][fm][y][x].
+      for (unsigned i = 0; i < count; ++i) {
+        for (unsigned fm = 0; fm < numFMs; ++fm) {
+          activate(&fmOutputs[(fm * numCols) + (i * outputSize)],
+                   &out[((first + i) * size()) + (fm * outputSize)],
+                   outputSize);
+        }
+      }
+    });
+  }
+};
+
+/// A max-pooling layer.
+class MaxPoolStage : public InferenceStage {
+  unsigned poolX, poolY;
+  unsigned inputX, inputY, inputZ;
+  unsigned grainSize;
+
+public:
+  MaxPoolStage(unsigned poolX, unsigned poolY,
+               unsigned inputX, unsigned inputY, unsigned inputZ,
+               unsigned grainSize) :
+      poolX(poolX), poolY(poolY),
+      inputX(inputX), inputY(inputY), inputZ(inputZ), grainSize(grainSize) {}
+
+  unsigned size() const override {
+    return (inputX / poolX) * (inputY / poolY) * inputZ;
+  }
+
+  void feedForward(const float *in, float *out, unsigned n) const override {
+    // Rows of the output are numbered over the images and channels.
+    unsigned outputX = inputX / poolX;
+    unsigned outputY = inputY / poolY;
+    parallelFor(n * inputZ * outputY, poolX * poolY * outputX, grainSize,
+                [=](unsigned begin, unsigned end) {
+      for (unsigned row = begin; row < end; ++row) {
+        unsigned plane = row / outputY;
+        unsigned y = row % outputY;
+        simd::kernels().maxPool(
+            &in[(plane * inputX * inputY) + (y * poolY * inputX)], inputX,
+            poolX, poolY, &out[row * outputX], outputX);
+      }
+    });
+  }
 };
 
-template <unsigned mbSize>
-struct Layer {
+///===--------------------------------------------------------------------===///
+/// Layer base.
+///
+/// Each neuron in the network can be indexed by a one- or three-dimensional
+/// coordinate, and stores a weighted input, an activation and an error. x and
+/// y are coordinates in the 2D image plane, z indexes depth (feature maps). The
+/// state for a whole layer is held in three contiguous, aligned buffers indexed
+/// [mb][z][y][x] so that the kernels stream through memory linearly. A 1D
+/// layer is the degenerate case with dimY = dimZ = 1. The forward and backward
+/// passes each operate on every item of the minibatch at once. The number of
+/// items is set at run time, by setBatchSize(), which sizes the buffers of the
+/// layer for it.
+///===--------------------------------------------------------------------===///
+class Layer {
+protected:
+  unsigned dimX, dimY, dimZ;
+  unsigned mbSize;       // The number of images in the minibatch.
+  Tensor weightedInputs; // [mb][z][y][x]
+  Tensor activations;    // [mb][z][y][x]
+  Tensor errors;         // [mb][z][y][x]
+
+public:
+  Layer(unsigned dimX, unsigned dimY, unsigned dimZ) :
+      dimX(dimX), dimY(dimY), dimZ(dimZ), mbSize(0) {}
+  /// Size the state of the layer for minibatches of mbSize_ images. The
+  /// buffers keep their capacity, so going back to an earlier size does not
+  /// allocate.
+  virtual void setBatchSize(unsigned mbSize_) {
+    mbSize = mbSize_;
+    weightedInputs.resize(mbSize * size());
+    activations.resize(mbSize * size());
+    errors.resize(mbSize * size());
+  }
+  unsigned getBatchSize() const { return mbSize; }
   virtual void initialiseDefaultWeights(std::default_random_engine&) = 0;
-  virtual void feedForward(unsigned mb) = 0;
-  virtual void calcBwdError(unsigned mb) = 0;
-  virtual void backPropogate(unsigned mb) = 0;
-  virtual void endBatch(unsigned numTrainingImages) = 0;
-  virtual void setInputs(Layer<mbSize> *layer) = 0;
-  virtual void setOutputs(Layer<mbSize> *layer) = 0;
-  virtual float getBwdError(unsigned index, unsigned mb) = 0;
-  virtual float getBwdError(unsigned x, unsigned y, unsigned z, unsigned mb) = 0;
-  virtual Neuron<mbSize> &getNeuron(unsigned index) = 0;
-  virtual Neuron<mbSize> &getNeuron(unsigned x, unsigned y, unsigned z) = 0;
-  virtual unsigned getNumDims() = 0;
-  virtual unsigned getDim(unsigned i) = 0;
-  virtual unsigned size() = 0;
+  virtual void feedForward() = 0;
+  virtual void calcBwdError() = 0;
+  virtual void backPropogate() = 0;
+  /// Add the gradients of the minibatch to those kept for the next update.
+  virtual void accumulateGradients() = 0;
+  /// Update the parameters with the gradients kept, averaged over the
+  /// numImages images they cover, and clear them.
+  virtual void applyGradients(float learningRate, unsigned numImages,
+                              unsigned numTrainingImages) = 0;
+  /// Update the parameters with the gradients of the minibatch and any kept
+  /// from earlier ones, averaged over the numImages images they cover.
+  virtual void endBatch(float learningRate, unsigned numImages,
+                        unsigned numTrainingImages) = 0;
+  /// The gradients kept for the next update, of the weights then the biases,
+  /// or null for a layer without parameters.
+  virtual Tensor *getGradients() { return nullptr; }
+  virtual void setInputs(Layer *layer) = 0;
+  virtual void setOutputs(Layer *layer) = 0;
+  /// A copy of the layer, with its parameters and state, for a copy of the
+  /// network to connect to its own layers.
+  virtual Layer *clone() const = 0;
+  /// Add the shape and parameters of the layer to a model.
+  virtual void save(model::Writer &writer) const = 0;
+  /// Set the parameters of the layer from a model with the same shape.
+  virtual void load(const float *weights, const float *bias) = 0;
+  /// The l+1 component of the error for each neuron in the previous layer,
+  /// laid out in the same order as the previous layer's activations.
+  virtual const float *getBwdErrors(unsigned mb) = 0;
+  float *getWeightedInputs(unsigned mb) {
+    return &weightedInputs[mb * size()];
+  }
+  float *getActivations(unsigned mb) { return &activations[mb * size()]; }
+  float *getErrors(unsigned mb) { return &errors[mb * size()]; }
+  unsigned getDim(unsigned i) {
+    assert(i <= 2 && "Dimension out of range.");
+    return i == 0 ? dimX : i == 1 ? dimY : dimZ;
+  }
+  unsigned size() { return dimX * dimY * dimZ; }
 };
 
 ///===--------------------------------------------------------------------===///
 /// Input layer.
 ///===--------------------------------------------------------------------===///
-template <unsigned mbSize,
-          unsigned imageX,
+template <unsigned imageX,
           unsigned imageY>
-class InputLayer : public Layer<mbSize> {
-  // x, y, z dimensions of input image.
-  boost::multi_array<Neuron<mbSize>*, 3> neurons;
-
+class InputLayer : public Layer {
 public:
-  InputLayer() :
-    neurons(boost::extents[imageX][imageY][1]) {
-    for (unsigned x = 0; x < imageX; ++x) {
-      for (unsigned y = 0; y < imageY; ++y) {
-        neurons[x][y][0] = new Neuron<mbSize>(x, y, 0);
-      }
-    }
-  }
-  void setImage(Image &image, unsigned mb) {
-    assert(image.size() == neurons.num_elements() && "invalid image size");
-    for (unsigned i = 0; i < image.size(); ++i) {
-      neurons[i % imageX][i / imageX][0]->activations[mb] = image[i];
-    }
+  InputLayer() : Layer(imageX, imageY, 1) {}
+  void setImage(const Image &image, unsigned mb) {
+    assert(image.size() == this->size() && "invalid image size");
+    image.copyTo(this->getActivations(mb));
+  }
+  /// Exchange the activations with a staged minibatch of images, without
+  /// copying them.
+  void swapImages(Tensor &images) {
+    assert(images.size() == this->activations.size() &&
+           "invalid minibatch size");
+    std::swap(this->activations, images);
   }
   void initialiseDefaultWeights(std::default_random_engine&) override {
     UNREACHABLE();
   }
-  virtual void calcBwdError(unsigned) override {
+  virtual void calcBwdError() override {
+    UNREACHABLE();
+  }
+  void feedForward() override {
+    UNREACHABLE();
+  }
+  void backPropogate() override {
     UNREACHABLE();
   }
-  void feedForward(unsigned) override {
+  void accumulateGradients() override {
     UNREACHABLE();
   }
-  void backPropogate(unsigned) override {
+  void applyGradients(float, unsigned, unsigned) override {
     UNREACHABLE();
   }
-  void endBatch(unsigned) override {
+  void endBatch(float, unsigned, unsigned) override {
     UNREACHABLE();
   }
-  void setInputs(Layer<mbSize>*) override {
+  void setInputs(Layer*) override {
     UNREACHABLE();
   }
-  void setOutputs(Layer<mbSize>*) override {
+  void setOutputs(Layer*) override {
     UNREACHABLE();
   }
-  float getBwdError(unsigned, unsigned) override {
+  Layer *clone() const override {
     UNREACHABLE();
   }
-  float getBwdError(unsigned, unsigned, unsigned, unsigned) override {
+  void save(model::Writer&) const override {
     UNREACHABLE();
   }
-  Neuron<mbSize> &getNeuron(unsigned i) override {
-    assert(i < neurons.num_elements() && "Neuron index out of range.");
-    return *neurons[i % imageX][i / imageX][0];
+  void load(const float*, const float*) override {
+    UNREACHABLE();
   }
-  Neuron<mbSize> &getNeuron(unsigned x, unsigned y, unsigned z) override {
-    assert(z == 0 && "Input image has depth 1");
-    return *neurons[x][y][z];
+  const float *getBwdErrors(unsigned) override {
+    UNREACHABLE();
   }
-  unsigned getNumDims() override { return neurons.num_dimensions(); }
-  unsigned getDim(unsigned i) override { return neurons.shape()[i]; }
-  unsigned size() override { return neurons.num_elements(); }
 };
 
 ///===--------------------------------------------------------------------===///
-/// Fully-connected neuron.
+/// Fully-connected layer.
 ///===--------------------------------------------------------------------===///
-template <unsigned mbSize,
+template <unsigned layerSize,
+          unsigned prevSize,
           float (*activationFn)(float) = nullptr,
           float (*activationFnDeriv)(float) = nullptr>
-class FullyConnectedNeuron : public Neuron<mbSize> {
+class FullyConnectedLayer : public Layer {
 protected:
-  float learningRate;
   float lambda;
-  Layer<mbSize> *inputs;
-  Layer<mbSize> *outputs;
-  std::vector<float> weights;
-  float bias;
-
-public:
-  FullyConnectedNeuron(unsigned index, float learningRate, float lambda) :
-    Neuron<mbSize>(index),
-    learningRate(learningRate), lambda(lambda),
-    inputs(nullptr), outputs(nullptr) {}
-
-  void initialiseDefaultWeights(std::default_random_engine &gen) {
-    // Initialise all weights with random values from normal distribution with
-    // mean 0 and stdandard deviation 1, divided by the square root of the
-    // number of input connections.
-    std::normal_distribution<float> distribution(0, 1.0f);
-    for (unsigned i = 0; i < inputs->size(); ++i) {
-      float weight = distribution(gen) / std::sqrt(inputs->size());
-      weights.push_back(weight);
-    }
-    bias = distribution(gen);
-  }
-
-  void feedForward(unsigned mb) {
-    float weightedInput = 0.0f;
-    for (unsigned i = 0; i < inputs->size(); ++i) {
-      weightedInput += inputs->getNeuron(i).activations[mb] * weights[i];
-    }
-    weightedInput += bias;
-    this->weightedInputs[mb] = weightedInput;
-    this->activations[mb] = activationFn(weightedInput);
-  }
-
-  void backPropogate(unsigned mb) {
-    // Get the weight-error sum component from the next layer, then multiply by
-    // the sigmoid derivative to get the error for this neuron.
-    float error = outputs->getBwdError(this->index, mb);
-    error *= activationFnDeriv(this->weightedInputs[mb]);
-    this->errors[mb] = error;
-  }
-
-  void endBatch(unsigned numTrainingImages) {
-    // For each weight.
-    for (unsigned i = 0; i < inputs->size(); ++i) {
-      float weightDelta = 0.0f;
-      // For each batch element, average input activation x error (rate of
-      // change of cost w.r.t. weight) and multiply by learning rate.
-      // Note that FC layers can only be followed by FC layers.
-      for (unsigned j = 0; j < mbSize; ++j) {
-        weightDelta += inputs->getNeuron(i).activations[j] * this->errors[j];
-      }
-      weightDelta *= learningRate / mbSize;
-      float reg = 1.0f - (learningRate * (lambda / numTrainingImages));
-      weights[i] *= reg; // Regularisation term.
-      weights[i] -= weightDelta;
-    }
-    // For each batch element, average the errors (error is equal to rate of
-    // change of cost w.r.t. bias) and multiply by learning rate.
-    float biasDelta = 0.0f;
-    for (unsigned j = 0; j < mbSize; ++j) {
-      biasDelta += this->errors[j];
+  unsigned grainSize;
+  Layer *inputs;
+  Layer *outputs;
+  Tensor weights;   // [neuron][input]
+  Tensor bias;      // [neuron]
+  Tensor bwdErrors; // [mb][input]
+  // Gradients summed over the minibatches since the last update, if any.
+  bool accumulated;
+  Tensor gradients; // [neuron][input], then [neuron]
+
+  /// Calculate the weighted input of each neuron for the whole minibatch as
+  /// the matrix product X.W^T, then add the biases.
+  void computeWeightedInputs() {
+    gemm::sgemm(false, true, mbSize, layerSize, prevSize,
+                1.0f, inputs->getActivations(0), prevSize,
+                weights.data(), prevSize,
+                0.0f, this->getWeightedInputs(0), layerSize);
+    for (unsigned mb = 0; mb < mbSize; ++mb) {
+      simd::kernels().axpy(1.0f, bias.data(), this->getWeightedInputs(mb),
+                           layerSize);
     }
-    biasDelta *= learningRate / mbSize;
-    bias -= biasDelta;
   }
 
-  void setInputs(Layer<mbSize> *inputs) { this->inputs = inputs; }
-  void setOutputs(Layer<mbSize> *outputs) { this->outputs = outputs; }
-  unsigned numWeights() { return weights.size(); }
-  float getWeight(unsigned i) { return weights.at(i); }
-};
-
-///===--------------------------------------------------------------------===///
-/// Fully-connected layer.
-///===--------------------------------------------------------------------===///
-template <unsigned mbSize,
-          unsigned layerSize,
-          unsigned prevSize,
-          float (*activationFn)(float),
-          float (*activationFnDeriv)(float)>
-class FullyConnectedLayer : public Layer<mbSize> {
-  using FullyConnectedNeuronTy =
-      FullyConnectedNeuron<mbSize, activationFn, activationFnDeriv>;
-  Layer<mbSize> *inputs;
-  Layer<mbSize> *outputs;
-  std::vector<FullyConnectedNeuronTy> neurons;
-  boost::multi_array<float, 2> bwdErrors; // [mb][i]
-
 public:
   FullyConnectedLayer(Params params) :
-      bwdErrors(boost::extents[mbSize][prevSize]) {
-    for (unsigned i = 0; i < layerSize; ++i) {
-      auto n = FullyConnectedNeuronTy(i, params.learningRate, params.lambda);
-      neurons.push_back(n);
-    }
-  }
+      Layer(layerSize, 1, 1),
+      lambda(params.lambda), grainSize(params.grainSize),
+      inputs(nullptr), outputs(nullptr),
+      weights(layerSize * prevSize),
+      bias(layerSize), accumulated(false) {}
 
-  void setInputs(Layer<mbSize> *layer) override {
-    inputs = layer;
-    for (auto &neuron : neurons) {
-      neuron.setInputs(layer);
-    }
+  void setBatchSize(unsigned mbSize_) override {
+    Layer::setBatchSize(mbSize_);
+    bwdErrors.resize(mbSize * prevSize);
   }
 
-  void setOutputs(Layer<mbSize> *layer) override {
-    outputs = layer;
-    for (auto &neuron : neurons) {
-      neuron.setOutputs(layer);
-    }
+  void setInputs(Layer *layer) override {
+    assert(layer->size() == prevSize && "Invalid input layer size");
+    inputs = layer;
   }
 
-  void initialiseDefaultWeights(std::default_random_engine &gen) override {
-    for (auto &neuron : neurons) {
-      neuron.initialiseDefaultWeights(gen);
-    }
-  }
+  void setOutputs(Layer *layer) override { outputs = layer; }
 
-  void feedForward(unsigned mb) override {
-    for (auto &neuron : neurons) {
-      neuron.feedForward(mb);
-    }
+  Layer *clone() const override {
+    return new FullyConnectedLayer(*this);
   }
 
-  /// Calculate the l+1 component of the error for each neuron in prev layer.
-  void calcBwdError(unsigned mb) override {
-    for (unsigned i = 0; i < inputs->size(); ++i) {
-      float error = 0.0f;
-      for (auto &neuron : neurons) {
-        error += neuron.getWeight(i) * neuron.errors[mb];
-      }
-      bwdErrors[mb][i] = error;
-    }
+  void save(model::Writer &writer) const override {
+    writer.addLayer(model::LayerKind::FullyConnected,
+                    ActivationOf<activationFn>::value, {layerSize, prevSize},
+                    weights.data(), weights.size(), bias.data(), bias.size());
   }
 
-  /// Update errors from next layer.
-  void backPropogate(unsigned mb) override {
-    for (auto &neuron : neurons) {
-      neuron.backPropogate(mb);
-    }
+  void load(const float *weights_, const float *bias_) override {
+    std::copy_n(weights_, weights.size(), weights.data());
+    std::copy_n(bias_, bias.size(), bias.data());
   }
 
-  void endBatch(unsigned numTrainingImages) override {
-    for (auto &neuron : neurons) {
-      neuron.endBatch(numTrainingImages);
+  void initialiseDefaultWeights(std::default_random_engine &gen) override {
+    // Initialise all weights with random values from normal distribution with
+    // mean 0 and stdandard deviation 1, divided by the square root of the
+    // number of input connections. Each neuron draws from its own
+    // distribution, as when the weights were held per neuron.
+    for (unsigned j = 0; j < layerSize; ++j) {
+      std::normal_distribution<float> distribution(0, 1.0f);
+      for (unsigned i = 0; i < prevSize; ++i) {
+        weights[(j * prevSize) + i] = distribution(gen) / std::sqrt(prevSize);
+      }
+      bias[j] = distribution(gen);
     }
   }
 
-  float getBwdError(unsigned index, unsigned mb) override {
-    return bwdErrors[mb][index];
-  }
-
-  float getBwdError(unsigned, unsigned, unsigned, unsigned) override {
-    UNREACHABLE();
-  }
-
-  Neuron<mbSize> &getNeuron(unsigned index) override {
-    return neurons.at(index);
+  void feedForward() override {
+    computeWeightedInputs();
+    parallelFor(mbSize * layerSize, 1, grainSize,
+                [this](unsigned begin, unsigned end) {
+      applyActivation<activationFn>(&this->getWeightedInputs(0)[begin],
+                                    &this->getActivations(0)[begin],
+                                    end - begin);
+    });
   }
 
-  Neuron<mbSize> &getNeuron(unsigned, unsigned, unsigned) override {
-    UNREACHABLE();
+  /// Calculate the l+1 component of the error for each neuron in prev layer,
+  /// as the matrix product E.W over the whole minibatch.
+  void calcBwdError() override {
+    gemm::sgemm(false, false, mbSize, prevSize, layerSize,
+                1.0f, this->getErrors(0), layerSize,
+                weights.data(), prevSize,
+                0.0f, bwdErrors.data(), prevSize);
   }
 
-  unsigned getNumDims() override { return 1; }
-
-  unsigned getDim(unsigned i) override {
-    assert(i == 0 && "Layer is 1D");
-    return neurons.size();
+  /// Update errors from next layer.
+  void backPropogate() override {
+    // Get the weight-error sum component from the next layer, then multiply by
+    // the activation derivative to get the error for each neuron.
+    parallelFor(mbSize * layerSize, 1, grainSize,
+                [this](unsigned begin, unsigned end) {
+      applyActivationDeriv<activationFnDeriv>(
+          &outputs->getBwdErrors(0)[begin],
+          &this->getWeightedInputs(0)[begin],
+          &this->getActivations(0)[begin],
+          &this->getErrors(0)[begin], end - begin);
+    });
   }
 
-  unsigned size() override { return neurons.size(); }
-};
-
-///===--------------------------------------------------------------------===///
-/// Softmax neuron.
-///===--------------------------------------------------------------------===///
-template <unsigned mbSize,
-          float (*costFn)(float, float),
-          float (*costDelta)(float, float, float)>
-class SoftMaxNeuron : public FullyConnectedNeuron<mbSize> {
-
-public:
-  SoftMaxNeuron(unsigned index, float learningRate, float lambda) :
-      FullyConnectedNeuron<mbSize>(index, learningRate, lambda) {}
-
-  void feedForward(unsigned mb) {
-    // Only calculate weighted inputs.
-    float weightedInput = 0.0f;
-    for (unsigned i = 0; i < this->inputs->size(); ++i) {
-      weightedInput +=
-        this->inputs->getNeuron(i).activations[mb] * this->weights[i];
+  /// For each weight, sum input activation x error (rate of change of cost
+  /// w.r.t. weight) over the minibatch as the matrix product E^T.X, and for
+  /// each bias, the errors (error is equal to rate of change of cost w.r.t.
+  /// bias), and add them, multiplied by scale, to weights and bias, which the
+  /// product scales by beta first.
+  void addGradients(float scale, float beta, float *weights_, float *bias_) {
+    gemm::sgemm(true, false, layerSize, prevSize, mbSize,
+                scale, this->getErrors(0), layerSize,
+                inputs->getActivations(0), prevSize,
+                beta, weights_, prevSize);
+    for (unsigned mb = 0; mb < mbSize; ++mb) {
+      simd::kernels().axpy(scale, this->getErrors(mb), bias_, layerSize);
     }
-    weightedInput += this->bias;
-    this->weightedInputs[mb] = weightedInput;
   }
 
-  void backPropogate(unsigned) { UNREACHABLE(); }
-
-  void computeOutputError(uint8_t label, unsigned mb) {
-    float y = label == this->index ? 1.0f : 0.0f;
-    float error = costDelta(this->weightedInputs[mb], this->activations[mb], y);
-    this->errors[mb] = error;
+  void accumulateGradients() override {
+    if (!accumulated) {
+      gradients.assign(weights.size() + bias.size(), 0.0f);
+      accumulated = true;
+    }
+    addGradients(1.0f, 1.0f, gradients.data(), &gradients[weights.size()]);
+  }
+
+  void applyGradients(float learningRate, unsigned numImages,
+                      unsigned numTrainingImages) override {
+    float reg = 1.0f - (learningRate * (lambda / numTrainingImages));
+    float scale = -learningRate / numImages;
+    simd::kernels().axpby(scale, gradients.data(), reg, weights.data(),
+                          weights.size());
+    simd::kernels().axpy(scale, &gradients[weights.size()], bias.data(),
+                         bias.size());
+    accumulated = false;
+  }
+
+  void endBatch(float learningRate, unsigned numImages,
+                unsigned numTrainingImages) override {
+    if (accumulated) {
+      accumulateGradients();
+      applyGradients(learningRate, numImages, numTrainingImages);
+      return;
+    }
+    // Average the gradients and multiply by learning rate. The
+    // regularisation term scales the existing weights in the same pass.
+    float reg = 1.0f - (learningRate * (lambda / numTrainingImages));
+    addGradients(-learningRate / numImages, reg, weights.data(), bias.data());
   }
 
-  float computeOutputCost(uint8_t label, unsigned mb) {
-    return costFn(this->activations[mb], label);
-  }
+  Tensor *getGradients() override { return &gradients; }
 
-  float sumSquaredWeights() {
-    float result = 0.0f;
-    for (auto weight : this->weights) {
-      result += std::pow(weight, 2.0f);
-    }
-    return result;
+  const float *getBwdErrors(unsigned mb) override {
+    return &bwdErrors[mb * prevSize];
   }
 };
 
 ///===--------------------------------------------------------------------===///
 /// Softmax layer.
 ///===--------------------------------------------------------------------===///
-template <unsigned mbSize,
-          unsigned layerSize,
+template <unsigned layerSize,
           unsigned prevSize,
           float (*costFn)(float, float),
           float (*costDelta)(float, float, float)>
-class SoftMaxLayer : public Layer<mbSize> {
-  using SoftMaxNeuronTy = SoftMaxNeuron<mbSize, costFn, costDelta>;
-  Layer<mbSize> *inputs;
-  Layer<mbSize> *outputs;
-  std::vector<SoftMaxNeuronTy> neurons;
-  boost::multi_array<float, 2> bwdErrors; // [mb][i]
+class SoftMaxLayer : public FullyConnectedLayer<layerSize, prevSize> {
 
 public:
-  SoftMaxLayer(float learningRate, float lambda) :
-      bwdErrors(boost::extents[mbSize][prevSize]) {
-    for (unsigned i = 0; i < layerSize; ++i) {
-      this->neurons.push_back(SoftMaxNeuronTy(i, learningRate, lambda));
-    }
-  }
-
-  void setInputs(Layer<mbSize> *layer) override {
-    inputs = layer;
-    for (auto &neuron : neurons) {
-      neuron.setInputs(layer);
-    }
-  }
+  SoftMaxLayer(Params params) :
+      FullyConnectedLayer<layerSize, prevSize>(params) {}
 
-  void setOutputs(Layer<mbSize>*) override {
+  void setOutputs(Layer*) override {
     UNREACHABLE();
   }
 
-  void initialiseDefaultWeights(std::default_random_engine &gen) override {
-    for (auto &neuron : neurons) {
-      neuron.initialiseDefaultWeights(gen);
-    }
-  }
-
-  void feedForward(unsigned mb) override {
-    // Calculate weighted inputs for each neuron.
-    // Sum the exponential values of the weighted inputs across neurons.
-    float sum = 0.0f;
-    for (auto &neuron : neurons) {
-      neuron.feedForward(mb);
-      sum += std::exp(neuron.weightedInputs[mb]);
-    }
-    // Calculate each of the neuron's activations.
-    for (auto &neuron : neurons) {
-      neuron.activations[mb] = std::exp(neuron.weightedInputs[mb]) / sum;
-    }
-  }
+  Layer *clone() const override { return new SoftMaxLayer(*this); }
 
-  /// Calculate the l+1 component of the error for each neuron in prev layer.
-  void calcBwdError(unsigned mb) override {
-    for (unsigned i = 0; i < inputs->size(); ++i) {
-      float error = 0.0f;
-      for (auto &neuron : neurons) {
-        error += neuron.getWeight(i) * neuron.errors[mb];
-      }
-      bwdErrors[mb][i] = error;
-    }
+  void save(model::Writer &writer) const override {
+    writer.addLayer(model::LayerKind::FullyConnected,
+                    model::Activation::SoftMax, {layerSize, prevSize},
+                    this->weights.data(), this->weights.size(),
+                    this->bias.data(), this->bias.size());
   }
 
-  /// Update errors from next layer.
-  void backPropogate(unsigned mb) override {
-    for (auto &neuron : neurons) {
-      neuron.backPropogate(mb);
+  void feedForward() override {
+    // Calculate weighted inputs for each neuron.
+    this->computeWeightedInputs();
+    // Normalise the exponential values of the weighted inputs across the
+    // neurons of each image.
+    for (unsigned mb = 0; mb < this->mbSize; ++mb) {
+      applySoftMax(this->getWeightedInputs(mb), this->getActivations(mb),
+                   layerSize);
     }
   }
 
-  void endBatch(unsigned numTrainingImages) override {
-    for (auto &neuron : neurons) {
-      neuron.endBatch(numTrainingImages);
-    }
-  }
+  void backPropogate() override { UNREACHABLE(); }
 
   /// Determine the index of the highest output activation.
   unsigned readOutput(unsigned mb) {
+    const float *activations = this->getActivations(mb);
     unsigned result = 0;
     float max = std::numeric_limits<float>::min();
-    for (unsigned i = 0; i < neurons.size(); ++i) {
-      float output = neurons[i].activations[mb];
-      if (output > max) {
-        result = i;
-        max = output;
+    for (unsigned j = 0; j < layerSize; ++j) {
+      if (activations[j] > max) {
+        result = j;
+        max = activations[j];
       }
     }
     return result;
   }
 
   void computeOutputError(uint8_t label, unsigned mb) {
-    for (auto &neuron : neurons) {
-      neuron.computeOutputError(label, mb);
+    const float *weightedInputs = this->getWeightedInputs(mb);
+    const float *activations = this->getActivations(mb);
+    float *errors = this->getErrors(mb);
+    for (unsigned j = 0; j < layerSize; ++j) {
+      float y = label == j ? 1.0f : 0.0f;
+      errors[j] = costDelta(weightedInputs[j], activations[j], y);
     }
   }
 
   float computeOutputCost(uint8_t label, unsigned mb) {
-    float outputCost = 0.0f;
-    for (auto &neuron : neurons) {
-      neuron.computeOutputCost(label, mb);
-    }
-    return outputCost;
+    return applyCost<costFn>(this->getActivations(mb), label, layerSize);
   }
 
   float sumSquaredWeights() {
-    float result = 0.0f;
-    for (auto &neuron : neurons) {
-      result += neuron.sumSquaredWeights();
-    }
-    return result;
-  }
-
-  float getBwdError(unsigned index, unsigned mb) override {
-    return bwdErrors[mb][index];
-  }
-
-  float getBwdError(unsigned, unsigned, unsigned, unsigned) override {
-    UNREACHABLE();
-  }
-
-  Neuron<mbSize> &getNeuron(unsigned index) override {
-    return neurons.at(index);
-  }
-
-  Neuron<mbSize> &getNeuron(unsigned, unsigned, unsigned) override {
-    UNREACHABLE();
-  }
-
-  unsigned getNumDims() override { return 1; }
-
-  unsigned getDim(unsigned i) override {
-    assert(i == 0 && "Layer is 1D");
-    return neurons.size();
-  }
-
-  unsigned size() override { return neurons.size(); }
-};
-
-///===--------------------------------------------------------------------===///
-/// Convolutional neuron.
-///===--------------------------------------------------------------------===///
-template <unsigned mbSize,
-          float (*activationFn)(float),
-          float (*activationFnDeriv)(float)>
-class ConvNeuron : public Neuron<mbSize> {
-  Layer<mbSize> *inputs;
-  Layer<mbSize> *outputs;
-  unsigned dimX;
-  unsigned dimY;
-
-public:
-  ConvNeuron(unsigned x, unsigned y, unsigned z, unsigned dimX, unsigned dimY) :
-      Neuron<mbSize>(x, y, z), dimX(dimX), dimY(dimY) {}
-
-  void feedForward(boost::multi_array_ref<float, 4> &weights,
-                   boost::multi_array_ref<float, 1> &bias,
-                   unsigned mb) {
-    // Convolve using each weight.
-    // (z is the index of the feature map.)
-    float weightedInput = 0.0f;
-    for (unsigned a = 0; a < weights.shape()[1]; ++a) {
-      for (unsigned b = 0; b < weights.shape()[2]; ++b) {
-        for (unsigned c = 0; c < weights.shape()[3]; ++c) {
-          unsigned inputX = this->x + a;
-          unsigned inputY = this->y + b;
-          float input = inputs->getNeuron(inputX, inputY, c).activations[mb];
-          weightedInput += input * weights[this->z][a][b][c];
-        }
-      }
-    }
-    // Add bias and apply non linerarity.
-    weightedInput += bias[this->z];
-    this->weightedInputs[mb] = weightedInput;
-    this->activations[mb] = activationFn(weightedInput);
+    return simd::kernels().dot(this->weights.data(), this->weights.data(),
+                               this->weights.size());
   }
-
-  void backPropogate(unsigned mb) {
-    // If next layer is 1D, map the x, y, z coordinates onto it.
-    unsigned index =
-      getIndex(this->x, this->y, this->z, this->dimX, this->dimY);
-    float error = outputs->getNumDims() == 1
-                    ? outputs->getBwdError(index, mb)
-                    : outputs->getBwdError(this->x, this->y, this->z, mb);
-    error *= activationFnDeriv(this->weightedInputs[mb]);
-    this->errors[mb] = error;
-  }
-
-  void setInputs(Layer<mbSize> *inputs) { this->inputs = inputs; }
-  void setOutputs(Layer<mbSize> *outputs) { this->outputs = outputs; }
 };
 
 ///===--------------------------------------------------------------------===///
@@ -596,9 +765,13 @@ public:
 /// kernelY is num rows
 /// neuron(x, y) is row y, col x
 /// weights(a, b) is row b, col a
+///
+/// The direct algorithm walks the receptive field of each neuron, with the
+/// work partitioned over rows of the feature maps and channels of the
+/// kernels. The im2col algorithm lowers the whole minibatch onto a column
+/// matrix and performs each pass as a single matrix multiply.
 ///===--------------------------------------------------------------------===///
-template <unsigned mbSize,
-          unsigned kernelX,
+template <unsigned kernelX,
           unsigned kernelY,
           unsigned kernelZ,
           unsigned inputX,
@@ -607,470 +780,1452 @@ template <unsigned mbSize,
           unsigned numFMs,
           float (*activationFn)(float),
           float (*activationFnDeriv)(float)>
-class ConvLayer : public Layer<mbSize> {
-  using ConvNeuronTy = ConvNeuron<mbSize, activationFn, activationFnDeriv>;
-  float learningRate;
+class ConvLayer : public Layer {
+  static constexpr unsigned outputX = inputX - kernelX + 1;
+  static constexpr unsigned outputY = inputY - kernelY + 1;
+  static constexpr unsigned kernelSize = kernelX * kernelY * kernelZ;
+  static constexpr unsigned outputSize = outputX * outputY;
   float lambda;
-  Layer<mbSize> *inputs;
-  Layer<mbSize> *outputs;
-  boost::multi_array<float, 1> bias;            // [fm]
-  boost::multi_array<float, 4> weights;         // [fm][x][y][z]
-  boost::multi_array<ConvNeuronTy*, 3> neurons; // [fm][x][y]
-  boost::multi_array<float, 4> bwdErrors;       // [mb][x][y][z]
-
-public:
-  ConvLayer(Params params) :
-      learningRate(params.learningRate), lambda(params.lambda),
-      inputs(nullptr), outputs(nullptr),
-      bias(boost::extents[numFMs]),
-      weights(boost::extents[numFMs][kernelX][kernelY][kernelZ]),
-      neurons(boost::extents[numFMs][inputX-kernelX+1][inputY-kernelY+1]),
-      bwdErrors(boost::extents[mbSize][inputX][inputY][inputZ]) {
-    static_assert(inputZ == kernelZ, "Kernel depth should match input depth");
-    unsigned dimX = neurons.shape()[1];
-    unsigned dimY = neurons.shape()[2];
-    for (unsigned fm = 0; fm < numFMs; ++fm) {
-      for (unsigned x = 0; x < dimX; ++x) {
-        for (unsigned y = 0; y < dimY; ++y) {
-          neurons[fm][x][y] = new ConvNeuronTy(x, y, fm, dimX, dimY);
-        }
+  unsigned grainSize;
+  ConvAlgorithm algorithm;
+  Layer *inputs;
+  Layer *outputs;
+  Tensor bias;      // [fm]
+  Tensor weights;   // [fm][z][y][x]
+  Tensor bwdErrors; // [mb][z][y][x]
+  // Im2col state.
+  unsigned numCols; // mbSize * outputSize.
+  Tensor cols;      // [z][y][x] x [mb][y][x] lowered inputs
+  Tensor colErrors; // [z][y][x] x [mb][y][x] lowered backwards errors
+  Tensor fmOutputs; // [fm][mb][y][x] weighted inputs, then errors
+  // Winograd state, with tiles covering the output (t) or the input (u).
+  unsigned winogradTile;   // Output tile size m.
+  bool filtersValid;       // The transformed filters match the weights.
+  Tensor filters;          // [xi][nu][fm][z]
+  Tensor flippedFilters;   // [xi][nu][z][fm]
+  Tensor inputTiles;       // [xi][nu][z][t]
+  Tensor outputTiles;      // [xi][nu][fm][t] products, then errors
+  Tensor errorTiles;       // [xi][nu][fm][u]
+  Tensor bwdErrorTiles;    // [xi][nu][z][u]
+  Tensor weightGradients;  // [fm][z][y][x]
+  // FFT state, holding a half spectrum for each channel.
+  unsigned fftSize;        // Transform size n, covering the input.
+  Tensor inputSpectra;     // [mb][z][spectrum]
+  Tensor kernelSpectra;    // [fm][z][spectrum]
+  Tensor errorSpectra;     // [mb][fm][spectrum]
+  // Gradients summed over the minibatches since the last update, if any.
+  bool accumulated;
+  Tensor gradients;        // [fm][z][y][x], then [fm]
+
+  /// Resolve the automatic choice of algorithm for this layer's shape, when
+  /// trained in minibatches of batchSize images. Winograd needs a 3x3 kernel,
+  /// and enough channels and output positions per image for its transforms to
+  /// be amortised over the products. Larger kernels use FFT when its estimated
+  /// cost is lower than im2col's. Direct is the fallback when the im2col
+  /// lowering would be too large to hold.
+  static ConvAlgorithm selectAlgorithm(ConvAlgorithm algorithm,
+                                       unsigned batchSize) {
+    if (algorithm != ConvAlgorithm::Auto) {
+      return algorithm;
+    }
+    if (kernelX == 3 && kernelY == 3) {
+      if (inputZ >= 8 && numFMs >= 8 &&
+          inputZ * numFMs * outputSize >= 32768) {
+        return conv::chooseWinogradTile(outputX, outputY) == 4
+                 ? ConvAlgorithm::WinogradF4 : ConvAlgorithm::WinogradF2;
       }
+    } else if (fftCost(batchSize) < im2colCost()) {
+      return ConvAlgorithm::FFT;
     }
-  }
-
-  void initialiseDefaultWeights(std::default_random_engine &gen) override {
-    // Initialise weights random distribution of mean 0 and standard deviation
-    // 1, then scale it by 1/sqrt(number of inputs).
-    std::normal_distribution<float> distribution(0, 1.0f);
-    float scale =
-        std::sqrt(weights.shape()[1] * weights.shape()[2] * weights.shape()[3]);
-    for (unsigned fm = 0; fm < weights.shape()[0]; ++fm) {
-      for (unsigned a = 0; a < weights.shape()[1]; ++a) {
-        for (unsigned b = 0; b < weights.shape()[2]; ++b) {
-          for (unsigned c = 0; c < weights.shape()[3]; ++c) {
-            weights[fm][a][b][c] = distribution(gen) / scale;
+    if (2.0 * kernelSize * batchSize * outputSize * sizeof(float) >
+        maxLoweredBytes) {
+      return ConvAlgorithm::Direct;
+    }
+    return ConvAlgorithm::Im2Col;
+  }
+
+  // Limit on the size of the im2col buffers.
+  static constexpr double maxLoweredBytes = 1 << 30;
+
+  /// Multiply-accumulates per image of the three im2col products.
+  static double im2colCost() {
+    return 3.0 * numFMs * kernelSize * outputSize;
+  }
+
+  /// Estimated cost per image of the FFT path in the same units, from the
+  /// measured relative costs of a 2D transform, per n^2 log2(n), and of a
+  /// complex multiply-accumulate over the spectra.
+  static double fftCost(unsigned batchSize) {
+    double n = fft::transformSize(std::max(inputX, inputY));
+    double transforms = (2.0 * (inputZ + numFMs)) +
+                        (double(inputZ) * numFMs / batchSize);
+    double products = 3.0 * inputZ * numFMs * fft::spectrumSize(n);
+    return (16.0 * n * n * std::log2(n) * transforms) + (6.0 * products);
+  }
+
+  /// Compute row y of feature map fm for image mb.
+  void feedForwardDirect(unsigned mb, unsigned fm, unsigned y) {
+    const float *in = inputs->getActivations(mb);
+    const float *w = &weights[fm * kernelSize];
+    unsigned offset = getIndex(0, y, fm, outputX, outputY);
+    float *weightedInputs = &this->getWeightedInputs(mb)[offset];
+    // Start from the bias and accumulate each weight times the input row it
+    // covers, so that the innermost loop runs along the row.
+    std::fill(weightedInputs, weightedInputs + outputX, bias[fm]);
+    for (unsigned c = 0; c < kernelZ; ++c) {
+      for (unsigned b = 0; b < kernelY; ++b) {
+        const float *inRow = &in[getIndex(0, y + b, c, inputX, inputY)];
+        const float *wRow = &w[getIndex(0, b, c, kernelX, kernelY)];
+        for (unsigned a = 0; a < kernelX; ++a) {
+          float weight = wRow[a];
+          for (unsigned x = 0; x < outputX; ++x) {
+            weightedInputs[x] += weight * inRow[x + a];
           }
         }
       }
-      bias[fm] = distribution(gen);
     }
-  }
-
-  void feedForward(unsigned mb) override {
-    for (unsigned fm = 0; fm < neurons.shape()[0]; ++fm) {
-      for (unsigned x = 0; x < neurons.shape()[1]; ++x) {
-        for (unsigned y = 0; y < neurons.shape()[2]; ++y) {
-          neurons[fm][x][y]->feedForward(weights, bias, mb);
+    // Apply non linearity.
+    applyActivation<activationFn>(weightedInputs,
+                                  &this->getActivations(mb)[offset], outputX);
+  }
+
+  /// Calculate the l+1 component of the error for each neuron in channel c
+  /// of the prev layer for image mb.
+  void calcBwdErrorDirect(unsigned mb, unsigned c) {
+    // Scatter each neuron's error back over its receptive field in the
+    // channel, summing over all feature maps.
+    const float *errors = this->getErrors(mb);
+    float *bwdError = &bwdErrors[((mb * inputZ) + c) * inputX * inputY];
+    std::fill(bwdError, bwdError + (inputX * inputY), 0.0f);
+    for (unsigned fm = 0; fm < numFMs; ++fm) {
+      const float *w = &weights[fm * kernelSize];
+      for (unsigned y = 0; y < outputY; ++y) {
+        const float *errorRow = &errors[getIndex(0, y, fm, outputX, outputY)];
+        for (unsigned b = 0; b < kernelY; ++b) {
+          float *bwdRow = &bwdError[(y + b) * inputX];
+          const float *wRow = &w[getIndex(0, b, c, kernelX, kernelY)];
+          for (unsigned a = 0; a < kernelX; ++a) {
+            float weight = wRow[a];
+            for (unsigned x = 0; x < outputX; ++x) {
+              bwdRow[x + a] += weight * errorRow[x];
+            }
+          }
         }
       }
     }
   }
 
-  void calcBwdError(unsigned mb) override {
-    // Calculate the l+1 component of the error for each neuron in prev layer.
-    for (unsigned x = 0; x < inputX; ++x) {
-      for (unsigned y = 0; y < inputY; ++y) {
-        for (unsigned z = 0; z < inputZ; ++z) {
-          // Sum over all feature maps.
-          float error = 0.0f;
-          for (unsigned fm = 0; fm < numFMs; ++fm) {
-            for (unsigned a = 0; a < weights.shape()[1]; ++a) {
-              for (unsigned b = 0; b < weights.shape()[2]; ++b) {
-                if (a <= x && b <= y &&
-                    x - a < neurons.shape()[1] &&
-                    y - b < neurons.shape()[2]) {
-                  float ne = neurons[fm][x - a][y - b]->errors[mb];
-                  error += weights[fm][a][b][z] * ne;
-                }
+  void backPropogateDirect() {
+    // Update errors from next layer. The backwards error is laid out in the
+    // same order as this layer's neurons, regardless of the next layer's
+    // dimensionality, and both are contiguous over the minibatch.
+    parallelFor(mbSize * this->size(), 1, grainSize,
+                [this](unsigned begin, unsigned end) {
+      applyActivationDeriv<activationFnDeriv>(
+          &outputs->getBwdErrors(0)[begin],
+          &this->getWeightedInputs(0)[begin],
+          &this->getActivations(0)[begin],
+          &this->getErrors(0)[begin], end - begin);
+    });
+  }
+
+  /// Add the weight gradient (input activation x error, the rate of change
+  /// of cost w.r.t. weight) of the output rows [begin, end) of the minibatch,
+  /// numbered mb * outputY + y, to grad.
+  void accumulateWeightGradients(unsigned begin, unsigned end, float *grad) {
+    for (unsigned i = begin; i < end; ++i) {
+      unsigned mb = i / outputY;
+      unsigned y = i % outputY;
+      const float *in = inputs->getActivations(mb);
+      // The input rows under the kernel stay in cache while they are
+      // correlated with the error row of each feature map.
+      for (unsigned fm = 0; fm < numFMs; ++fm) {
+        const float *errorRow =
+          &this->getErrors(mb)[getIndex(0, y, fm, outputX, outputY)];
+        float *g = &grad[fm * kernelSize];
+        for (unsigned c = 0; c < kernelZ; ++c) {
+          for (unsigned b = 0; b < kernelY; ++b) {
+            const float *inRow = &in[getIndex(0, y + b, c, inputX, inputY)];
+            float *gRow = &g[getIndex(0, b, c, kernelX, kernelY)];
+            float acc[kernelX] = {};
+            for (unsigned x = 0; x < outputX; ++x) {
+              float error = errorRow[x];
+              for (unsigned a = 0; a < kernelX; ++a) {
+                acc[a] += error * inRow[x + a];
               }
             }
+            for (unsigned a = 0; a < kernelX; ++a) {
+              gRow[a] += acc[a];
+            }
           }
-          bwdErrors[mb][x][y][z] = error;
         }
       }
     }
   }
 
-  void backPropogate(unsigned mb) override {
-    // Update errors from next layer.
-    for (unsigned fm = 0; fm < neurons.shape()[0]; ++fm) {
-      for (unsigned x = 0; x < neurons.shape()[1]; ++x) {
-        for (unsigned y = 0; y < neurons.shape()[2]; ++y) {
-          neurons[fm][x][y]->backPropogate(mb);
+  void weightGradientsDirect() {
+    // Sum the weight gradient over blocks of output rows of the minibatch.
+    weightGradients =
+      parallelSum(mbSize * outputY, numFMs * kernelSize * outputX, grainSize,
+                  numFMs * kernelSize,
+                  [this](unsigned begin, unsigned end, float *grad) {
+        accumulateWeightGradients(begin, end, grad);
+      });
+  }
+
+  /// Sum the errors of each feature map over the minibatch (error is equal to
+  /// rate of change of cost w.r.t. bias), and add the sum, multiplied by
+  /// scale, to its element of biases.
+  void addBiasGradients(float scale, float *biases) {
+    parallelFor(numFMs, numCols, grainSize,
+                [this, scale, biases](unsigned begin, unsigned end) {
+      for (unsigned fm = begin; fm < end; ++fm) {
+        float biasDelta = 0.0f;
+        for (unsigned mb = 0; mb < mbSize; ++mb) {
+          const float *errors =
+            &this->getErrors(mb)[getIndex(0, 0, fm, outputX, outputY)];
+          biasDelta += simd::kernels().sum(errors, outputSize);
         }
+        biasDelta *= scale;
+        biases[fm] += biasDelta;
       }
-    }
+    });
   }
 
-  void endBatch(unsigned numTrainingImages) override {
-    // For each feature map.
-    for (unsigned fm = 0; fm < numFMs; ++fm) {
-      // For each weight, calculate the delta and update the weight.
-      for (unsigned a = 0; a < weights.shape()[1]; ++a) {
-        for (unsigned b = 0; b < weights.shape()[2]; ++b) {
-          for (unsigned c = 0; c < weights.shape()[3]; ++c) {
-            float weightDelta = 0.0f;
-            // For each item of the minibatch.
-            for (unsigned mb = 0; mb < mbSize; ++mb) {
-              // For each neuron.
-              for (unsigned x = 0; x < neurons.shape()[1]; ++x) {
-                for (unsigned y = 0; y < neurons.shape()[2]; ++y) {
-                  float i = inputs->getNeuron(x + a, y + b, c).activations[mb];
-                  weightDelta += i * neurons[fm][x][y]->errors[mb];
-                }
-              }
-            }
-            weightDelta *= learningRate / mbSize;
-            float reg = 1.0f - (learningRate * (lambda / numTrainingImages));
-            weights[fm][a][b][c] *= reg; // Regularisation term.
-            weights[fm][a][b][c] -= weightDelta;
-          }
+  /// Add the bias of each feature map to its weighted inputs and apply the
+  /// non linearity, over every feature map of every image.
+  void addBiasAndActivate() {
+    parallelFor(mbSize * numFMs, outputSize, grainSize,
+                [this](unsigned begin, unsigned end) {
+      for (unsigned i = begin; i < end; ++i) {
+        unsigned fm = i % numFMs;
+        float *weightedInputs = &this->getWeightedInputs(0)[i * outputSize];
+        for (unsigned j = 0; j < outputSize; ++j) {
+          weightedInputs[j] += bias[fm];
         }
+        applyActivation<activationFn>(weightedInputs,
+                                      &this->getActivations(0)[i * outputSize],
+                                      outputSize);
       }
-      // Calculate bias delta and update it.
-      float biasDelta = 0.0f;
-      // For each item of the minibatch.
-      for (unsigned mb = 0; mb < mbSize; ++mb) {
-        // For each neuron.
-        for (unsigned x = 0; x < neurons.shape()[1]; ++x) {
-          for (unsigned y = 0; y < neurons.shape()[2]; ++y) {
-            biasDelta += neurons[fm][x][y]->errors[mb];
-          }
+    });
+  }
+
+  void feedForwardIm2Col() {
+    // Convolve every image with every kernel as W.cols.
+    conv::im2col(inputs->getActivations(0), mbSize,
+                 inputX, inputY, inputZ, kernelX, kernelY, cols.data());
+    gemm::sgemm(false, false, numFMs, numCols, kernelSize,
+                1.0f, weights.data(), kernelSize,
+                cols.data(), numCols,
+                0.0f, fmOutputs.data(), numCols);
+    // Add bias, apply non linearity and reorder from [fm][mb] to [mb][fm].
+    parallelFor(mbSize * numFMs, outputSize, grainSize,
+                [this](unsigned begin, unsigned end) {
+      for (unsigned i = begin; i < end; ++i) {
+        unsigned mb = i / numFMs;
+        unsigned fm = i % numFMs;
+        const float *fmOutput = &fmOutputs[((fm * mbSize) + mb) * outputSize];
+        float *weightedInputs = &this->getWeightedInputs(0)[i * outputSize];
+        for (unsigned j = 0; j < outputSize; ++j) {
+          weightedInputs[j] = fmOutput[j] + bias[fm];
         }
+        applyActivation<activationFn>(weightedInputs,
+                                      &this->getActivations(0)[i * outputSize],
+                                      outputSize);
       }
-      biasDelta *= learningRate / mbSize;
-      bias[fm] -= biasDelta;
-    }
+    });
   }
 
-  float getBwdError(unsigned x, unsigned y, unsigned z, unsigned mb) override {
-    return bwdErrors[mb][x][y][z];
+  void backPropogateIm2Col() {
+    // Update errors from next layer, also keeping a copy in [fm][mb] order
+    // for the backwards error and weight gradient products.
+    parallelFor(mbSize * numFMs, outputSize, grainSize,
+                [this](unsigned begin, unsigned end) {
+      for (unsigned i = begin; i < end; ++i) {
+        unsigned mb = i / numFMs;
+        unsigned fm = i % numFMs;
+        unsigned offset = i * outputSize;
+        float *errors = &this->getErrors(0)[offset];
+        applyActivationDeriv<activationFnDeriv>(
+            &outputs->getBwdErrors(0)[offset],
+            &this->getWeightedInputs(0)[offset],
+            &this->getActivations(0)[offset], errors, outputSize);
+        std::copy(errors, errors + outputSize,
+                  &fmOutputs[((fm * mbSize) + mb) * outputSize]);
+      }
+    });
   }
 
-  void setInputs(Layer<mbSize> *layer) override {
-    assert(layer->size() == inputX * inputY * inputZ &&
-           "Invalid input layer size");
-    inputs = layer;
-    std::for_each(neurons.data(), neurons.data() + neurons.num_elements(),
-                  [layer](ConvNeuronTy *n){ n->setInputs(layer); });
+  void calcBwdErrorIm2Col() {
+    // Lowered backwards error is W^T.E, then accumulate it over each
+    // receptive field.
+    gemm::sgemm(true, false, kernelSize, numCols, numFMs,
+                1.0f, weights.data(), kernelSize,
+                fmOutputs.data(), numCols,
+                0.0f, colErrors.data(), numCols);
+    conv::col2im(colErrors.data(), mbSize,
+                 inputX, inputY, inputZ, kernelX, kernelY, bwdErrors.data());
   }
 
-  void setOutputs(Layer<mbSize> *layer) override {
-    outputs = layer;
-    std::for_each(neurons.data(), neurons.data() + neurons.num_elements(),
-                  [layer](ConvNeuronTy *n){ n->setOutputs(layer); });
+  /// The weight gradient summed over the minibatch is E.cols^T, which is
+  /// added, multiplied by scale, to weights_, which is scaled by beta first.
+  void addWeightGradientsIm2Col(float scale, float beta, float *weights_) {
+    gemm::sgemm(false, true, numFMs, kernelSize, numCols,
+                scale, fmOutputs.data(), numCols,
+                cols.data(), numCols,
+                beta, weights_, kernelSize);
   }
 
-  float getBwdError(unsigned, unsigned) override {
-    UNREACHABLE(); // No FC layers preceed conv layers.
+  unsigned numOutputTiles() const {
+    return conv::numWinogradTiles(winogradTile, mbSize, outputX, outputY);
   }
 
-  Neuron<mbSize> &getNeuron(unsigned index) override {
-    // Map a 1D index onto the 3D neurons (for Conv <- FC connections).
-    unsigned dimX = neurons.shape()[1];
-    unsigned dimY = neurons.shape()[2];
-    unsigned x = getX(index, dimX);
-    unsigned y = getY(index, dimX, dimY);
-    unsigned z = getZ(index, dimX, dimY);
-    return *neurons[z][x][y];
+  unsigned numInputTiles() const {
+    return conv::numWinogradTiles(winogradTile, mbSize, inputX, inputY);
   }
 
-  Neuron<mbSize> &getNeuron(unsigned x, unsigned y, unsigned z) override {
-    // Feature maps is inner dimension but corresponds to z.
-    return *neurons[z][x][y];
+  template <unsigned m>
+  void transformFilters() {
+    // The weights only change at the end of a batch, so their transforms are
+    // reused until then.
+    if (filtersValid) {
+      return;
+    }
+    conv::winogradFilters<m>(weights.data(), numFMs, kernelZ, false,
+                             filters.data());
+    conv::winogradFilters<m>(weights.data(), numFMs, kernelZ, true,
+                             flippedFilters.data());
+    filtersValid = true;
+  }
+
+  template <unsigned m>
+  void feedForwardWinograd() {
+    // Each transformed tile position is an independent product of the
+    // [fm][z] filters with the [z][t] inputs.
+    constexpr unsigned alpha2 = conv::Winograd<m>::alpha *
+                                conv::Winograd<m>::alpha;
+    unsigned numTiles = numOutputTiles();
+    transformFilters<m>();
+    conv::winogradInputs<m>(inputs->getActivations(0), mbSize,
+                            inputX, inputY, inputZ, 0, outputX, outputY,
+                            inputTiles.data());
+    gemm::sgemmBatched(alpha2, false, false, numFMs, numTiles, kernelZ,
+                       1.0f, filters.data(), numFMs * kernelZ, kernelZ,
+                       inputTiles.data(), kernelZ * numTiles, numTiles,
+                       0.0f, outputTiles.data(), numFMs * numTiles, numTiles);
+    conv::winogradOutputs<m>(outputTiles.data(), mbSize, numFMs,
+                             outputX, outputY, this->getWeightedInputs(0));
+    addBiasAndActivate();
+  }
+
+  template <unsigned m>
+  void calcBwdErrorWinograd() {
+    // The backwards error is the full convolution of the errors with the
+    // rotated filters, ie the errors padded by kernel size - 1.
+    constexpr unsigned alpha2 = conv::Winograd<m>::alpha *
+                                conv::Winograd<m>::alpha;
+    unsigned numTiles = numInputTiles();
+    transformFilters<m>();
+    conv::winogradInputs<m>(this->getErrors(0), mbSize,
+                            outputX, outputY, numFMs, 2, inputX, inputY,
+                            errorTiles.data());
+    gemm::sgemmBatched(alpha2, false, false, kernelZ, numTiles, numFMs,
+                       1.0f, flippedFilters.data(), kernelZ * numFMs, numFMs,
+                       errorTiles.data(), numFMs * numTiles, numTiles,
+                       0.0f, bwdErrorTiles.data(), kernelZ * numTiles,
+                       numTiles);
+    conv::winogradOutputs<m>(bwdErrorTiles.data(), mbSize, kernelZ,
+                             inputX, inputY, bwdErrors.data());
+  }
+
+  template <unsigned m>
+  void weightGradientsWinograd() {
+    // The gradient of the transformed filters is the product of the
+    // transformed errors with the transformed inputs of the forward pass,
+    // which is transformed back to the gradient of the weights. It is formed
+    // in the space of the transformed filters, which must then be remade.
+    constexpr unsigned alpha2 = conv::Winograd<m>::alpha *
+                                conv::Winograd<m>::alpha;
+    unsigned numTiles = numOutputTiles();
+    conv::winogradErrors<m>(this->getErrors(0), mbSize, numFMs,
+                            outputX, outputY, outputTiles.data());
+    gemm::sgemmBatched(alpha2, false, true, numFMs, kernelZ, numTiles,
+                       1.0f, outputTiles.data(), numFMs * numTiles, numTiles,
+                       inputTiles.data(), kernelZ * numTiles, numTiles,
+                       0.0f, filters.data(), numFMs * kernelZ, kernelZ);
+    conv::winogradFilterGradients<m>(filters.data(), numFMs, kernelZ,
+                                     weightGradients.data());
+    filtersValid = false;
+  }
+
+  unsigned spectrumElements() const {
+    // Real and imaginary planes.
+    return 2 * fft::spectrumSize(fftSize);
+  }
+
+  void transformKernels() {
+    // The weights only change at the end of a batch, so their spectra are
+    // reused until then.
+    if (filtersValid) {
+      return;
+    }
+    tbb::parallel_for(0u, numFMs * kernelZ, [this](unsigned i) {
+      fft::forward2D(&weights[i * kernelX * kernelY], kernelX, kernelY,
+                     fftSize, &kernelSpectra[i * spectrumElements()]);
+    });
+    filtersValid = true;
+  }
+
+  void feedForwardFFT() {
+    // Each feature map is the correlation of the inputs with its kernels,
+    // summed over the input channels, which is a sum of products of each
+    // input spectrum with the conjugate of the kernel spectrum.
+    unsigned elements = spectrumElements();
+    transformKernels();
+    tbb::parallel_for(0u, mbSize * inputZ, [this, elements](unsigned i) {
+      fft::forward2D(&inputs->getActivations(0)[i * inputX * inputY],
+                     inputX, inputY, fftSize, &inputSpectra[i * elements]);
+    });
+    tbb::parallel_for(0u, mbSize * numFMs, [this, elements](unsigned i) {
+      unsigned mb = i / numFMs;
+      unsigned fm = i % numFMs;
+      static thread_local Tensor acc;
+      acc.assign(elements, 0.0f);
+      for (unsigned c = 0; c < kernelZ; ++c) {
+        fft::multiplyAccumulate(&inputSpectra[((mb * inputZ) + c) * elements],
+                                &kernelSpectra[((fm * kernelZ) + c) * elements],
+                                true, elements / 2, acc.data());
+      }
+      unsigned offset = getIndex(0, 0, fm, outputX, outputY);
+      float *weightedInputs = &this->getWeightedInputs(mb)[offset];
+      float *activations = &this->getActivations(mb)[offset];
+      fft::inverse2D(acc.data(), fftSize, 0, 0, outputX, outputY,
+                     weightedInputs);
+      // Add bias and apply non linearity.
+      for (unsigned j = 0; j < outputSize; ++j) {
+        weightedInputs[j] += bias[fm];
+      }
+      applyActivation<activationFn>(weightedInputs, activations, outputSize);
+    });
   }
 
-  unsigned getDim(unsigned i) override {
-    assert(i <= 2 && "Dimension out of range.");
-    // Feature maps is inner dimension but corresponds to z.
-    return i == 2 ? neurons.shape()[0] : neurons.shape()[i + 1];
+  void backPropogateFFT() {
+    // Update errors from next layer and keep their spectra for the
+    // backwards error and the weight gradient.
+    unsigned elements = spectrumElements();
+    backPropogateDirect();
+    tbb::parallel_for(0u, mbSize * numFMs, [this, elements](unsigned i) {
+      fft::forward2D(&this->getErrors(0)[i * outputSize], outputX, outputY,
+                     fftSize, &errorSpectra[i * elements]);
+    });
   }
 
-  unsigned getNumDims() override { return neurons.num_dimensions(); }
-  unsigned size() override { return neurons.num_elements(); }
+  void calcBwdErrorFFT() {
+    // The backwards error is the full convolution of the errors with the
+    // kernels, summed over the feature maps.
+    unsigned elements = spectrumElements();
+    transformKernels();
+    tbb::parallel_for(0u, mbSize * inputZ, [this, elements](unsigned i) {
+      unsigned mb = i / inputZ;
+      unsigned c = i % inputZ;
+      static thread_local Tensor acc;
+      acc.assign(elements, 0.0f);
+      for (unsigned fm = 0; fm < numFMs; ++fm) {
+        fft::multiplyAccumulate(&errorSpectra[((mb * numFMs) + fm) * elements],
+                                &kernelSpectra[((fm * kernelZ) + c) * elements],
+                                false, elements / 2, acc.data());
+      }
+      fft::inverse2D(acc.data(), fftSize, 0, 0, inputX, inputY,
+                     &bwdErrors[i * inputX * inputY]);
+    });
+  }
+
+  void weightGradientsFFT() {
+    // The weight gradient is the correlation of the inputs with the errors,
+    // summed over the minibatch.
+    unsigned elements = spectrumElements();
+    tbb::parallel_for(0u, numFMs * kernelZ, [this, elements](unsigned i) {
+      unsigned fm = i / kernelZ;
+      unsigned c = i % kernelZ;
+      static thread_local Tensor acc;
+      acc.assign(elements, 0.0f);
+      for (unsigned mb = 0; mb < mbSize; ++mb) {
+        fft::multiplyAccumulate(&inputSpectra[((mb * inputZ) + c) * elements],
+                                &errorSpectra[((mb * numFMs) + fm) * elements],
+                                true, elements / 2, acc.data());
+      }
+      fft::inverse2D(acc.data(), fftSize, 0, 0, kernelX, kernelY,
+                     &weightGradients[i * kernelX * kernelY]);
+    });
+  }
+
+  /// Sum the weight gradient over the minibatch into weightGradients, for the
+  /// algorithms other than im2col, which forms it in one product.
+  void computeWeightGradients() {
+    switch (algorithm) {
+    case ConvAlgorithm::Direct:
+      weightGradientsDirect();
+      break;
+    case ConvAlgorithm::WinogradF2:
+      weightGradientsWinograd<2>();
+      break;
+    case ConvAlgorithm::WinogradF4:
+      weightGradientsWinograd<4>();
+      break;
+    case ConvAlgorithm::FFT:
+      weightGradientsFFT();
+      break;
+    case ConvAlgorithm::Im2Col:
+    case ConvAlgorithm::Auto:
+      UNREACHABLE();
+    }
+  }
+
+public:
+  ConvLayer(Params params) :
+      Layer(outputX, outputY, numFMs),
+      lambda(params.lambda), grainSize(params.grainSize),
+      algorithm(selectAlgorithm(params.convAlgorithm, params.mbSize)),
+      inputs(nullptr), outputs(nullptr),
+      bias(numFMs),
+      weights(numFMs * kernelSize),
+      numCols(0), winogradTile(0), filtersValid(false),
+      fftSize(fft::transformSize(std::max(inputX, inputY))),
+      accumulated(false) {
+    static_assert(inputZ == kernelZ, "Kernel depth should match input depth");
+    switch (algorithm) {
+    case ConvAlgorithm::WinogradF2:
+    case ConvAlgorithm::WinogradF4: {
+      assert(kernelX == 3 && kernelY == 3 &&
+             "Winograd convolution requires a 3x3 kernel");
+      winogradTile = algorithm == ConvAlgorithm::WinogradF2 ? 2 : 4;
+      unsigned alpha2 = (winogradTile + 2) * (winogradTile + 2);
+      filters.resize(alpha2 * numFMs * kernelZ);
+      flippedFilters.resize(alpha2 * kernelZ * numFMs);
+      weightGradients.resize(numFMs * kernelSize);
+      break;
+    }
+    case ConvAlgorithm::FFT:
+      kernelSpectra.resize(numFMs * kernelZ * spectrumElements());
+      weightGradients.resize(numFMs * kernelSize);
+      break;
+    default:
+      break;
+    }
+  }
+
+  void setBatchSize(unsigned mbSize_) override {
+    Layer::setBatchSize(mbSize_);
+    bwdErrors.resize(mbSize * inputX * inputY * inputZ);
+    numCols = mbSize * outputSize;
+    switch (algorithm) {
+    case ConvAlgorithm::Im2Col:
+      cols.resize(kernelSize * numCols);
+      colErrors.resize(kernelSize * numCols);
+      fmOutputs.resize(numFMs * numCols);
+      break;
+    case ConvAlgorithm::WinogradF2:
+    case ConvAlgorithm::WinogradF4: {
+      unsigned alpha2 = (winogradTile + 2) * (winogradTile + 2);
+      inputTiles.resize(alpha2 * kernelZ * numOutputTiles());
+      outputTiles.resize(alpha2 * numFMs * numOutputTiles());
+      errorTiles.resize(alpha2 * numFMs * numInputTiles());
+      bwdErrorTiles.resize(alpha2 * kernelZ * numInputTiles());
+      break;
+    }
+    case ConvAlgorithm::FFT:
+      inputSpectra.resize(mbSize * inputZ * spectrumElements());
+      errorSpectra.resize(mbSize * numFMs * spectrumElements());
+      break;
+    default:
+      break;
+    }
+  }
+
+  void initialiseDefaultWeights(std::default_random_engine &gen) override {
+    // Initialise weights random distribution of mean 0 and standard deviation
+    // 1, then scale it by 1/sqrt(number of inputs).
+    std::normal_distribution<float> distribution(0, 1.0f);
+    float scale = std::sqrt(kernelSize);
+    for (unsigned fm = 0; fm < numFMs; ++fm) {
+      float *w = &weights[fm * kernelSize];
+      for (unsigned a = 0; a < kernelX; ++a) {
+        for (unsigned b = 0; b < kernelY; ++b) {
+          for (unsigned c = 0; c < kernelZ; ++c) {
+            w[getIndex(a, b, c, kernelX, kernelY)] = distribution(gen) / scale;
+          }
+        }
+      }
+      bias[fm] = distribution(gen);
+    }
+    filtersValid = false;
+  }
+
+  void feedForward() override {
+    switch (algorithm) {
+    case ConvAlgorithm::Direct:
+      parallelFor(mbSize * numFMs * outputY, outputX * kernelSize, grainSize,
+                  [this](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i < end; ++i) {
+          feedForwardDirect(i / (numFMs * outputY), (i / outputY) % numFMs,
+                            i % outputY);
+        }
+      });
+      break;
+    case ConvAlgorithm::Im2Col:
+      feedForwardIm2Col();
+      break;
+    case ConvAlgorithm::WinogradF2:
+      feedForwardWinograd<2>();
+      break;
+    case ConvAlgorithm::WinogradF4:
+      feedForwardWinograd<4>();
+      break;
+    case ConvAlgorithm::FFT:
+      feedForwardFFT();
+      break;
+    case ConvAlgorithm::Auto:
+      UNREACHABLE();
+    }
+  }
+
+  void calcBwdError() override {
+    switch (algorithm) {
+    case ConvAlgorithm::Direct:
+      parallelFor(mbSize * inputZ, numFMs * outputSize * kernelX * kernelY,
+                  grainSize, [this](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i < end; ++i) {
+          calcBwdErrorDirect(i / inputZ, i % inputZ);
+        }
+      });
+      break;
+    case ConvAlgorithm::Im2Col:
+      calcBwdErrorIm2Col();
+      break;
+    case ConvAlgorithm::WinogradF2:
+      calcBwdErrorWinograd<2>();
+      break;
+    case ConvAlgorithm::WinogradF4:
+      calcBwdErrorWinograd<4>();
+      break;
+    case ConvAlgorithm::FFT:
+      calcBwdErrorFFT();
+      break;
+    case ConvAlgorithm::Auto:
+      UNREACHABLE();
+    }
+  }
+
+  void backPropogate() override {
+    switch (algorithm) {
+    case ConvAlgorithm::Direct:
+    case ConvAlgorithm::WinogradF2:
+    case ConvAlgorithm::WinogradF4:
+      backPropogateDirect();
+      break;
+    case ConvAlgorithm::Im2Col:
+      backPropogateIm2Col();
+      break;
+    case ConvAlgorithm::FFT:
+      backPropogateFFT();
+      break;
+    case ConvAlgorithm::Auto:
+      UNREACHABLE();
+    }
+  }
+
+  void accumulateGradients() override {
+    if (!accumulated) {
+      gradients.assign(weights.size() + bias.size(), 0.0f);
+      accumulated = true;
+    }
+    if (algorithm == ConvAlgorithm::Im2Col) {
+      addWeightGradientsIm2Col(1.0f, 1.0f, gradients.data());
+    } else {
+      computeWeightGradients();
+      simd::kernels().axpy(1.0f, weightGradients.data(), gradients.data(),
+                           weights.size());
+    }
+    addBiasGradients(1.0f, &gradients[weights.size()]);
+  }
+
+  void applyGradients(float learningRate, unsigned numImages,
+                      unsigned numTrainingImages) override {
+    float reg = 1.0f - (learningRate * (lambda / numTrainingImages));
+    float scale = -learningRate / numImages;
+    simd::kernels().axpby(scale, gradients.data(), reg, weights.data(),
+                          weights.size());
+    simd::kernels().axpy(scale, &gradients[weights.size()], bias.data(),
+                         bias.size());
+    accumulated = false;
+    filtersValid = false;
+  }
+
+  void endBatch(float learningRate, unsigned numImages,
+                unsigned numTrainingImages) override {
+    if (accumulated) {
+      accumulateGradients();
+      applyGradients(learningRate, numImages, numTrainingImages);
+      return;
+    }
+    // Average the gradients and multiply by the learning rate, applying the
+    // weight gradient together with the regularisation term.
+    float reg = 1.0f - (learningRate * (lambda / numTrainingImages));
+    float scale = -learningRate / numImages;
+    if (algorithm == ConvAlgorithm::Im2Col) {
+      addWeightGradientsIm2Col(scale, reg, weights.data());
+    } else {
+      computeWeightGradients();
+      simd::kernels().axpby(scale, weightGradients.data(), reg,
+                            weights.data(), weights.size());
+    }
+    addBiasGradients(scale, bias.data());
+    filtersValid = false;
+  }
+
+  Tensor *getGradients() override { return &gradients; }
+
+  const float *getBwdErrors(unsigned mb) override {
+    return &bwdErrors[mb * inputX * inputY * inputZ];
+  }
+
+  void setInputs(Layer *layer) override {
+    assert(layer->size() == inputX * inputY * inputZ &&
+           "Invalid input layer size");
+    inputs = layer;
+  }
+
+  void setOutputs(Layer *layer) override { outputs = layer; }
+
+  Layer *clone() const override { return new ConvLayer(*this); }
+
+  void save(model::Writer &writer) const override {
+    writer.addLayer(model::LayerKind::Conv, ActivationOf<activationFn>::value,
+                    {kernelX, kernelY, inputX, inputY, inputZ, numFMs},
+                    weights.data(), weights.size(), bias.data(), bias.size());
+  }
+
+  void load(const float *weights_, const float *bias_) override {
+    std::copy_n(weights_, weights.size(), weights.data());
+    std::copy_n(bias_, bias.size(), bias.data());
+    filtersValid = false;
+  }
 };
 
 ///===--------------------------------------------------------------------===///
 /// Max pool layer
 ///===--------------------------------------------------------------------===///
-template <unsigned mbSize,
-          unsigned poolX,
+template <unsigned poolX,
           unsigned poolY,
           unsigned inputX,
           unsigned inputY,
           unsigned inputZ>
-class MaxPoolLayer : public Layer<mbSize> {
-  Layer<mbSize> *inputs;
-  Layer<mbSize> *outputs;
-  boost::multi_array<Neuron<mbSize>*, 3> neurons; // [x][y][z]
+class MaxPoolLayer : public Layer {
+  static constexpr unsigned outputX = inputX / poolX;
+  static constexpr unsigned outputY = inputY / poolY;
+  unsigned grainSize;
+  Layer *inputs;
+  Layer *outputs;
+  Tensor bwdErrors; // [mb][z][y][x]
+
+  /// Compute output row y of channel z for image mb.
+  void feedForward(unsigned mb, unsigned z, unsigned y) {
+    // Take the maximum activation over each pool area.
+    const float *in = inputs->getActivations(mb);
+    float *activations = this->getActivations(mb);
+    simd::kernels().maxPool(&in[getIndex(0, y * poolY, z, inputX, inputY)],
+                            inputX, poolX, poolY,
+                            &activations[getIndex(0, y, z, outputX, outputY)],
+                            outputX);
+  }
+
+  /// Compute the backwards error for the input rows of output row y of
+  /// channel z for image mb.
+  void calcBwdError(unsigned mb, unsigned z, unsigned y) {
+    // Forward the backwards error component from the next layer to the input
+    // neuron that was the maximum in each pool area, and zero to the rest.
+    const float *in = inputs->getActivations(mb);
+    const float *activations = this->getActivations(mb);
+    const float *nextBwdError = outputs->getBwdErrors(mb);
+    float *bwdError = &bwdErrors[mb * inputX * inputY * inputZ];
+    unsigned index = getIndex(0, y, z, outputX, outputY);
+    unsigned inIndex = getIndex(0, y * poolY, z, inputX, inputY);
+    simd::kernels().maxPoolBackward(&in[inIndex], inputX, poolX, poolY,
+                                    &activations[index], &nextBwdError[index],
+                                    outputX, &bwdError[inIndex]);
+  }
 
 public:
-  MaxPoolLayer() :
-      inputs(nullptr), outputs(nullptr),
-      neurons(boost::extents[inputX / poolX][inputY / poolY][inputZ]) {
+  MaxPoolLayer(Params params = Params()) :
+      Layer(outputX, outputY, inputZ),
+      grainSize(params.grainSize),
+      inputs(nullptr), outputs(nullptr) {
     static_assert(inputX % poolX == 0, "Dimension x mismatch with pooling");
     static_assert(inputY % poolY == 0, "Dimension y mismatch with pooling");
-    for (unsigned x = 0; x < neurons.shape()[0]; ++x) {
-      for (unsigned y = 0; y < neurons.shape()[1]; ++y) {
-        for (unsigned z = 0; z < neurons.shape()[2]; ++z) {
-          neurons[x][y][z] = new Neuron<mbSize>(x, y, z);
-        }
-      }
-    }
+  }
+
+  void setBatchSize(unsigned mbSize_) override {
+    Layer::setBatchSize(mbSize_);
+    bwdErrors.resize(mbSize * inputX * inputY * inputZ);
   }
 
   void initialiseDefaultWeights(std::default_random_engine&) override {
     /* Skip */
   }
 
-  void feedForward(unsigned mb) override {
-    // For each neuron in this layer.
-    for (unsigned x = 0; x < neurons.shape()[0]; ++x) {
-      for (unsigned y = 0; y < neurons.shape()[1]; ++y) {
-        for (unsigned z = 0; z < neurons.shape()[2]; ++z) {
-          // Take maximum activation over pool area.
-          float weightedInput = std::numeric_limits<float>::min();
-          for (unsigned a = 0; a < poolX; ++a) {
-            for (unsigned b = 0; b < poolY; ++b) {
-              unsigned nX = (x * poolX) + a;
-              unsigned nY = (y * poolY) + b;
-              float input = inputs->getNeuron(nX, nY, z).activations[mb];
-              float max = std::max(weightedInput, input);
-              neurons[x][y][z]->activations[mb] = max;
-            }
-          }
-        }
+  void feedForward() override {
+    parallelFor(mbSize * inputZ * outputY, poolX * poolY * outputX, grainSize,
+                [this](unsigned begin, unsigned end) {
+      for (unsigned i = begin; i < end; ++i) {
+        feedForward(i / (inputZ * outputY), (i / outputY) % inputZ,
+                    i % outputY);
       }
-    }
+    });
   }
 
-  void calcBwdError(unsigned) override { /* Skip */ }
-  void backPropogate(unsigned) override { /* Skip */ }
-
-  float getBwdError(unsigned x, unsigned y, unsigned z, unsigned mb) override {
-    // Forward the backwards error component from the next layer.
-    unsigned nX = x / poolX;
-    unsigned nY = y / poolY;
-    unsigned nZ = z;
-    unsigned dimX = neurons.shape()[0];
-    unsigned dimY = neurons.shape()[1];
-    // If next layer is 1D, map the x, y, z coordinates onto it.
-    unsigned index = getIndex(nX, nY, nZ, dimX, dimY);
-    return outputs->getNumDims() == 1
-             ? outputs->getBwdError(index, mb)
-             : outputs->getBwdError(nX, nY, nZ, mb);
+  void calcBwdError() override {
+    parallelFor(mbSize * inputZ * outputY, poolX * poolY * outputX, grainSize,
+                [this](unsigned begin, unsigned end) {
+      for (unsigned i = begin; i < end; ++i) {
+        calcBwdError(i / (inputZ * outputY), (i / outputY) % inputZ,
+                     i % outputY);
+      }
+    });
   }
 
-  void endBatch(unsigned) override { /* Skip */ }
+  void backPropogate() override { /* Skip */ }
+
+  void accumulateGradients() override { /* Skip */ }
+
+  void applyGradients(float, unsigned, unsigned) override { /* Skip */ }
 
-  float getBwdError(unsigned, unsigned) override {
-    UNREACHABLE(); // No FC layers preceed max-pooling layers.
+  void endBatch(float, unsigned, unsigned) override { /* Skip */ }
+
+  const float *getBwdErrors(unsigned mb) override {
+    return &bwdErrors[mb * inputX * inputY * inputZ];
   }
 
-  void setInputs(Layer<mbSize> *layer) override {
-    assert(layer->size() == poolX * poolY * neurons.num_elements() &&
+  void setInputs(Layer *layer) override {
+    assert(layer->size() == poolX * poolY * this->size() &&
            "invalid input layer size");
     inputs = layer;
   }
 
-  void setOutputs(Layer<mbSize> *layer) override { outputs = layer; }
+  void setOutputs(Layer *layer) override { outputs = layer; }
+
+  Layer *clone() const override { return new MaxPoolLayer(*this); }
+
+  void save(model::Writer &writer) const override {
+    writer.addLayer(model::LayerKind::MaxPool, model::Activation::None,
+                    {poolX, poolY, inputX, inputY, inputZ},
+                    nullptr, 0, nullptr, 0);
+  }
+
+  void load(const float*, const float*) override { /* Skip */ }
+};
 
-  Neuron<mbSize> &getNeuron(unsigned index) override {
-    // Map a 1D index onto the 3D neurons (for Conv <- FC connections).
-    unsigned dimX = neurons.shape()[0];
-    unsigned dimY = neurons.shape()[1];
-    unsigned x = getX(index, dimX);
-    unsigned y = getY(index, dimX, dimY);
-    unsigned z = getZ(index, dimX, dimY);
-    return *neurons[x][y][z];
+///===--------------------------------------------------------------------===///
+/// Inference network.
+///
+/// A trained network frozen for scoring. Its stages read their parameters
+/// in place from a model, either built in memory from a trained network or
+/// mapped from a model file. Besides the model, it holds two activation
+/// buffers, which the stages read from and write to in turn, with none of the
+/// weighted inputs, errors or backwards storage of training. Batches of any
+/// size are classified, up to batchSize images at a time.
+///===--------------------------------------------------------------------===///
+class InferenceNetwork {
+  model::Buffer buffer;             // The model, if held in memory,
+  std::unique_ptr<MappedFile> file; // or if mapped from a file.
+  unsigned inputSize;
+  unsigned batchSize;
+  std::vector<std::unique_ptr<InferenceStage>> stages;
+  Tensor buffers[2]; // [image][z][y][x]
+
+  static void check(bool condition, const char *name, const char *reason) {
+    if (!condition) {
+      std::cout << "Invalid model " << name << ": " << reason << '\n';
+      std::exit(1);
+    }
   }
 
-  Neuron<mbSize> &getNeuron(unsigned x, unsigned y, unsigned z) override {
-    return *neurons[x][y][z];
+  /// Create a stage for each layer of the model, checking that the layers
+  /// fit together.
+  void createStages(const char *data, uint64_t size, const char *name,
+                    Params params) {
+    model::Reader reader(data, size, name);
+    const model::Header &header = reader.getHeader();
+    inputSize = header.inputX * header.inputY;
+    unsigned prevSize = inputSize;
+    unsigned maxSize = inputSize;
+    for (unsigned i = 0; i < header.numLayers; ++i) {
+      const model::LayerDescriptor &layer = reader.getLayer(i);
+      const uint32_t *dims = layer.dims;
+      bool pooling = layer.kind == model::LayerKind::MaxPool;
+      check(pooling == (layer.activation == model::Activation::None), name,
+            "bad layer activation");
+      InferenceStage *stage = nullptr;
+      uint64_t numWeights = 0, numBias = 0;
+      switch (layer.kind) {
+      case model::LayerKind::FullyConnected:
+        check(dims[1] == prevSize, name, "bad layer size");
+        numWeights = uint64_t(dims[0]) * dims[1];
+        numBias = dims[0];
+        stage = new FullyConnectedStage(dims[0], dims[1],
+                                        reader.getWeights(i),
+                                        reader.getBias(i),
+                                        getBatchActivationFn(layer.activation),
+                                        params.grainSize);
+        break;
+      case model::LayerKind::Conv:
+        check(dims[0] && dims[1] && dims[0] <= dims[2] && dims[1] <= dims[3] &&
+              dims[2] * dims[3] * dims[4] == prevSize, name, "bad layer size");
+        numWeights = uint64_t(dims[0]) * dims[1] * dims[4] * dims[5];
+        numBias = dims[5];
+        stage = new ConvStage(dims[0], dims[1], dims[2], dims[3], dims[4],
+                              dims[5], reader.getWeights(i), reader.getBias(i),
+                              getBatchActivationFn(layer.activation));
+        break;
+      case model::LayerKind::MaxPool:
+        check(dims[0] && dims[1] && dims[2] % dims[0] == 0 &&
+              dims[3] % dims[1] == 0 && dims[2] * dims[3] * dims[4] == prevSize,
+              name, "bad layer size");
+        stage = new MaxPoolStage(dims[0], dims[1], dims[2], dims[3], dims[4],
+                                 params.grainSize);
+        break;
+      }
+      stages.emplace_back(stage);
+      check(layer.numWeights == numWeights && layer.numBias == numBias, name,
+            "bad parameter count");
+      prevSize = stage->size();
+      maxSize = std::max(maxSize, prevSize);
+    }
+    check(header.numLayers > 0 &&
+          reader.getLayer(header.numLayers - 1).activation ==
+            model::Activation::SoftMax, name, "last layer is not softmax");
+    buffers[0].resize(batchSize * maxSize);
+    buffers[1].resize(batchSize * maxSize);
   }
 
-  unsigned getNumDims() override { return neurons.num_dimensions(); }
-  unsigned getDim(unsigned i) override { return neurons.shape()[i]; }
-  unsigned size() override { return neurons.num_elements(); }
+public:
+  /// The class and the softmax scores of each image of a batch.
+  struct Predictions {
+    std::vector<unsigned> classes; // [image]
+    std::vector<float> scores;     // [image][class]
+  };
+
+  /// An inference network over a model held in memory.
+  InferenceNetwork(model::Buffer buffer_, unsigned batchSize,
+                   Params params = Params()) :
+      buffer(std::move(buffer_)), batchSize(batchSize) {
+    createStages(buffer.data(), buffer.size(), "in memory", params);
+  }
+
+  /// An inference network over a model file, which is mapped into memory.
+  InferenceNetwork(const char *filename, unsigned batchSize,
+                   Params params = Params()) :
+      file(new MappedFile(filename)), batchSize(batchSize) {
+    createStages(file->getData(), file->getSize(), filename, params);
+  }
+
+  unsigned numClasses() const { return stages.back()->size(); }
+
+  /// Classify a batch of images.
+  Predictions predict(const std::vector<Image> &images) {
+    unsigned numImages = images.size();
+    unsigned n = numClasses();
+    Predictions predictions;
+    predictions.classes.resize(numImages);
+    predictions.scores.resize(numImages * n);
+    for (unsigned i = 0; i < numImages; i += batchSize) {
+      unsigned count = std::min(batchSize, numImages - i);
+      for (unsigned j = 0; j < count; ++j) {
+        assert(images[i + j].size() == inputSize && "invalid image size");
+        images[i + j].copyTo(&buffers[0][j * inputSize]);
+      }
+      unsigned current = 0;
+      for (auto &stage : stages) {
+        stage->feedForward(buffers[current].data(),
+                           buffers[1 - current].data(), count);
+        current = 1 - current;
+      }
+      const float *scores = buffers[current].data();
+      std::copy(scores, scores + (count * n), &predictions.scores[i * n]);
+      for (unsigned j = 0; j < count; ++j) {
+        const float *imageScores = &scores[j * n];
+        predictions.classes[i + j] =
+          std::max_element(imageScores, imageScores + n) - imageScores;
+      }
+    }
+    return predictions;
+  }
 };
 
 ///===--------------------------------------------------------------------===///
 /// The network.
+///
+/// The training and evaluation loops are shared by two ways of composing the
+/// layers. Network holds a list of layers created at run time and drives them
+/// through the virtual layer interface. StaticNetwork takes the layer types
+/// as template parameters and holds the layers by value, so that each pass
+/// over them is unrolled and bound at compile time. Each provides
+/// feedForward(), backPropogateLayers(), accumulateGradientsLayers(),
+/// endBatchLayers(), saveLayers(), setLayersBatchSize() and getSoftMaxLayer()
+/// to the shared base. Training runs in minibatches of Params::mbSize images
+/// and evaluation in batches of Params::evalBatchSize, both chosen at run
+/// time. Each update of the weights follows Params::accumulationSteps
+/// minibatches, whose gradients are summed, so that an update covers more
+/// images than fit in a minibatch. With Params::numReplicas above one, that
+/// many copies of the network each train on their own minibatches at once,
+/// and their gradients are summed by an all-reduce before each update. With
+/// Params::numProcesses above one, as many processes do the same, each on
+/// its own slice of each step, reducing their gradients over a
+/// transport::Group.
 ///===--------------------------------------------------------------------===///
-template <unsigned mbSize,
+template <typename NetworkTy,
           unsigned inputX,
           unsigned inputY,
-          unsigned softMaxSize,
-          unsigned lastLayerSize,
-          float (*costFn)(float, float),
-          float (*costDelta)(float, float, float)>
-class Network {
-  using SoftMaxLayerTy = SoftMaxLayer<mbSize, softMaxSize, lastLayerSize,
-                                      costFn, costDelta>;
-  using LayerTy = Layer<mbSize>;
+          typename SoftMaxLayerTy>
+class NetworkBase {
+protected:
   Params params;
-  InputLayer<mbSize, inputX, inputY> inputLayer;
-  SoftMaxLayerTy *softMaxLayer;
-  std::vector<LayerTy*> layers;
+  InputLayer<inputX, inputY> inputLayer;
   std::default_random_engine generator;
 
+  NetworkBase(Params params) : params(params), generator(params.seed) {}
+
+  NetworkTy &derived() { return static_cast<NetworkTy&>(*this); }
+
 public:
-  Network(Params params, std::vector<LayerTy*> layers_) :
-      params(params), layers(layers_), generator(params.seed) {
-    softMaxLayer = new SoftMaxLayerTy(params.learningRate, params.lambda);
-    layers.push_back(softMaxLayer);
-    // Set neuron inputs.
-    layers[0]->setInputs(&inputLayer);
-    layers[0]->initialiseDefaultWeights(generator);
-    for (unsigned i = 1; i < layers.size(); ++i) {
-      layers[i]->setInputs(layers[i - 1]);
-      layers[i]->initialiseDefaultWeights(generator);
-    }
-    // Set neuron outputs.
-    for (unsigned i = 0; i < layers.size() - 1; ++i) {
-      layers[i]->setOutputs(layers[i + 1]);
-    }
+  /// Size the network for minibatches of mbSize images.
+  void setBatchSize(unsigned mbSize) {
+    inputLayer.setBatchSize(mbSize);
+    derived().setLayersBatchSize(mbSize);
   }
 
-  /// The forward pass.
-  void feedForward(unsigned mb) {
-    for (auto layer : layers) {
-      layer->feedForward(mb);
+  unsigned getBatchSize() const { return inputLayer.getBatchSize(); }
+
+  /// Load a minibatch of images into the input layer.
+  void setImages(std::vector<Image>::const_iterator imagesIt) {
+    for (unsigned mb = 0; mb < getBatchSize(); ++mb) {
+      inputLayer.setImage(*(imagesIt + mb), mb);
     }
   }
 
-  /// The backward pass.
-  void backPropogate(Image &image, uint8_t label, unsigned mb) {
+  /// The backward pass, for a staged minibatch of the network's batch size.
+  /// Its images are exchanged with the input layer's previous ones.
+  void backPropogate(Minibatch &batch) {
     // Set input.
-    inputLayer.setImage(image, mb);
+    inputLayer.swapImages(batch.images);
     // Feed forward.
-    feedForward(mb);
+    derived().feedForward();
     // Compute output error in last layer.
-    softMaxLayer->computeOutputError(label, mb);
-    softMaxLayer->calcBwdError(mb);
+    SoftMaxLayerTy &softMaxLayer = derived().getSoftMaxLayer();
+    for (unsigned mb = 0; mb < getBatchSize(); ++mb) {
+      softMaxLayer.computeOutputError(batch.labels[mb], mb);
+    }
+    softMaxLayer.calcBwdError();
     // Backpropagate the error and calculate component for next layer.
-    for (int i = layers.size() - 2; i > 0; --i) {
-      layers[i]->backPropogate(mb);
-      layers[i]->calcBwdError(mb);
+    derived().backPropogateLayers();
+  }
+
+  /// Back propogate a minibatch and keep its gradients for the next update.
+  void accumulateMiniBatch(Minibatch &batch) {
+    backPropogate(batch);
+    derived().accumulateGradientsLayers();
+  }
+
+  /// Back propogate a minibatch and keep its gradients for the next update,
+  /// handing each layer's to ready() once they are summed, from the last
+  /// layer back, so that their reduction overlaps the rest of the pass.
+  template <typename Fn>
+  void accumulateMiniBatch(Minibatch &batch, const Fn &ready) {
+    inputLayer.swapImages(batch.images);
+    derived().feedForward();
+    SoftMaxLayerTy &softMaxLayer = derived().getSoftMaxLayer();
+    for (unsigned mb = 0; mb < getBatchSize(); ++mb) {
+      softMaxLayer.computeOutputError(batch.labels[mb], mb);
     }
-    layers[0]->backPropogate(mb);
+    derived().backPropogateAccumulateLayers(ready);
   }
 
-  void updateMiniBatch(std::vector<Image>::iterator trainingImagesIt,
-                       std::vector<uint8_t>::iterator trainingLabelsIt,
-                       unsigned numTrainingImages) {
-    // For each training image and label, back propogate.
-    // Parallelise over the elements of the minibatch to improve performance.
-    tbb::parallel_for(size_t(0), size_t(mbSize), [=](size_t i) {
-      backPropogate(*(trainingImagesIt + i), *(trainingLabelsIt + i), i);
-    });
+  /// Back propogate the last minibatch of an update of numImages images and
+  /// apply the gradients summed over them at the given learning rate.
+  void updateMiniBatch(Minibatch &batch, float learningRate,
+                       unsigned numImages, unsigned numTrainingImages) {
+    // For each training image and label, back propogate. Each layer
+    // parallelises over the elements of the minibatch internally.
+    backPropogate(batch);
     // Gradient descent: for every neuron, compute the new weights and biases.
-    for (int i = layers.size() - 1; i >= 0; --i) {
-      layers[i]->endBatch(numTrainingImages);
+    derived().endBatchLayers(learningRate, numImages, numTrainingImages);
+  }
+
+  /// The learning rate of the update whose first image is at the given
+  /// position in the run. It is Params::learningRate, multiplied by the
+  /// minibatches in each update, Params::accumulationSteps times
+  /// Params::numReplicas times Params::numProcesses, if
+  /// Params::scaleLearningRate is set, in which case it rises to that
+  /// linearly over Params::warmupImages.
+  float getLearningRate(uint64_t position) const {
+    float rate = params.learningRate;
+    if (!params.scaleLearningRate) {
+      return rate;
+    }
+    float scaled = rate * params.accumulationSteps * params.numReplicas *
+                   params.numProcesses;
+    if (position >= params.warmupImages) {
+      return scaled;
     }
+    return rate + ((scaled - rate) * float(double(position) /
+                                           params.warmupImages));
+  }
+
+  /// The shape and parameters of the network's layers.
+  model::Writer getModel() {
+    model::Writer writer(inputX, inputY);
+    derived().saveLayers(writer);
+    return writer;
+  }
+
+  /// Write the network to a model file.
+  void save(const char *filename) { getModel().write(filename); }
+
+  /// Set the weights from a model file written by the same network.
+  void load(const char *filename) {
+    MappedFile file(filename);
+    loadModel(model::Reader(file.getData(), file.getSize(), filename),
+              filename);
+  }
+
+  /// Freeze the trained network into an inference network that classifies up
+  /// to batchSize images at a time.
+  InferenceNetwork freeze(unsigned batchSize) {
+    return InferenceNetwork(getModel().getBuffer(), batchSize, params);
+  }
+
+  InferenceNetwork freeze() { return freeze(getEvalBatchSize()); }
+
+  /// The number of images fed forward at a time in evaluation.
+  unsigned getEvalBatchSize() const {
+    return params.evalBatchSize ? params.evalBatchSize : params.mbSize;
   }
 
-  float imageCost(Image &image, uint8_t label,
-                  unsigned numImages, float regularisation, unsigned mb) {
-    inputLayer.setImage(image, mb);
-    feedForward(mb);
-    float cost = softMaxLayer->computeOutputCost(label, mb) / numImages;
-    cost += regularisation;
-    return cost;
+  /// Sum fn(softMaxLayer, mb, label) over a dataset, after feeding each
+  /// batch of it forward. All the batches are scored in one parallel sweep,
+  /// each thread using its own copy of the network as a workspace. The sum
+  /// is combined in the same order for any number of threads.
+  template <typename T, typename Fn>
+  T evaluate(const std::vector<Image> &images,
+             const std::vector<uint8_t> &labels, const Fn &fn) {
+    unsigned batchSize = getEvalBatchSize();
+    unsigned numImages = images.size();
+    tbb::enumerable_thread_specific<std::unique_ptr<NetworkTy>> copies;
+    auto score = [&](const tbb::blocked_range<unsigned> &r, T result) {
+      std::unique_ptr<NetworkTy> &copy = copies.local();
+      if (!copy) {
+        copy.reset(new NetworkTy(derived()));
+      }
+      for (unsigned i = r.begin(); i < r.end(); ++i) {
+        // The last batch holds the images left over.
+        unsigned first = i * batchSize;
+        unsigned count = std::min(batchSize, numImages - first);
+        // Keep this thread from taking another batch, which would use the
+        // same copy, while it waits inside the layers' parallel loops.
+        tbb::this_task_arena::isolate([&] {
+          if (copy->getBatchSize() != count) {
+            copy->setBatchSize(count);
+          }
+          copy->setImages(images.begin() + first);
+          copy->feedForward();
+        });
+        for (unsigned mb = 0; mb < count; ++mb) {
+          result += fn(copy->getSoftMaxLayer(), mb, labels[first + mb]);
+        }
+      }
+      return result;
+    };
+    return tbb::parallel_deterministic_reduce(
+      tbb::blocked_range<unsigned>(0, (numImages + batchSize - 1) / batchSize),
+      T(), score, std::plus<T>());
   }
 
   /// Calculate the total cost for a dataset.
-  /// Parallelise over the test images (up to the minibatch size).
-  float evaluateTotalCost(std::vector<Image> &testImages,
-                          std::vector<uint8_t> &testLabels) {
+  float evaluateTotalCost(const std::vector<Image> &testImages,
+                          const std::vector<uint8_t> &testLabels) {
     float regularisation = 0.5f * (params.lambda / testImages.size())
-                            * softMaxLayer->sumSquaredWeights();
-    float cost = 0.0f;
-    for (unsigned i = 0, end = testImages.size(); i < end; i += mbSize) {
-      auto mbStart = std::chrono::high_resolution_clock::now();
-      // Parallel reduce over the minibatch.
-      cost +=
-        tbb::parallel_reduce(
-          tbb::blocked_range<size_t>(0, mbSize), 0.0f,
-          [&](const tbb::blocked_range<size_t> &r, float total) {
-            for (size_t mb = r.begin(); mb < r.end(); ++mb) {
-              total += imageCost(*(testImages.begin() + i + mb),
-                                 *(testLabels.begin() + i + mb),
-                                 testImages.size(), regularisation, mb);
-            }
-            return total;
-          }, std::plus<float>());
-      auto mbEnd = std::chrono::high_resolution_clock::now();
-      auto ms =
-        std::chrono::duration_cast<std::chrono::milliseconds>(mbEnd-mbStart);
-      float imagesPerSec = (float(mbSize) / ms.count()) * 1000.0f;
-      std::cout << "\rEvaluate cost " << i << " / " << end
-                << " (" << imagesPerSec << " imgs/s)";
-    }
-    return cost;
+                            * derived().getSoftMaxLayer().sumSquaredWeights();
+    float cost = evaluate<float>(testImages, testLabels,
+        [](SoftMaxLayerTy &softMaxLayer, unsigned mb, uint8_t label) {
+          return softMaxLayer.computeOutputCost(label, mb);
+        });
+    return (cost / testImages.size()) + (testImages.size() * regularisation);
   }
 
-  bool testImage(Image &image, uint8_t label, unsigned mb) {
-    inputLayer.setImage(image, mb);
-    feedForward(mb);
-    return softMaxLayer->readOutput(mb) == label;
+  /// Evaluate the test set and return the number of correct classifications.
+  unsigned evaluateAccuracy(const std::vector<Image> &testImages,
+                            const std::vector<uint8_t> &testLabels) {
+    return evaluate<unsigned>(testImages, testLabels,
+        [](SoftMaxLayerTy &softMaxLayer, unsigned mb, uint8_t label) {
+          return unsigned(softMaxLayer.readOutput(mb) == label);
+        });
+  }
+
+  /// Start a run of SGD from the current weights, on a Data or a
+  /// StreamingData.
+  template <typename DataTy>
+  void SGD(const DataTy &data) {
+    checkpoint::State state;
+    state.mbSize = params.mbSize;
+    state.accumulationSteps = params.accumulationSteps;
+    state.numReplicas = params.numReplicas;
+    state.numProcesses = params.numProcesses;
+    state.numTrainingImages = data.getNumTrainingImages();
+    train(data, state);
+  }
+
+  /// Continue a run of SGD from the checkpoint in params.checkpointFile. The
+  /// network and data should be created as they were for the run, which then
+  /// follows the same trajectory as if it had not stopped.
+  template <typename DataTy>
+  void resume(const DataTy &data) {
+    const char *filename = params.checkpointFile.c_str();
+    checkpoint::State state = checkpoint::read(filename);
+    if (state.mbSize != params.mbSize ||
+        state.accumulationSteps != params.accumulationSteps ||
+        state.numReplicas != params.numReplicas ||
+        state.numProcesses != params.numProcesses ||
+        state.numTrainingImages != data.getNumTrainingImages()) {
+      std::cout << "Error: checkpoint " << filename
+                << " was made with a different minibatch, update, number of "
+                   "replicas or processes, or training set\n";
+      std::exit(1);
+    }
+    loadModel(model::Reader(state.model.data(), state.model.size(), filename),
+              filename);
+    std::istringstream(state.generatorState) >> generator;
+    std::cout << "Resuming epoch " << state.epoch << " at image "
+              << state.nextImage << '\n';
+    train(data, state);
+  }
+
+private:
+  /// Set the weights from a model of the same network.
+  void loadModel(const model::Reader &reader, const char *name) {
+    model::Buffer own = getModel().getBuffer();
+    model::Reader expected(own.data(), own.size(), "network");
+    bool match =
+      reader.getHeader().inputX == inputX &&
+      reader.getHeader().inputY == inputY &&
+      reader.getHeader().numLayers == expected.getHeader().numLayers;
+    for (unsigned i = 0; match && i < expected.getHeader().numLayers; ++i) {
+      match = model::sameShape(reader.getLayer(i), expected.getLayer(i));
+    }
+    if (!match) {
+      std::cout << "Error: model " << name << " does not match the network\n";
+      std::exit(1);
+    }
+    derived().loadLayers(reader);
+  }
+
+  /// Start the processes of a run from the weights and random number
+  /// generator of the process of rank 0.
+  void synchronise(transport::Group &group) {
+    model::Buffer buffer = getModel().getBuffer();
+    group.broadcast(buffer.data(), buffer.size());
+    std::ostringstream generatorState;
+    generatorState << generator;
+    std::string state = generatorState.str();
+    uint64_t stateSize = state.size();
+    group.broadcast(&stateSize, sizeof(stateSize));
+    state.resize(stateSize);
+    group.broadcast(&state[0], stateSize);
+    if (group.getRank() != 0) {
+      loadModel(model::Reader(buffer.data(), buffer.size(), "process 0"),
+                "process 0");
+      std::istringstream(state) >> generator;
+    }
   }
 
-  /// Evaluate the test set and return the number of correct classifications.
-  /// Parallelise over the test images (up to the minibatch size).
-  unsigned evaluateAccuracy(std::vector<Image> &testImages,
-                            std::vector<uint8_t> &testLabels) {
-    unsigned result = 0;
-    for (unsigned i = 0, end = testImages.size(); i < end; i += mbSize) {
-      auto mbStart = std::chrono::high_resolution_clock::now();
-      // Parallel reduce over the minibatch.
-      result +=
-        tbb::parallel_reduce(
-          tbb::blocked_range<size_t>(0, mbSize), 0,
-          [&](const tbb::blocked_range<size_t> &r, unsigned total) {
-            for (size_t mb = r.begin(); mb < r.end(); ++mb) {
-              total += testImage(*(testImages.begin() + i + mb),
-                                 *(testLabels.begin() + i + mb), mb);
-            }
-            return total;
-          }, std::plus<unsigned>());
-      auto mbEnd = std::chrono::high_resolution_clock::now();
-      auto ms =
-        std::chrono::duration_cast<std::chrono::milliseconds>(mbEnd-mbStart);
-      float imagesPerSec = (float(mbSize) / ms.count()) * 1000.0f;
-      std::cout << "\rEvaluate accuracy " << i << " / " << end
-                << " (" << imagesPerSec << " imgs/s)";
+  /// Back propogate the last step of an update on each replica, sum their
+  /// gradients, and those of the other processes if there is a reducer, and
+  /// apply the total, averaged over numImages images, with the weight decay
+  /// of a training set of numTrainingImages.
+  void updateReplicas(Replicas<NetworkTy> &replicas,
+                      const std::vector<Minibatch*> &batches,
+                      transport::AsyncAllReduce *reducer, float learningRate,
+                      unsigned numImages, unsigned numTrainingImages) {
+    auto post = [reducer](Tensor *gradients) {
+      reducer->post(gradients->data(), gradients->size());
+    };
+    if (!reducer) {
+      replicas.run([&](NetworkTy &replica, unsigned r) {
+        replica.accumulateMiniBatch(*batches[r]);
+      });
+      replicas.allReduce();
+    } else if (replicas.size() == 1) {
+      // Each layer's gradients are exchanged while the earlier layers are
+      // back propogated.
+      accumulateMiniBatch(*batches[0], post);
+      reducer->wait();
+    } else {
+      replicas.run([&](NetworkTy &replica, unsigned r) {
+        replica.accumulateMiniBatch(*batches[r]);
+      });
+      replicas.reduce();
+      std::vector<Tensor*> gradients;
+      derived().getGradientsLayers(gradients);
+      std::for_each(gradients.begin(), gradients.end(), post);
+      reducer->wait();
+      replicas.broadcast();
     }
-    return result;
+    replicas.run([&](NetworkTy &replica, unsigned) {
+      replica.applyGradientsLayers(learningRate, numImages,
+                                   numTrainingImages);
+    });
   }
 
-  void SGD(Data &data) {
+  /// Snapshot the run, to be written in the background.
+  void writeCheckpoint(checkpoint::AsyncWriter &writer,
+                       checkpoint::State &state, double &stallMs) {
+    auto start = std::chrono::high_resolution_clock::now();
+    std::ostringstream generatorState;
+    generatorState << generator;
+    state.generatorState = generatorState.str();
+    state.model = getModel().getBuffer();
+    writer.write(state);
+    auto end = std::chrono::high_resolution_clock::now();
+    stallMs += std::chrono::duration<double, std::milli>(end - start).count();
+  }
+
+  template <typename DataTy>
+  void train(const DataTy &data, checkpoint::State state) {
+    unsigned mbSize = params.mbSize;
+    unsigned numReplicas = params.numReplicas;
+    unsigned numProcesses = params.numProcesses;
+    if (!params.accumulationSteps || !numReplicas || !numProcesses) {
+      std::cout << "Error: each update needs at least one minibatch\n";
+      std::exit(1);
+    }
+    // Each step trains a minibatch on each replica of each process, and each
+    // process takes its own slice of the step.
+    unsigned processStepSize = mbSize * numReplicas;
+    unsigned stepSize = processStepSize * numProcesses;
+    unsigned updateSize = stepSize * params.accumulationSteps;
+    std::unique_ptr<transport::Group> group;
+    std::unique_ptr<transport::AsyncAllReduce> reducer;
+    unsigned rank = 0;
+    if (numProcesses > 1) {
+      group = transport::connect(params);
+      reducer.reset(new transport::AsyncAllReduce(*group));
+      rank = group->getRank();
+      synchronise(*group);
+    }
+    bool leader = rank == 0;
+    setBatchSize(mbSize);
+    Replicas<NetworkTy> replicas(derived(), numReplicas, params.grainSize);
+    checkpoint::AsyncWriter checkpointWriter(params.checkpointFile);
+    bool checkpointing = leader && !params.checkpointFile.empty();
+    double checkpointStallMs = 0.0;
+    // The training set is shuffled each epoch. Repeat the shuffles made so
+    // far. Any images left over from whole updates are not visited.
+    typename DataTy::TrainingSet trainingSet(data);
+    for (uint32_t seed : state.shuffleSeeds) {
+      trainingSet.shuffle(seed);
+    }
+    unsigned numTrainingImages = trainingSet.size() -
+                                 (trainingSet.size() % updateSize);
     // For each epoch.
-    for (unsigned epoch = 0; epoch < params.numEpochs; ++epoch) {
+    while (state.epoch < params.numEpochs) {
+      unsigned epoch = state.epoch;
       auto epochStart = std::chrono::high_resolution_clock::now();
-      // Identically randomly shuffle the training images and labels.
-      std::uniform_int_distribution<unsigned> distribution;
-      unsigned seed = distribution.operator ()(generator);
-      std::shuffle(data.getTrainingLabels().begin(),
-                   data.getTrainingLabels().end(),
-                   std::default_random_engine(seed));
-      std::shuffle(data.getTrainingImages().begin(),
-                   data.getTrainingImages().end(),
-                   std::default_random_engine(seed));
-      // For each mini batch.
-      unsigned numTrainingImages = data.getTrainingImages().size();
-      for (unsigned i = 0; i < numTrainingImages; i += mbSize) {
+      if (state.shuffleSeeds.size() == epoch) {
+        std::uniform_int_distribution<unsigned> distribution;
+        unsigned seed = distribution.operator ()(generator);
+        state.shuffleSeeds.push_back(seed);
+        trainingSet.shuffle(seed);
+      }
+      trainingSet.seek(state.nextImage);
+      // Gather the minibatches, augmenting them, ahead of training or on
+      // demand.
+      Augmenter augmenter(params, mbSize, inputX, inputY);
+      uint32_t epochSeed = state.shuffleSeeds[epoch];
+      unsigned firstImage = state.nextImage;
+      unsigned nextGathered = firstImage;
+      unsigned numGathered = 0;
+      auto gatherNext = [&](Minibatch &batch) {
+        // Pass over the images of the other processes.
+        unsigned position = firstImage +
+                            ((numGathered / numReplicas) * stepSize) +
+                            (rank * processStepSize) +
+                            ((numGathered % numReplicas) * mbSize);
+        trainingSet.skip(position - nextGathered);
+        trainingSet.gather(batch);
+        if (augmenter.isEnabled()) {
+          augmenter.apply(batch, epochSeed, position);
+        }
+        nextGathered = position + mbSize;
+        ++numGathered;
+      };
+      std::unique_ptr<Prefetcher> prefetcher;
+      std::vector<Minibatch> staged(numReplicas,
+                                    Minibatch(mbSize, inputX * inputY));
+      std::vector<Minibatch*> batches(numReplicas);
+      if (params.prefetchDepth) {
+        prefetcher.reset(new Prefetcher(
+            gatherNext,
+            ((numTrainingImages - firstImage) / stepSize) * numReplicas,
+            mbSize, inputX * inputY, params.prefetchDepth * numReplicas));
+      }
+      // For each step of a mini batch on each replica.
+      for (unsigned i = state.nextImage; i < numTrainingImages; i += stepSize) {
         auto mbStart = std::chrono::high_resolution_clock::now();
-        updateMiniBatch(data.getTrainingImages().begin() + i,
-                        data.getTrainingLabels().begin() + i,
-                        mbSize);
+        for (unsigned r = 0; r < numReplicas; ++r) {
+          batches[r] = &staged[r];
+          if (prefetcher) {
+            batches[r] = &prefetcher->next(r);
+          } else {
+            gatherNext(staged[r]);
+          }
+        }
+        // The last step of each update applies it, averaging the gradients
+        // over its images. The weight decay is scaled by the size of the
+        // training set, not of the update, so k steps of mbSize images
+        // decay the weights as one step of k * mbSize images does.
+        bool update = (i + stepSize) % updateSize == 0;
+        float rate = 0.0f;
+        if (update) {
+          unsigned updateStart = i + stepSize - updateSize;
+          rate = getLearningRate(
+              (uint64_t(epoch) * numTrainingImages) + updateStart);
+        }
+        if (!update) {
+          replicas.run([&](NetworkTy &replica, unsigned r) {
+            replica.accumulateMiniBatch(*batches[r]);
+          });
+        } else if (numReplicas == 1 && !group) {
+          updateMiniBatch(*batches[0], rate, updateSize, trainingSet.size());
+        } else {
+          updateReplicas(replicas, batches, reducer.get(), rate, updateSize,
+                         trainingSet.size());
+        }
+        if (prefetcher) {
+          for (unsigned r = 0; r < numReplicas; ++r) {
+            prefetcher->release();
+          }
+        }
         auto mbEnd = std::chrono::high_resolution_clock::now();
         auto ms =
           std::chrono::duration_cast<std::chrono::milliseconds>(mbEnd-mbStart);
-        float imagesPerSec = (float(mbSize) / ms.count()) * 1000.0f;
-        std::cout << "\rMinibatch " << i << " / " << numTrainingImages
-                  << " (" << imagesPerSec << " imgs/s)";
-        if (i % params.monitorInterval == 0) {
+        float imagesPerSec = (float(stepSize) / ms.count()) * 1000.0f;
+        if (leader) {
+          std::cout << "\rMinibatch " << i << " / " << numTrainingImages
+                    << " (" << imagesPerSec << " imgs/s)";
+        }
+        // Monitor after the first step of each epoch, and then each time the
+        // images trained pass a multiple of the interval, which steps of any
+        // size may not land on.
+        if (leader && (i == 0 || (i / params.monitorInterval) !=
+                                 ((i + stepSize) / params.monitorInterval))) {
           std::cout << '\r' << std::string(100, ' ');
           // Evaluate the test set.
           if (params.monitorEvaluationAccuracy) {
@@ -1102,15 +2257,481 @@ public:
             std::cout << "\rCost on test data: " << cost << "\n";
           }
         }
+        // Checkpoints fall between updates, since the gradients summed in
+        // one are not saved.
+        state.nextImage = i + stepSize;
+        if (checkpointing && params.checkpointInterval &&
+            state.nextImage % updateSize == 0 &&
+            state.nextImage < numTrainingImages &&
+            (state.nextImage / params.checkpointInterval) !=
+                ((state.nextImage - updateSize) /
+                 params.checkpointInterval)) {
+          writeCheckpoint(checkpointWriter, state, checkpointStallMs);
+        }
       }
-      std::cout << '\n';
-      // Display end of epoch and time.
-      auto epochEnd = std::chrono::high_resolution_clock::now();
-      auto s =
-        std::chrono::duration_cast<std::chrono::seconds>(epochEnd-epochStart);
-      std::cout << "Epoch " << epoch << " complete in " << s.count() << " s.\n";
+      if (leader) {
+        std::cout << '\n';
+        // Display end of epoch and time.
+        auto epochEnd = std::chrono::high_resolution_clock::now();
+        auto s = std::chrono::duration_cast<std::chrono::seconds>(
+                     epochEnd - epochStart);
+        std::cout << "Epoch " << epoch << " complete in " << s.count()
+                  << " s.\n";
+        if (augmenter.isEnabled()) {
+          double epochMs = std::chrono::duration<double, std::milli>(
+                               epochEnd - epochStart).count();
+          std::cout << "Augmented " << augmenter.getNumImages()
+                    << " images at " << augmenter.getImagesPerSec()
+                    << " imgs/s, trained at "
+                    << (numTrainingImages - firstImage) * 1000.0 / epochMs
+                    << " imgs/s\n";
+        }
+        if (prefetcher) {
+          std::cout << "Training waited for " << prefetcher->getNumStalls()
+                    << " minibatches to be gathered, for "
+                    << prefetcher->getStallMs() << " ms\n";
+        }
+        if (reducer) {
+          std::cout << "Training waited for the gradients of " << numProcesses
+                    << " processes for " << reducer->getWaitMs()
+                    << " ms in all\n";
+        }
+      }
+      ++state.epoch;
+      state.nextImage = 0;
+      if (checkpointing) {
+        writeCheckpoint(checkpointWriter, state, checkpointStallMs);
+      }
+    }
+    if (checkpointing) {
+      checkpointWriter.wait();
+      std::cout << checkpointWriter.getNumWrites() << " checkpoints written to "
+                << params.checkpointFile << " in "
+                << checkpointWriter.getMeanWriteMs() << " ms on average ("
+                << checkpointWriter.getMaxWriteMs() << " ms at most), "
+                << "stalling training for " << checkpointStallMs << " ms\n";
+    }
+    if (leader && !params.modelFile.empty()) {
+      save(params.modelFile.c_str());
+    }
+  }
+};
+
+/// A network of layers created at run time.
+template <unsigned inputX,
+          unsigned inputY,
+          unsigned softMaxSize,
+          unsigned lastLayerSize,
+          float (*costFn)(float, float),
+          float (*costDelta)(float, float, float)>
+class Network :
+    public NetworkBase<Network<inputX, inputY, softMaxSize,
+                               lastLayerSize, costFn, costDelta>,
+                       inputX, inputY,
+                       SoftMaxLayer<softMaxSize, lastLayerSize,
+                                    costFn, costDelta>> {
+  using SoftMaxLayerTy = SoftMaxLayer<softMaxSize, lastLayerSize,
+                                      costFn, costDelta>;
+  using BaseTy = NetworkBase<Network, inputX, inputY, SoftMaxLayerTy>;
+  using LayerTy = Layer;
+  SoftMaxLayerTy *softMaxLayer;
+  std::vector<LayerTy*> layers;
+  std::vector<std::unique_ptr<LayerTy>> clones; // Owned by a copy.
+
+  void connect() {
+    // Set neuron inputs.
+    layers[0]->setInputs(&this->inputLayer);
+    for (unsigned i = 1; i < layers.size(); ++i) {
+      layers[i]->setInputs(layers[i - 1]);
+    }
+    // Set neuron outputs.
+    for (unsigned i = 0; i < layers.size() - 1; ++i) {
+      layers[i]->setOutputs(layers[i + 1]);
+    }
+  }
+
+public:
+  Network(Params params, std::vector<LayerTy*> layers_) :
+      BaseTy(params), layers(layers_) {
+    softMaxLayer = new SoftMaxLayerTy(params);
+    layers.push_back(softMaxLayer);
+    connect();
+    this->setBatchSize(params.mbSize);
+    for (auto layer : layers) {
+      layer->initialiseDefaultWeights(this->generator);
+    }
+  }
+
+  /// A copy of the network with a clone of each of its layers.
+  Network(const Network &other) : BaseTy(other) {
+    for (auto layer : other.layers) {
+      clones.emplace_back(layer->clone());
+      layers.push_back(clones.back().get());
+    }
+    softMaxLayer = static_cast<SoftMaxLayerTy*>(layers.back());
+    connect();
+  }
+
+  Network &operator=(const Network&) = delete;
+
+  SoftMaxLayerTy &getSoftMaxLayer() { return *softMaxLayer; }
+
+  /// The forward pass.
+  void feedForward() {
+    for (auto layer : layers) {
+      layer->feedForward();
+    }
+  }
+
+  /// The backward pass through the layers before the softmax layer.
+  void backPropogateLayers() {
+    for (int i = layers.size() - 2; i > 0; --i) {
+      layers[i]->backPropogate();
+      layers[i]->calcBwdError();
+    }
+    layers[0]->backPropogate();
+  }
+
+  void accumulateGradientsLayers() {
+    for (int i = layers.size() - 1; i >= 0; --i) {
+      layers[i]->accumulateGradients();
+    }
+  }
+
+  /// The backward pass through all the layers, summing the gradients of each
+  /// as soon as its errors are known and passing them to ready().
+  template <typename Fn>
+  void backPropogateAccumulateLayers(const Fn &ready) {
+    for (int i = layers.size() - 1; i >= 0; --i) {
+      if (i != int(layers.size()) - 1) {
+        layers[i]->backPropogate();
+      }
+      if (i > 0) {
+        layers[i]->calcBwdError();
+      }
+      layers[i]->accumulateGradients();
+      if (Tensor *gradients = layers[i]->getGradients()) {
+        ready(gradients);
+      }
+    }
+  }
+
+  void applyGradientsLayers(float learningRate, unsigned numImages,
+                            unsigned numTrainingImages) {
+    for (int i = layers.size() - 1; i >= 0; --i) {
+      layers[i]->applyGradients(learningRate, numImages, numTrainingImages);
+    }
+  }
+
+  void endBatchLayers(float learningRate, unsigned numImages,
+                      unsigned numTrainingImages) {
+    for (int i = layers.size() - 1; i >= 0; --i) {
+      layers[i]->endBatch(learningRate, numImages, numTrainingImages);
+    }
+  }
+
+  void getGradientsLayers(std::vector<Tensor*> &gradients) {
+    for (auto layer : layers) {
+      if (Tensor *layerGradients = layer->getGradients()) {
+        gradients.push_back(layerGradients);
+      }
+    }
+  }
+
+  void setLayersBatchSize(unsigned mbSize) {
+    for (auto layer : layers) {
+      layer->setBatchSize(mbSize);
+    }
+  }
+
+  void saveLayers(model::Writer &writer) {
+    for (auto layer : layers) {
+      layer->save(writer);
     }
   }
+
+  void loadLayers(const model::Reader &reader) {
+    for (unsigned i = 0; i < layers.size(); ++i) {
+      layers[i]->load(reader.getWeights(i), reader.getBias(i));
+    }
+  }
+};
+
+/// A network of layers given as a list of types, followed by the softmax
+/// layer. Layers are constructed from the parameters, or by default if they
+/// take none, and are initialised in order with the same random draws as the
+/// equivalent Network. The passes call each layer's members by qualified
+/// name, which binds them statically rather than through the vtable.
+template <unsigned inputX,
+          unsigned inputY,
+          unsigned softMaxSize,
+          unsigned lastLayerSize,
+          float (*costFn)(float, float),
+          float (*costDelta)(float, float, float),
+          typename... LayerTys>
+class StaticNetwork :
+    public NetworkBase<StaticNetwork<inputX, inputY, softMaxSize,
+                                     lastLayerSize, costFn, costDelta,
+                                     LayerTys...>,
+                       inputX, inputY,
+                       SoftMaxLayer<softMaxSize, lastLayerSize,
+                                    costFn, costDelta>> {
+  using SoftMaxLayerTy = SoftMaxLayer<softMaxSize, lastLayerSize,
+                                      costFn, costDelta>;
+  using BaseTy = NetworkBase<StaticNetwork, inputX, inputY,
+                             SoftMaxLayerTy>;
+  using LayersTy = std::tuple<LayerTys..., SoftMaxLayerTy>;
+  static constexpr unsigned numLayers = sizeof...(LayerTys) + 1;
+  static_assert(numLayers > 1, "Network needs a layer before the softmax");
+  LayersTy layers;
+
+  template <unsigned i>
+  using LayerAt = typename std::tuple_element<i, LayersTy>::type;
+
+  template <typename LayerTy>
+  static LayerTy makeLayer(Params params, std::true_type) {
+    return LayerTy(params);
+  }
+
+  template <typename LayerTy>
+  static LayerTy makeLayer(Params, std::false_type) {
+    return LayerTy();
+  }
+
+  template <typename LayerTy>
+  static LayerTy makeLayer(Params params) {
+    return makeLayer<LayerTy>(params,
+                              std::is_constructible<LayerTy, Params>());
+  }
+
+  /// The layer providing the inputs of layer i.
+  template <unsigned i>
+  typename std::enable_if<i == 0, Layer*>::type getInputs() {
+    return &this->inputLayer;
+  }
+
+  template <unsigned i>
+  typename std::enable_if<(i > 0), Layer*>::type getInputs() {
+    return &std::get<i - 1>(layers);
+  }
+
+  template <unsigned i>
+  typename std::enable_if<i == 0>::type setOutputsOfInputs() {}
+
+  template <unsigned i>
+  typename std::enable_if<(i > 0)>::type setOutputsOfInputs() {
+    typedef LayerAt<i - 1> InputsTy;
+    std::get<i - 1>(layers).InputsTy::setOutputs(&std::get<i>(layers));
+  }
+
+  template <unsigned i>
+  typename std::enable_if<i == numLayers>::type connect() {}
+
+  template <unsigned i>
+  typename std::enable_if<(i < numLayers)>::type connect() {
+    typedef LayerAt<i> LayerTy;
+    std::get<i>(layers).LayerTy::setInputs(getInputs<i>());
+    setOutputsOfInputs<i>();
+    connect<i + 1>();
+  }
+
+  template <unsigned i>
+  typename std::enable_if<i == numLayers>::type initialiseFrom() {}
+
+  template <unsigned i>
+  typename std::enable_if<(i < numLayers)>::type initialiseFrom() {
+    typedef LayerAt<i> LayerTy;
+    std::get<i>(layers).LayerTy::initialiseDefaultWeights(this->generator);
+    initialiseFrom<i + 1>();
+  }
+
+  template <unsigned i>
+  typename std::enable_if<i == numLayers>::type feedForwardFrom() {}
+
+  template <unsigned i>
+  typename std::enable_if<(i < numLayers)>::type feedForwardFrom() {
+    typedef LayerAt<i> LayerTy;
+    std::get<i>(layers).LayerTy::feedForward();
+    feedForwardFrom<i + 1>();
+  }
+
+  template <unsigned i>
+  typename std::enable_if<i == 0>::type backPropogateFrom() {
+    typedef LayerAt<0> LayerTy;
+    std::get<0>(layers).LayerTy::backPropogate();
+  }
+
+  template <unsigned i>
+  typename std::enable_if<(i > 0)>::type backPropogateFrom() {
+    typedef LayerAt<i> LayerTy;
+    LayerTy &layer = std::get<i>(layers);
+    layer.LayerTy::backPropogate();
+    layer.LayerTy::calcBwdError();
+    backPropogateFrom<i - 1>();
+  }
+
+  template <unsigned i>
+  typename std::enable_if<i == 0>::type accumulateGradientsFrom() {}
+
+  template <unsigned i>
+  typename std::enable_if<(i > 0)>::type accumulateGradientsFrom() {
+    typedef LayerAt<i - 1> LayerTy;
+    std::get<i - 1>(layers).LayerTy::accumulateGradients();
+    accumulateGradientsFrom<i - 1>();
+  }
+
+  template <unsigned i, typename Fn>
+  typename std::enable_if<i == 0>::type
+  backPropogateAccumulateFrom(const Fn&) {}
+
+  template <unsigned i, typename Fn>
+  typename std::enable_if<(i > 0)>::type
+  backPropogateAccumulateFrom(const Fn &ready) {
+    typedef LayerAt<i - 1> LayerTy;
+    LayerTy &layer = std::get<i - 1>(layers);
+    if (i != numLayers) {
+      layer.LayerTy::backPropogate();
+    }
+    if (i > 1) {
+      layer.LayerTy::calcBwdError();
+    }
+    layer.LayerTy::accumulateGradients();
+    if (Tensor *gradients = layer.LayerTy::getGradients()) {
+      ready(gradients);
+    }
+    backPropogateAccumulateFrom<i - 1>(ready);
+  }
+
+  template <unsigned i>
+  typename std::enable_if<i == 0>::type
+  applyGradientsFrom(float, unsigned, unsigned) {}
+
+  template <unsigned i>
+  typename std::enable_if<(i > 0)>::type
+  applyGradientsFrom(float rate, unsigned numImages, unsigned n) {
+    typedef LayerAt<i - 1> LayerTy;
+    std::get<i - 1>(layers).LayerTy::applyGradients(rate, numImages, n);
+    applyGradientsFrom<i - 1>(rate, numImages, n);
+  }
+
+  template <unsigned i>
+  typename std::enable_if<i == 0>::type
+  endBatchFrom(float, unsigned, unsigned) {}
+
+  template <unsigned i>
+  typename std::enable_if<(i > 0)>::type
+  endBatchFrom(float rate, unsigned numImages, unsigned n) {
+    typedef LayerAt<i - 1> LayerTy;
+    std::get<i - 1>(layers).LayerTy::endBatch(rate, numImages, n);
+    endBatchFrom<i - 1>(rate, numImages, n);
+  }
+
+  template <unsigned i>
+  typename std::enable_if<i == numLayers>::type
+  getGradientsFrom(std::vector<Tensor*>&) {}
+
+  template <unsigned i>
+  typename std::enable_if<(i < numLayers)>::type
+  getGradientsFrom(std::vector<Tensor*> &gradients) {
+    typedef LayerAt<i> LayerTy;
+    if (Tensor *layerGradients = std::get<i>(layers).LayerTy::getGradients()) {
+      gradients.push_back(layerGradients);
+    }
+    getGradientsFrom<i + 1>(gradients);
+  }
+
+  template <unsigned i>
+  typename std::enable_if<i == numLayers>::type setBatchSizeFrom(unsigned) {}
+
+  template <unsigned i>
+  typename std::enable_if<(i < numLayers)>::type
+  setBatchSizeFrom(unsigned mbSize) {
+    typedef LayerAt<i> LayerTy;
+    std::get<i>(layers).LayerTy::setBatchSize(mbSize);
+    setBatchSizeFrom<i + 1>(mbSize);
+  }
+
+  template <unsigned i>
+  typename std::enable_if<i == numLayers>::type saveFrom(model::Writer&) {}
+
+  template <unsigned i>
+  typename std::enable_if<(i < numLayers)>::type
+  saveFrom(model::Writer &writer) {
+    typedef LayerAt<i> LayerTy;
+    std::get<i>(layers).LayerTy::save(writer);
+    saveFrom<i + 1>(writer);
+  }
+
+  template <unsigned i>
+  typename std::enable_if<i == numLayers>::type
+  loadFrom(const model::Reader&) {}
+
+  template <unsigned i>
+  typename std::enable_if<(i < numLayers)>::type
+  loadFrom(const model::Reader &reader) {
+    typedef LayerAt<i> LayerTy;
+    std::get<i>(layers).LayerTy::load(reader.getWeights(i),
+                                      reader.getBias(i));
+    loadFrom<i + 1>(reader);
+  }
+
+public:
+  StaticNetwork(Params params) :
+      BaseTy(params),
+      layers(makeLayer<LayerTys>(params)..., SoftMaxLayerTy(params)) {
+    connect<0>();
+    this->setBatchSize(params.mbSize);
+    initialiseFrom<0>();
+  }
+
+  /// A copy of the network, with the copied layers connected to each other.
+  StaticNetwork(const StaticNetwork &other) :
+      BaseTy(other), layers(other.layers) {
+    connect<0>();
+  }
+
+  StaticNetwork &operator=(const StaticNetwork&) = delete;
+
+  SoftMaxLayerTy &getSoftMaxLayer() { return std::get<numLayers - 1>(layers); }
+
+  /// Layer i, in the order given.
+  template <unsigned i>
+  LayerAt<i> &getLayer() { return std::get<i>(layers); }
+
+  /// The forward pass.
+  void feedForward() { feedForwardFrom<0>(); }
+
+  /// The backward pass through the layers before the softmax layer.
+  void backPropogateLayers() { backPropogateFrom<numLayers - 2>(); }
+
+  void accumulateGradientsLayers() { accumulateGradientsFrom<numLayers>(); }
+
+  /// The backward pass through all the layers, summing the gradients of each
+  /// as soon as its errors are known and passing them to ready().
+  template <typename Fn>
+  void backPropogateAccumulateLayers(const Fn &ready) {
+    backPropogateAccumulateFrom<numLayers>(ready);
+  }
+
+  void applyGradientsLayers(float learningRate, unsigned numImages,
+                            unsigned numTrainingImages) {
+    applyGradientsFrom<numLayers>(learningRate, numImages, numTrainingImages);
+  }
+
+  void endBatchLayers(float learningRate, unsigned numImages,
+                      unsigned numTrainingImages) {
+    endBatchFrom<numLayers>(learningRate, numImages, numTrainingImages);
+  }
+
+  void getGradientsLayers(std::vector<Tensor*> &gradients) {
+    getGradientsFrom<0>(gradients);
+  }
+
+  void setLayersBatchSize(unsigned mbSize) { setBatchSizeFrom<0>(mbSize); }
+
+  void saveLayers(model::Writer &writer) { saveFrom<0>(writer); }
+
+  void loadLayers(const model::Reader &reader) { loadFrom<0>(reader); }
 };
 
 #endif
@@ -2,10 +2,58 @@
 #define _PARAMS_H_
 
 #include <iostream>
+#include <string>
+#include "Simd.hpp"
+
+/// Implementation used by the convolutional layers.
+enum class ConvAlgorithm {
+  Direct,     // Loop over the receptive field of each neuron.
+  Im2Col,     // Lower the convolution to a matrix multiply.
+  WinogradF2, // Winograd F(2x2, 3x3) minimal filtering, 3x3 kernels only.
+  WinogradF4, // Winograd F(4x4, 3x3) minimal filtering, 3x3 kernels only.
+  FFT,        // Pointwise products of the spectra of inputs and kernels.
+  Auto        // Chosen per layer shape.
+};
+
+inline const char *getConvAlgorithmName(ConvAlgorithm algorithm) {
+  switch (algorithm) {
+  case ConvAlgorithm::Direct:     return "direct";
+  case ConvAlgorithm::Im2Col:     return "im2col";
+  case ConvAlgorithm::WinogradF2: return "winograd-f2";
+  case ConvAlgorithm::WinogradF4: return "winograd-f4";
+  case ConvAlgorithm::FFT:        return "fft";
+  case ConvAlgorithm::Auto:       return "auto";
+  }
+  return "unknown";
+}
 
 struct Params {
   unsigned  numEpochs;
+  // Images in each minibatch of training, and in each batch fed forward in
+  // evaluation, or 0 to evaluate in minibatches of the training size.
+  unsigned  mbSize = 10;
+  unsigned  evalBatchSize = 0;
+  // Minibatches whose gradients are summed for each update of the weights,
+  // on each of numReplicas copies of the network trained at once. If
+  // scaleLearningRate is set, the learning rate of the updates is multiplied
+  // by the number of minibatches in each, accumulationSteps * numReplicas *
+  // numProcesses, rising to it linearly from learningRate over the first
+  // warmupImages images of the run.
+  unsigned  accumulationSteps = 1;
+  unsigned  numReplicas = 1;
+  // Processes training the network together, each started with its own rank,
+  // which connect through Unix-domain sockets at socketPath followed by the
+  // rank. Each trains numReplicas replicas, and the process of rank 0 alone
+  // writes checkpoints, the model and progress.
+  unsigned  numProcesses = 1;
+  unsigned  processRank = 0;
+  std::string socketPath;
+  bool      scaleLearningRate = false;
+  unsigned  warmupImages = 0;
   float     learningRate;
+  // L2 regularisation: each update multiplies the weights by
+  // 1 - learningRate * lambda / n, for a training set of n images, whatever
+  // the number of images in the update.
   float     lambda;
   unsigned  seed = 1;
   unsigned  numValidationImages;
@@ -16,14 +64,54 @@ struct Params {
   bool      monitorTrainingAccuracy   = false;
   bool      monitorTrainingCost       = false;
   unsigned  monitorInterval = 1000;
-  void dump(unsigned mbSize /* mbSize is a template param */,
-            unsigned numThreads /* returned by TBB object */) {
+  ConvAlgorithm convAlgorithm = ConvAlgorithm::Auto;
+  // Minimum work in each task of the layers' parallel loops, counted in
+  // multiply-accumulates or elements processed.
+  unsigned  grainSize = 16384;
+  // Minibatches gathered ahead of training on another thread, for each
+  // replica, or 0 to gather each one when it is needed.
+  unsigned  prefetchDepth = 2;
+  // Images in the window that streamed training data is shuffled within.
+  unsigned  shuffleWindow = 1 << 16;
+  // Largest random shift, in pixels, and rotation, in degrees, of each
+  // training image, and the scale and smoothness of its elastic distortion.
+  // Training images are used as they are if all are 0.
+  float     augmentShift = 0.0f;
+  float     augmentRotation = 0.0f;
+  float     elasticAlpha = 0.0f;
+  float     elasticSigma = 4.0f;
+  // Model file written at the end of training, if any.
+  std::string modelFile;
+  // Checkpoint file written during training, if any, and read to resume.
+  std::string checkpointFile;
+  // Images between checkpoints, or 0 to write one only after each epoch.
+  unsigned  checkpointInterval = 0;
+  void dump(unsigned numThreads /* returned by TBB object */) {
     std::cout << "=============================\n";
     std::cout << "Parameters\n";
     std::cout << "-----------------------------\n";
     std::cout << "Num threads       " << numThreads << "\n";
     std::cout << "Num epochs        " << numEpochs << "\n";
     std::cout << "Minibatch size    " << mbSize << "\n";
+    if (evalBatchSize) {
+      std::cout << "Eval batch size   " << evalBatchSize << "\n";
+    }
+    if (accumulationSteps != 1) {
+      std::cout << "Accumulated steps " << accumulationSteps << "\n";
+    }
+    if (numReplicas != 1) {
+      std::cout << "Replicas          " << numReplicas << "\n";
+    }
+    if (numProcesses != 1) {
+      std::cout << "Processes         " << numProcesses << "\n";
+      std::cout << "Process rank      " << processRank << "\n";
+    }
+    if (scaleLearningRate) {
+      std::cout << "Scaled rate       "
+                << learningRate * accumulationSteps * numReplicas * numProcesses
+                << "\n";
+      std::cout << "Warm-up images    " << warmupImages << "\n";
+    }
     std::cout << "Learning rate     " << learningRate << "\n";
     std::cout << "Lambda            " << lambda << "\n";
     std::cout << "Seed              " << seed << "\n";
@@ -31,6 +119,29 @@ struct Params {
     std::cout << "Testing images    " << numTestImages << "\n";
     std::cout << "Validation images " << numValidationImages << "\n";
     std::cout << "Monitor interval  " << monitorInterval << "\n";
+    std::cout << "Conv algorithm    " << getConvAlgorithmName(convAlgorithm)
+              << "\n";
+    std::cout << "Grain size        " << grainSize << "\n";
+    std::cout << "Prefetch depth    " << prefetchDepth << "\n";
+    std::cout << "Shuffle window    " << shuffleWindow << "\n";
+    if (augmentShift != 0.0f || augmentRotation != 0.0f ||
+        elasticAlpha != 0.0f) {
+      std::cout << "Augment shift     " << augmentShift << "\n";
+      std::cout << "Augment rotation  " << augmentRotation << "\n";
+      std::cout << "Elastic alpha     " << elasticAlpha << "\n";
+      std::cout << "Elastic sigma     " << elasticSigma << "\n";
+    }
+    if (!modelFile.empty()) {
+      std::cout << "Model file        " << modelFile << "\n";
+    }
+    if (!checkpointFile.empty()) {
+      std::cout << "Checkpoint file   " << checkpointFile << "\n";
+      if (checkpointInterval) {
+        std::cout << "Checkpoint every  " << checkpointInterval << "\n";
+      }
+    }
+    std::cout << "SIMD kernels      "
+              << simd::getLevelName(simd::kernels().level) << "\n";
     std::cout << "=============================\n";
   }
 };
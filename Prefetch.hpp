@@ -0,0 +1,106 @@
+#ifndef _PREFETCH_H_
+#define _PREFETCH_H_
+
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Data.hpp"
+
+///===--------------------------------------------------------------------===///
+/// Minibatch prefetching.
+///
+/// A producer thread gathers the minibatches of a pass over a training set,
+/// one after another, into a ring of staging minibatches. It runs up to the
+/// size of the ring ahead of training, which takes each minibatch with next()
+/// and hands its slot back with release(). Training may hold several
+/// minibatches at once, up to the size of the ring. The number of times
+/// training has to wait for a minibatch, and for how long, are counted.
+///===--------------------------------------------------------------------===///
+class Prefetcher {
+  std::function<void(Minibatch&)> gatherNext;
+  unsigned numBatches;
+  std::vector<Minibatch> slots;
+  std::mutex mutex;
+  std::condition_variable gathered;
+  std::condition_variable released;
+  unsigned numGathered = 0; // Guarded by mutex.
+  unsigned numReleased = 0; // Guarded by mutex.
+  bool stopping = false;    // Guarded by mutex.
+  unsigned numStalls = 0;
+  double stallMs = 0.0;
+  std::thread producer;
+
+  void produce() {
+    for (unsigned batch = 0; batch < numBatches; ++batch) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        released.wait(lock, [&] {
+          return stopping || numGathered - numReleased < slots.size();
+        });
+        if (stopping) {
+          return;
+        }
+      }
+      gatherNext(slots[batch % slots.size()]);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++numGathered;
+      }
+      gathered.notify_one();
+    }
+  }
+
+public:
+  /// Gather numBatches minibatches of mbSize images with gatherNext, up to
+  /// depth minibatches ahead.
+  Prefetcher(std::function<void(Minibatch&)> gatherNext, unsigned numBatches,
+             unsigned mbSize, unsigned imageSize, unsigned depth) :
+      gatherNext(gatherNext), numBatches(numBatches),
+      slots(depth, Minibatch(mbSize, imageSize)),
+      producer(&Prefetcher::produce, this) {}
+
+  ~Prefetcher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    released.notify_one();
+    producer.join();
+  }
+
+  Prefetcher(const Prefetcher&) = delete;
+  Prefetcher &operator=(const Prefetcher&) = delete;
+
+  /// The minibatch ahead places after the next one to be released, which is
+  /// owned by the caller until it is released.
+  Minibatch &next(unsigned ahead = 0) {
+    assert(ahead < slots.size() && "Minibatch beyond the ring");
+    std::unique_lock<std::mutex> lock(mutex);
+    if (numGathered - numReleased <= ahead) {
+      auto start = std::chrono::high_resolution_clock::now();
+      gathered.wait(lock, [&] { return numGathered - numReleased > ahead; });
+      auto end = std::chrono::high_resolution_clock::now();
+      ++numStalls;
+      stallMs += std::chrono::duration<double, std::milli>(end - start).count();
+    }
+    return slots[(numReleased + ahead) % slots.size()];
+  }
+
+  /// Hand the slot of the oldest minibatch held back to the producer.
+  void release() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++numReleased;
+    }
+    released.notify_one();
+  }
+
+  unsigned getNumStalls() const { return numStalls; }
+  double getStallMs() const { return stallMs; }
+};
+
+#endif
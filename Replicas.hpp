@@ -0,0 +1,125 @@
+#ifndef _REPLICAS_H_
+#define _REPLICAS_H_
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "tbb/tbb.h"
+#include "Simd.hpp"
+#include "Tensor.hpp"
+
+///===--------------------------------------------------------------------===///
+/// Data-parallel replicas.
+///
+/// A network is trained by numReplicas full copies of it at once, each on its
+/// own minibatches. Each replica runs in its own task arena, a share of the
+/// threads, so its nested parallel loops stay on those threads and its
+/// working set in their caches. Before each update the gradients the replicas
+/// have summed are combined by an all-reduce in shared memory: as in the
+/// reduce-scatter and all-gather phases of a ring all-reduce, each slice of
+/// the gradients is summed by one task, over the replicas in a fixed order,
+/// and copied back to all of them, so every replica applies the same update
+/// and the weights stay identical. In a run over several processes the sum
+/// of a process's replicas is reduced with those of the others before it is
+/// copied back.
+///===--------------------------------------------------------------------===///
+template <typename NetworkTy>
+class Replicas {
+  std::vector<std::unique_ptr<NetworkTy>> copies;
+  std::vector<NetworkTy*> networks; // The network, then its copies.
+  std::vector<std::unique_ptr<tbb::task_arena>> arenas;
+  unsigned grainSize;
+
+  /// Call fn(slices, count) in parallel for slices of the gradients, with a
+  /// pointer to the slice in each replica.
+  template <typename Fn>
+  void forEachSlice(const Fn &fn) {
+    std::vector<std::vector<Tensor*>> gradients(size());
+    for (unsigned r = 0; r < size(); ++r) {
+      networks[r]->getGradientsLayers(gradients[r]);
+    }
+    unsigned grain = std::max(1u, grainSize / size());
+    for (unsigned i = 0; i < gradients[0].size(); ++i) {
+      unsigned length = gradients[0][i]->size();
+      tbb::parallel_for(tbb::blocked_range<unsigned>(0, length, grain),
+                        [&](const tbb::blocked_range<unsigned> &range) {
+        std::vector<float*> slices(size());
+        for (unsigned r = 0; r < size(); ++r) {
+          slices[r] = &(*gradients[r][i])[range.begin()];
+        }
+        fn(slices, range.end() - range.begin());
+      });
+    }
+  }
+
+  /// Sum the slices of the replicas, in order, into that of the network.
+  void sum(const std::vector<float*> &slices, unsigned count) const {
+    for (unsigned r = 1; r < size(); ++r) {
+      simd::kernels().axpy(1.0f, slices[r], slices[0], count);
+    }
+  }
+
+  /// Copy the slice of the network to the other replicas.
+  void copy(const std::vector<float*> &slices, unsigned count) const {
+    for (unsigned r = 1; r < size(); ++r) {
+      std::copy_n(slices[0], count, slices[r]);
+    }
+  }
+
+public:
+  /// The network and numReplicas - 1 copies of it, sharing the threads.
+  Replicas(NetworkTy &network, unsigned numReplicas, unsigned grainSize) :
+      networks(1, &network), grainSize(grainSize) {
+    for (unsigned r = 1; r < numReplicas; ++r) {
+      copies.emplace_back(new NetworkTy(network));
+      networks.push_back(copies.back().get());
+    }
+    int numThreads = tbb::this_task_arena::max_concurrency();
+    for (unsigned r = 0; r < numReplicas; ++r) {
+      arenas.emplace_back(
+          new tbb::task_arena(std::max(1, numThreads / int(numReplicas))));
+    }
+  }
+
+  Replicas(const Replicas&) = delete;
+  Replicas &operator=(const Replicas&) = delete;
+
+  unsigned size() const { return networks.size(); }
+
+  /// Call fn(network, r) for each replica r at once, each in its arena.
+  template <typename Fn>
+  void run(const Fn &fn) {
+    if (size() == 1) {
+      fn(*networks[0], 0);
+      return;
+    }
+    tbb::parallel_for(0u, size(), [&](unsigned r) {
+      arenas[r]->execute([&] { fn(*networks[r], r); });
+    });
+  }
+
+  /// Sum the gradients kept by the replicas, leaving the total in each.
+  void allReduce() {
+    forEachSlice([this](std::vector<float*> &slices, unsigned count) {
+      sum(slices, count);
+      copy(slices, count);
+    });
+  }
+
+  /// Sum the gradients kept by the replicas into those of the network, so
+  /// that they can be reduced with those of other processes.
+  void reduce() {
+    forEachSlice([this](std::vector<float*> &slices, unsigned count) {
+      sum(slices, count);
+    });
+  }
+
+  /// Copy the gradients of the network to the other replicas.
+  void broadcast() {
+    forEachSlice([this](std::vector<float*> &slices, unsigned count) {
+      copy(slices, count);
+    });
+  }
+};
+
+#endif
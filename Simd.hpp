@@ -0,0 +1,698 @@
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+#include <algorithm>
+#include <cstring>
+
+///===--------------------------------------------------------------------===///
+/// Vector kernels with run-time instruction set dispatch.
+///
+/// Each kernel is written once over vectors of W floats, using the GCC vector
+/// extensions, and compiled separately for each supported instruction set
+/// with its widest native vector: 4 lanes for SSE4.2, 8 for AVX2 and 16 for
+/// AVX-512, alongside a generic build for the baseline target. The kernels for
+/// the best instruction set the CPU supports are chosen on first use, so a
+/// single binary runs at full width on each machine.
+///===--------------------------------------------------------------------===///
+namespace simd {
+
+// Micro-kernel tile of the matrix multiply: MR rows of A by NR columns of B.
+constexpr unsigned MR = 4;
+constexpr unsigned NR = 16;
+
+enum class Level {
+  Generic, // Baseline target, 4 lanes.
+  SSE4,    // SSE4.2, 4 lanes.
+  AVX2,    // AVX2, 8 lanes.
+  AVX512   // AVX-512F, 16 lanes.
+};
+
+inline const char *getLevelName(Level level) {
+  switch (level) {
+  case Level::Generic: return "generic";
+  case Level::SSE4:    return "sse4.2";
+  case Level::AVX2:    return "avx2";
+  case Level::AVX512:  return "avx512";
+  }
+  return "unknown";
+}
+
+#define SIMD_INLINE inline __attribute__((always_inline))
+
+/// Vectors of W floats, and of W lane indices for shuffles. The vector size
+/// attribute cannot depend on a template parameter, so each width is spelled
+/// out.
+template <unsigned W> struct Vector;
+
+template <> struct Vector<4> {
+  typedef float Type __attribute__((vector_size(4 * sizeof(float))));
+  typedef int Mask __attribute__((vector_size(4 * sizeof(int))));
+};
+
+template <> struct Vector<8> {
+  typedef float Type __attribute__((vector_size(8 * sizeof(float))));
+  typedef int Mask __attribute__((vector_size(8 * sizeof(int))));
+};
+
+template <> struct Vector<16> {
+  typedef float Type __attribute__((vector_size(16 * sizeof(float))));
+  typedef int Mask __attribute__((vector_size(16 * sizeof(int))));
+};
+
+/// A row of a micro-kernel tile, held in vector registers.
+typedef float Row __attribute__((vector_size(NR * sizeof(float))));
+
+template <unsigned W>
+struct Impl {
+  typedef typename Vector<W>::Type Vec;
+  typedef typename Vector<W>::Mask Mask;
+
+  /// Copy the first n lanes of a vector from or to memory. On loading, the
+  /// remaining lanes are left unchanged.
+  static SIMD_INLINE void load(const float *src, unsigned n, Vec &v) {
+    if (n == W) {
+      std::memcpy(&v, src, sizeof(Vec));
+    } else {
+      for (unsigned l = 0; l < n; ++l) {
+        v[l] = src[l];
+      }
+    }
+  }
+
+  static SIMD_INLINE void store(const Vec &v, unsigned n, float *dst) {
+    if (n == W) {
+      std::memcpy(dst, &v, sizeof(Vec));
+    } else {
+      for (unsigned l = 0; l < n; ++l) {
+        dst[l] = v[l];
+      }
+    }
+  }
+
+  /// Multiply an MR-row sliver of A by an NR-column sliver of B and merge the
+  /// mr x nr valid part of the tile into C. The packed slivers of B are
+  /// aligned to a whole tile row.
+  static SIMD_INLINE void microKernel(unsigned kc, const float *a,
+                                      const float *b,
+                                      float alpha, float beta,
+                                      float *C, unsigned ldc,
+                                      unsigned mr, unsigned nr) {
+    Row acc[MR] = {};
+    for (unsigned p = 0; p < kc; ++p) {
+      Row row = *reinterpret_cast<const Row*>(&b[p * NR]);
+      for (unsigned i = 0; i < MR; ++i) {
+        acc[i] += a[(p * MR) + i] * row;
+      }
+    }
+    for (unsigned i = 0; i < mr; ++i) {
+      float *c = &C[i * ldc];
+      if (beta == 0.0f) {
+        for (unsigned j = 0; j < nr; ++j) {
+          c[j] = alpha * acc[i][j];
+        }
+      } else {
+        for (unsigned j = 0; j < nr; ++j) {
+          c[j] = (alpha * acc[i][j]) + (beta * c[j]);
+        }
+      }
+    }
+  }
+
+  /// Sum of x[i] * y[i].
+  static SIMD_INLINE float dot(const float *x, const float *y, unsigned n) {
+    Vec acc = {};
+    unsigned i = 0;
+    for (; i + W <= n; i += W) {
+      Vec u, v;
+      std::memcpy(&u, &x[i], sizeof(Vec));
+      std::memcpy(&v, &y[i], sizeof(Vec));
+      acc += u * v;
+    }
+    float result = 0.0f;
+    for (unsigned l = 0; l < W; ++l) {
+      result += acc[l];
+    }
+    for (; i < n; ++i) {
+      result += x[i] * y[i];
+    }
+    return result;
+  }
+
+  /// Sum of x[i].
+  static SIMD_INLINE float sum(const float *x, unsigned n) {
+    Vec acc = {};
+    unsigned i = 0;
+    for (; i + W <= n; i += W) {
+      Vec u;
+      std::memcpy(&u, &x[i], sizeof(Vec));
+      acc += u;
+    }
+    float result = 0.0f;
+    for (unsigned l = 0; l < W; ++l) {
+      result += acc[l];
+    }
+    for (; i < n; ++i) {
+      result += x[i];
+    }
+    return result;
+  }
+
+  /// y = alpha * x + y.
+  static SIMD_INLINE void axpy(float alpha, const float *x, float *y,
+                               unsigned n) {
+    unsigned i = 0;
+    for (; i + W <= n; i += W) {
+      Vec u, v;
+      std::memcpy(&u, &x[i], sizeof(Vec));
+      std::memcpy(&v, &y[i], sizeof(Vec));
+      v += alpha * u;
+      std::memcpy(&y[i], &v, sizeof(Vec));
+    }
+    for (; i < n; ++i) {
+      y[i] += alpha * x[i];
+    }
+  }
+
+  /// y = alpha * x + beta * y.
+  static SIMD_INLINE void axpby(float alpha, const float *x, float beta,
+                                float *y, unsigned n) {
+    unsigned i = 0;
+    for (; i + W <= n; i += W) {
+      Vec u, v;
+      std::memcpy(&u, &x[i], sizeof(Vec));
+      std::memcpy(&v, &y[i], sizeof(Vec));
+      v = (alpha * u) + (beta * v);
+      std::memcpy(&y[i], &v, sizeof(Vec));
+    }
+    for (; i < n; ++i) {
+      y[i] = (alpha * x[i]) + (beta * y[i]);
+    }
+  }
+
+  /// y = max(x, 0).
+  static SIMD_INLINE void relu(const float *x, float *y, unsigned n) {
+    Vec zero = {};
+    unsigned i = 0;
+    for (; i + W <= n; i += W) {
+      Vec u;
+      std::memcpy(&u, &x[i], sizeof(Vec));
+      u = u > zero ? u : zero;
+      std::memcpy(&y[i], &u, sizeof(Vec));
+    }
+    for (; i < n; ++i) {
+      y[i] = x[i] > 0.0f ? x[i] : 0.0f;
+    }
+  }
+
+  /// y = error * relu'(x).
+  static SIMD_INLINE void reluBackward(const float *error, const float *x,
+                                       float *y, unsigned n) {
+    Vec zero = {};
+    unsigned i = 0;
+    for (; i + W <= n; i += W) {
+      Vec e, u;
+      std::memcpy(&e, &error[i], sizeof(Vec));
+      std::memcpy(&u, &x[i], sizeof(Vec));
+      e = u > zero ? e : zero;
+      std::memcpy(&y[i], &e, sizeof(Vec));
+    }
+    for (; i < n; ++i) {
+      y[i] = x[i] > 0.0f ? error[i] : 0.0f;
+    }
+  }
+
+  /// exp(x), from the Cephes polynomial for exp(r) over the reduced range
+  /// |r| <= ln(2) / 2, where x = r + k ln(2). The scaling by 2^k is split in
+  /// two so that results near the limits overflow to infinity and underflow
+  /// gradually, as std::exp does.
+  static SIMD_INLINE void exp(Vec &x) {
+    Vec in = x;
+    x = x > 88.8f ? Vec{} + 88.8f : x;
+    x = x < -104.0f ? Vec{} - 104.0f : x;
+    // k = floor(x / ln(2) + 0.5).
+    Vec fk = (x * 1.44269504088896341f) + 0.5f;
+    Mask k = __builtin_convertvector(fk, Mask);
+    k += __builtin_convertvector(k, Vec) > fk; // True is -1.
+    fk = __builtin_convertvector(k, Vec);
+    // ln(2) is split into a part that is exact in float and the remainder.
+    Vec r = x - (fk * 0.693359375f);
+    r = r - (fk * -2.12194440e-4f);
+    Vec p = Vec{} + 1.9875691500e-4f;
+    p = (p * r) + 1.3981999507e-3f;
+    p = (p * r) + 8.3334519073e-3f;
+    p = (p * r) + 4.1665795894e-2f;
+    p = (p * r) + 1.6666665459e-1f;
+    p = (p * r) + 5.0000001201e-1f;
+    Vec y = (p * (r * r)) + r + 1.0f;
+    Mask k1 = k >> 1;
+    Mask k2 = k - k1;
+    y *= reinterpret_cast<Vec>((k1 + 127) << 23);
+    y *= reinterpret_cast<Vec>((k2 + 127) << 23);
+    x = in == in ? y : in;
+  }
+
+  /// log(x), from the Cephes polynomial for log(1 + m) over
+  /// sqrt(1/2) - 1 <= m <= sqrt(2) - 1, where x = (1 + m) 2^e. Zero gives
+  /// -infinity and negative values NaN, as with std::log.
+  static SIMD_INLINE void log(Vec &x) {
+    Vec in = x;
+    Vec zero = {};
+    // Bring subnormals into the normal range before splitting off the
+    // exponent.
+    Mask subnormal = x < 1.17549435e-38f;
+    x = subnormal ? x * 8388608.0f : x;
+    Mask bits = reinterpret_cast<Mask>(x);
+    Vec e = __builtin_convertvector(((bits >> 23) & 0xff) - 126, Vec);
+    e = subnormal ? e - 23.0f : e;
+    // Mantissa in [0.5, 1), then adjusted to [sqrt(1/2), sqrt(2)) - 1.
+    Vec m = reinterpret_cast<Vec>((bits & 0x007fffff) | 0x3f000000);
+    Mask low = m < 0.707106781186547524f;
+    e = low ? e - 1.0f : e;
+    m = low ? m + m - 1.0f : m - 1.0f;
+    Vec z = m * m;
+    Vec p = Vec{} + 7.0376836292e-2f;
+    p = (p * m) - 1.1514610310e-1f;
+    p = (p * m) + 1.1676998740e-1f;
+    p = (p * m) - 1.2420140846e-1f;
+    p = (p * m) + 1.4249322787e-1f;
+    p = (p * m) - 1.6668057665e-1f;
+    p = (p * m) + 2.0000714765e-1f;
+    p = (p * m) - 2.4999993993e-1f;
+    p = (p * m) + 3.3333331174e-1f;
+    Vec y = p * m * z;
+    y += e * -2.12194440e-4f;
+    y -= 0.5f * z;
+    y = m + y + (e * 0.693359375f);
+    // Special values.
+    y = in == __builtin_inff() ? in : y;
+    y = in == zero ? zero - __builtin_inff() : y;
+    x = in >= zero ? y : zero + __builtin_nanf("");
+  }
+
+  /// y = exp(x).
+  static SIMD_INLINE void exp(const float *x, float *y, unsigned n) {
+    for (unsigned i = 0; i < n; i += W) {
+      unsigned lanes = std::min(W, n - i);
+      Vec u = {};
+      load(&x[i], lanes, u);
+      exp(u);
+      store(u, lanes, &y[i]);
+    }
+  }
+
+  /// y = 1 / (1 + exp(-x)).
+  static SIMD_INLINE void sigmoid(const float *x, float *y, unsigned n) {
+    for (unsigned i = 0; i < n; i += W) {
+      unsigned lanes = std::min(W, n - i);
+      Vec u = {};
+      load(&x[i], lanes, u);
+      u = -u;
+      exp(u);
+      u = 1.0f / (1.0f + u);
+      store(u, lanes, &y[i]);
+    }
+  }
+
+  /// y = error * sigmoid'(x), from the activations a = sigmoid(x).
+  static SIMD_INLINE void sigmoidBackward(const float *error, const float *a,
+                                          float *y, unsigned n) {
+    unsigned i = 0;
+    for (; i + W <= n; i += W) {
+      Vec e, u;
+      std::memcpy(&e, &error[i], sizeof(Vec));
+      std::memcpy(&u, &a[i], sizeof(Vec));
+      e = e * (u * (1.0f - u));
+      std::memcpy(&y[i], &e, sizeof(Vec));
+    }
+    for (; i < n; ++i) {
+      y[i] = error[i] * (a[i] * (1.0f - a[i]));
+    }
+  }
+
+  /// y = exp(x) / sum(exp(x)), evaluated as exp(x - max(x)) so that the
+  /// exponentials cannot overflow.
+  static SIMD_INLINE void softmax(const float *x, float *y, unsigned n) {
+    float max = -__builtin_inff();
+    unsigned i = 0;
+    if (n >= W) {
+      Vec m;
+      std::memcpy(&m, x, sizeof(Vec));
+      for (i = W; i + W <= n; i += W) {
+        Vec u;
+        std::memcpy(&u, &x[i], sizeof(Vec));
+        m = u > m ? u : m;
+      }
+      for (unsigned l = 0; l < W; ++l) {
+        max = m[l] > max ? m[l] : max;
+      }
+    }
+    for (; i < n; ++i) {
+      max = x[i] > max ? x[i] : max;
+    }
+    for (i = 0; i < n; i += W) {
+      unsigned lanes = std::min(W, n - i);
+      Vec u = {};
+      load(&x[i], lanes, u);
+      u -= max;
+      exp(u);
+      store(u, lanes, &y[i]);
+    }
+    float scale = 1.0f / sum(y, n);
+    for (i = 0; i < n; ++i) {
+      y[i] *= scale;
+    }
+  }
+
+  /// Cross-entropy cost of n activations against a one-hot label, the sum
+  /// of -log(a) for the labelled output and -log(1 - a) for the rest.
+  static SIMD_INLINE float crossEntropy(const float *a, unsigned label,
+                                        unsigned n) {
+    Vec acc = {};
+    Mask index;
+    for (unsigned l = 0; l < W; ++l) {
+      index[l] = l;
+    }
+    for (unsigned i = 0; i < n; i += W, index += W) {
+      unsigned lanes = std::min(W, n - i);
+      // Padding lanes take log(1) = 0.
+      Vec u = Vec{} + 1.0f;
+      load(&a[i], lanes, u);
+      Mask valid = index < int(n);
+      u = index == int(label) ? u : 1.0f - u;
+      u = valid ? u : Vec{} + 1.0f;
+      log(u);
+      acc -= u;
+    }
+    float result = 0.0f;
+    for (unsigned l = 0; l < W; ++l) {
+      result += acc[l];
+    }
+    return result;
+  }
+
+  /// Write a row of outputX maxima over poolX x poolY areas of the input,
+  /// starting at the first of poolY rows of length inputX.
+  static SIMD_INLINE void maxPool(const float *in, unsigned inputX,
+                                  unsigned poolX, unsigned poolY,
+                                  float *out, unsigned outputX) {
+    unsigned x = 0;
+    if (poolX == 2) {
+      // Take the maxima down each column of two vectors of the input, then
+      // between the even and odd columns.
+      Mask even, odd;
+      for (unsigned l = 0; l < W; ++l) {
+        even[l] = 2 * l;
+        odd[l] = (2 * l) + 1;
+      }
+      for (; x + W <= outputX; x += W) {
+        Vec lo, hi;
+        std::memcpy(&lo, &in[2 * x], sizeof(Vec));
+        std::memcpy(&hi, &in[(2 * x) + W], sizeof(Vec));
+        for (unsigned b = 1; b < poolY; ++b) {
+          Vec u, v;
+          std::memcpy(&u, &in[(b * inputX) + (2 * x)], sizeof(Vec));
+          std::memcpy(&v, &in[(b * inputX) + (2 * x) + W], sizeof(Vec));
+          lo = u > lo ? u : lo;
+          hi = v > hi ? v : hi;
+        }
+        Vec u = __builtin_shuffle(lo, hi, even);
+        Vec v = __builtin_shuffle(lo, hi, odd);
+        u = v > u ? v : u;
+        std::memcpy(&out[x], &u, sizeof(Vec));
+      }
+    }
+    for (; x < outputX; ++x) {
+      float max = in[x * poolX];
+      for (unsigned b = 0; b < poolY; ++b) {
+        for (unsigned a = 0; a < poolX; ++a) {
+          float value = in[(b * inputX) + (x * poolX) + a];
+          max = value > max ? value : max;
+        }
+      }
+      out[x] = max;
+    }
+  }
+
+  /// Route a row of outputX errors back to the poolX x poolY areas of the
+  /// input whose maxima they are, starting at the first of poolY rows of
+  /// length inputX. Only the first input of each area, in row order, equal to
+  /// its maximum receives the error of the area, so an error is not
+  /// duplicated over tied inputs; the rest receive zero.
+  static SIMD_INLINE void maxPoolBackward(const float *in, unsigned inputX,
+                                          unsigned poolX, unsigned poolY,
+                                          const float *max,
+                                          const float *error,
+                                          unsigned outputX, float *bwdError) {
+    unsigned x = 0;
+    if (poolX == 2) {
+      // Split the even and odd columns of each row, as in maxPool, and mark
+      // each area once its maximum has been found.
+      Mask even, odd, lower, upper;
+      for (unsigned l = 0; l < W; ++l) {
+        even[l] = 2 * l;
+        odd[l] = (2 * l) + 1;
+        lower[l] = ((l % 2) * W) + (l / 2);
+        upper[l] = ((l % 2) * W) + (W / 2) + (l / 2);
+      }
+      for (; x + W <= outputX; x += W) {
+        Vec m, e;
+        std::memcpy(&m, &max[x], sizeof(Vec));
+        std::memcpy(&e, &error[x], sizeof(Vec));
+        Mask found = {};
+        for (unsigned b = 0; b < poolY; ++b) {
+          Vec lo, hi;
+          std::memcpy(&lo, &in[(b * inputX) + (2 * x)], sizeof(Vec));
+          std::memcpy(&hi, &in[(b * inputX) + (2 * x) + W], sizeof(Vec));
+          Vec u = __builtin_shuffle(lo, hi, even);
+          Vec v = __builtin_shuffle(lo, hi, odd);
+          Mask first = (u == m) & ~found;
+          found |= first;
+          Mask second = (v == m) & ~found;
+          found |= second;
+          Vec zero = {};
+          u = first ? e : zero;
+          v = second ? e : zero;
+          lo = __builtin_shuffle(u, v, lower);
+          hi = __builtin_shuffle(u, v, upper);
+          std::memcpy(&bwdError[(b * inputX) + (2 * x)], &lo, sizeof(Vec));
+          std::memcpy(&bwdError[(b * inputX) + (2 * x) + W], &hi,
+                      sizeof(Vec));
+        }
+      }
+    }
+    for (; x < outputX; ++x) {
+      bool found = false;
+      for (unsigned b = 0; b < poolY; ++b) {
+        for (unsigned a = 0; a < poolX; ++a) {
+          unsigned i = (b * inputX) + (x * poolX) + a;
+          bool first = !found && in[i] == max[x];
+          found |= first;
+          bwdError[i] = first ? error[x] : 0.0f;
+        }
+      }
+    }
+  }
+
+  /// The pixel of a width x height image at (x, y), or zero outside it.
+  static SIMD_INLINE float pixel(const float *image, unsigned width,
+                                 unsigned height, int x, int y) {
+    return unsigned(x) < width && unsigned(y) < height
+               ? image[(unsigned(y) * width) + unsigned(x)] : 0.0f;
+  }
+
+  /// Sample a width x height image at the n points (x[i], y[i]) by bilinear
+  /// interpolation, taking the image to be zero outside its bounds.
+  static SIMD_INLINE void warp(const float *image, unsigned width,
+                               unsigned height, const float *x,
+                               const float *y, float *out, unsigned n) {
+    for (unsigned i = 0; i < n; i += W) {
+      unsigned lanes = std::min(W, n - i);
+      Vec u = {}, v = {};
+      load(&x[i], lanes, u);
+      load(&y[i], lanes, v);
+      // Keep the points near enough to convert to integers.
+      u = u < -2.0f ? Vec{} - 2.0f : u;
+      u = u > float(width) ? Vec{} + float(width) : u;
+      v = v < -2.0f ? Vec{} - 2.0f : v;
+      v = v > float(height) ? Vec{} + float(height) : v;
+      // Round down, correcting the truncation of negative values.
+      Mask x0 = __builtin_convertvector(u, Mask);
+      x0 += __builtin_convertvector(x0, Vec) > u; // True is -1.
+      Mask y0 = __builtin_convertvector(v, Mask);
+      y0 += __builtin_convertvector(y0, Vec) > v;
+      Vec fx = u - __builtin_convertvector(x0, Vec);
+      Vec fy = v - __builtin_convertvector(y0, Vec);
+      Vec p00, p01, p10, p11;
+      for (unsigned l = 0; l < W; ++l) {
+        p00[l] = pixel(image, width, height, x0[l], y0[l]);
+        p01[l] = pixel(image, width, height, x0[l] + 1, y0[l]);
+        p10[l] = pixel(image, width, height, x0[l], y0[l] + 1);
+        p11[l] = pixel(image, width, height, x0[l] + 1, y0[l] + 1);
+      }
+      Vec top = p00 + (fx * (p01 - p00));
+      Vec bottom = p10 + (fx * (p11 - p10));
+      store(top + (fy * (bottom - top)), lanes, &out[i]);
+    }
+  }
+};
+
+/// The kernels compiled for one instruction set.
+struct Kernels {
+  Level level;
+  void (*microKernel)(unsigned kc, const float *a, const float *b,
+                      float alpha, float beta, float *C, unsigned ldc,
+                      unsigned mr, unsigned nr);
+  float (*dot)(const float *x, const float *y, unsigned n);
+  float (*sum)(const float *x, unsigned n);
+  void (*axpy)(float alpha, const float *x, float *y, unsigned n);
+  void (*axpby)(float alpha, const float *x, float beta, float *y,
+                unsigned n);
+  void (*relu)(const float *x, float *y, unsigned n);
+  void (*reluBackward)(const float *error, const float *x, float *y,
+                       unsigned n);
+  void (*exp)(const float *x, float *y, unsigned n);
+  void (*sigmoid)(const float *x, float *y, unsigned n);
+  void (*sigmoidBackward)(const float *error, const float *a, float *y,
+                          unsigned n);
+  void (*softmax)(const float *x, float *y, unsigned n);
+  float (*crossEntropy)(const float *a, unsigned label, unsigned n);
+  void (*maxPool)(const float *in, unsigned inputX,
+                  unsigned poolX, unsigned poolY,
+                  float *out, unsigned outputX);
+  void (*maxPoolBackward)(const float *in, unsigned inputX,
+                          unsigned poolX, unsigned poolY,
+                          const float *max, const float *error,
+                          unsigned outputX, float *bwdError);
+  void (*warp)(const float *image, unsigned width, unsigned height,
+               const float *x, const float *y, float *out, unsigned n);
+};
+
+/// Define entry points for each kernel compiled with the given target
+/// attribute and vector width, and a table of them.
+#define SIMD_KERNELS(NAME, LEVEL, W, TARGET)                                   \
+namespace NAME {                                                               \
+TARGET inline void microKernel(unsigned kc, const float *a, const float *b,    \
+                               float alpha, float beta, float *C,              \
+                               unsigned ldc, unsigned mr, unsigned nr) {       \
+  Impl<W>::microKernel(kc, a, b, alpha, beta, C, ldc, mr, nr);                 \
+}                                                                              \
+TARGET inline float dot(const float *x, const float *y, unsigned n) {          \
+  return Impl<W>::dot(x, y, n);                                                \
+}                                                                              \
+TARGET inline float sum(const float *x, unsigned n) {                          \
+  return Impl<W>::sum(x, n);                                                   \
+}                                                                              \
+TARGET inline void axpy(float alpha, const float *x, float *y, unsigned n) {   \
+  Impl<W>::axpy(alpha, x, y, n);                                               \
+}                                                                              \
+TARGET inline void axpby(float alpha, const float *x, float beta, float *y,    \
+                         unsigned n) {                                         \
+  Impl<W>::axpby(alpha, x, beta, y, n);                                        \
+}                                                                              \
+TARGET inline void relu(const float *x, float *y, unsigned n) {                \
+  Impl<W>::relu(x, y, n);                                                      \
+}                                                                              \
+TARGET inline void reluBackward(const float *error, const float *x, float *y,  \
+                                unsigned n) {                                  \
+  Impl<W>::reluBackward(error, x, y, n);                                       \
+}                                                                              \
+TARGET inline void exp(const float *x, float *y, unsigned n) {                 \
+  Impl<W>::exp(x, y, n);                                                       \
+}                                                                              \
+TARGET inline void sigmoid(const float *x, float *y, unsigned n) {             \
+  Impl<W>::sigmoid(x, y, n);                                                   \
+}                                                                              \
+TARGET inline void sigmoidBackward(const float *error, const float *a,         \
+                                   float *y, unsigned n) {                     \
+  Impl<W>::sigmoidBackward(error, a, y, n);                                    \
+}                                                                              \
+TARGET inline void softmax(const float *x, float *y, unsigned n) {             \
+  Impl<W>::softmax(x, y, n);                                                   \
+}                                                                              \
+TARGET inline float crossEntropy(const float *a, unsigned label, unsigned n) { \
+  return Impl<W>::crossEntropy(a, label, n);                                   \
+}                                                                              \
+TARGET inline void maxPool(const float *in, unsigned inputX,                   \
+                           unsigned poolX, unsigned poolY,                     \
+                           float *out, unsigned outputX) {                     \
+  Impl<W>::maxPool(in, inputX, poolX, poolY, out, outputX);                    \
+}                                                                              \
+TARGET inline void maxPoolBackward(const float *in, unsigned inputX,          \
+                                   unsigned poolX, unsigned poolY,             \
+                                   const float *max, const float *error,       \
+                                   unsigned outputX, float *bwdError) {        \
+  Impl<W>::maxPoolBackward(in, inputX, poolX, poolY, max, error, outputX,      \
+                           bwdError);                                          \
+}                                                                              \
+TARGET inline void warp(const float *image, unsigned width, unsigned height,   \
+                        const float *x, const float *y, float *out,            \
+                        unsigned n) {                                          \
+  Impl<W>::warp(image, width, height, x, y, out, n);                           \
+}                                                                              \
+inline const Kernels &getKernels() {                                           \
+  static const Kernels kernels = {                                             \
+    LEVEL, microKernel, dot, sum, axpy, axpby, relu, reluBackward,             \
+    exp, sigmoid, sigmoidBackward, softmax, crossEntropy,                      \
+    maxPool, maxPoolBackward, warp                                             \
+  };                                                                           \
+  return kernels;                                                              \
+}                                                                              \
+}
+
+SIMD_KERNELS(generic, Level::Generic, 4, )
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+SIMD_KERNELS(sse4, Level::SSE4, 4, __attribute__((target("sse4.2"))))
+SIMD_KERNELS(avx2, Level::AVX2, 8, __attribute__((target("avx2"))))
+SIMD_KERNELS(avx512, Level::AVX512, 16, __attribute__((target("avx512f"))))
+#endif
+
+#undef SIMD_KERNELS
+#undef SIMD_INLINE
+
+/// The best instruction set supported by this CPU.
+inline Level detectLevel() {
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return Level::AVX512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return Level::AVX2;
+  }
+  if (__builtin_cpu_supports("sse4.2")) {
+    return Level::SSE4;
+  }
+#endif
+  return Level::Generic;
+}
+
+inline const Kernels &getKernels(Level level) {
+  switch (level) {
+#ifdef SIMD_X86
+  case Level::SSE4:   return sse4::getKernels();
+  case Level::AVX2:   return avx2::getKernels();
+  case Level::AVX512: return avx512::getKernels();
+#endif
+  default:            return generic::getKernels();
+  }
+}
+
+inline const Kernels *&activeKernels() {
+  static const Kernels *kernels = &getKernels(detectLevel());
+  return kernels;
+}
+
+/// The kernels in use, for the detected instruction set unless overridden.
+inline const Kernels &kernels() {
+  return *activeKernels();
+}
+
+/// Use the kernels for a given instruction set, which the CPU must support.
+inline void setLevel(Level level) {
+  activeKernels() = &getKernels(level);
+}
+
+} // End namespace simd.
+
+#endif
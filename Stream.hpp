@@ -0,0 +1,286 @@
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+#include "Data.hpp"
+#include "Gzip.hpp"
+#include "MappedFile.hpp"
+#include "Params.hpp"
+
+///===--------------------------------------------------------------------===///
+/// Streamed training data.
+///
+/// A training set too large to hold in memory is read from a list of shards,
+/// each a pair of IDX image and label files, which may be gzipped. Each epoch
+/// visits the shards in a shuffled order and reads each one sequentially, in
+/// large blocks. The images pass through a window of Params::shuffleWindow
+/// images, from which each image of a minibatch is drawn at random and
+/// replaced by the next one read, so the order is shuffled across shards and
+/// within the span of the window.
+///===--------------------------------------------------------------------===///
+
+class StreamedSet;
+
+/// A training set streamed from shards, and a test set, which is read into
+/// memory as Data reads it.
+class StreamingData {
+public:
+  struct Shard {
+    std::string imagesFile;
+    std::string labelsFile;
+    unsigned numImages;
+  };
+
+private:
+  std::vector<Shard> shards;
+  unsigned numTrainingImages;
+  unsigned shuffleWindow;
+  std::unique_ptr<idx::File> testFile;
+  std::vector<uint8_t> testLabels;
+  std::vector<uint8_t> validationLabels;
+  std::vector<Image>   testImages;
+  std::vector<Image>   validationImages;
+
+  /// Read the header of an IDX file, returning the size of the file. The
+  /// size of a gzipped file is not known until it is read, so it is taken to
+  /// be the size the header gives, and a short file is found when it is read.
+  static uint64_t readHeader(const std::string &filename, char *header,
+                             unsigned headerSize) {
+    if (gzip::isCompressed(filename)) {
+      gzip::Reader file(filename);
+      if (!file.read(header, headerSize)) {
+        return 0;
+      }
+      uint64_t numItems = idx::readField(header, 1);
+      return headerSize == idx::imagesHeaderSize
+                 ? headerSize + (numItems * idx::readField(header, 2) *
+                                 idx::readField(header, 3))
+                 : headerSize + numItems;
+    }
+    std::ifstream file;
+    file.open(filename, std::ios::binary | std::ios::in | std::ios::ate);
+    if (!file.good()) {
+      std::cout << "Error opening file " << filename << '\n';
+      std::exit(1);
+    }
+    uint64_t size = file.tellg();
+    file.seekg(0);
+    file.read(header, std::min<uint64_t>(size, headerSize));
+    return size;
+  }
+
+public:
+  /// The order in which training visits the training set.
+  using TrainingSet = StreamedSet;
+
+  /// Stream the training set from shards of the given image and label files.
+  StreamingData(Params params, const std::vector<std::string> &imagesFiles,
+                const std::vector<std::string> &labelsFiles) :
+      numTrainingImages(0), shuffleWindow(params.shuffleWindow) {
+    if (imagesFiles.size() != labelsFiles.size() || imagesFiles.empty()) {
+      std::cout << "Error: each shard needs an image and a label file\n";
+      std::exit(1);
+    }
+    if (params.numValidationImages) {
+      std::cout << "Error: validation images are not taken from streamed "
+                   "training data\n";
+      std::exit(1);
+    }
+    if (!shuffleWindow) {
+      std::cout << "Error: the shuffle window must hold an image\n";
+      std::exit(1);
+    }
+    uint64_t total = 0;
+    for (unsigned i = 0; i < imagesFiles.size(); ++i) {
+      const char *imagesFile = imagesFiles[i].c_str();
+      const char *labelsFile = labelsFiles[i].c_str();
+      std::cout << "Opening shard: " << imagesFile << ", " << labelsFile
+                << "\n";
+      char header[idx::imagesHeaderSize] = {};
+      uint64_t size = readHeader(imagesFiles[i], header,
+                                 idx::imagesHeaderSize);
+      uint32_t numImages = idx::checkImagesHeader(header, size, imagesFile);
+      size = readHeader(labelsFiles[i], header, idx::labelsHeaderSize);
+      uint32_t numLabels = idx::checkLabelsHeader(header, size, labelsFile);
+      idx::check(numLabels == numImages, labelsFile,
+                 "labels do not match images");
+      shards.push_back({imagesFiles[i], labelsFiles[i], numImages});
+      total += numImages;
+    }
+    idx::check(total <= std::numeric_limits<unsigned>::max(),
+               imagesFiles.back().c_str(), "too many images");
+    numTrainingImages = total;
+    idx::readLabels(idx::locate("t10k-labels-idx1-ubyte"), testLabels);
+    testFile = idx::readImages(idx::locate("t10k-images-idx3-ubyte"),
+                               testImages);
+    testLabels.erase(testLabels.begin() + params.numTestImages,
+                     testLabels.end());
+    testImages.erase(testImages.begin() + params.numTestImages,
+                     testImages.end());
+  }
+  const std::vector<Shard> &getShards() const { return shards; }
+  unsigned getShuffleWindow() const { return shuffleWindow; }
+  unsigned getNumTrainingImages() const { return numTrainingImages; }
+  const std::vector<Image> &getValidationImages() const {
+    return validationImages;
+  }
+  const std::vector<uint8_t> &getValidationLabels() const {
+    return validationLabels;
+  }
+  const std::vector<Image> &getTestImages() const { return testImages; }
+  const std::vector<uint8_t> &getTestLabels() const { return testLabels; }
+};
+
+/// The training set of a StreamingData, read a shard at a time. An epoch
+/// depends only on its shuffle seed.
+class StreamedSet {
+  static constexpr unsigned blockSize = 1 << 22; // Bytes read at a time.
+  const std::vector<StreamingData::Shard> &shards;
+  unsigned numImages;
+  uint32_t seed;
+  std::default_random_engine engine;
+  std::vector<unsigned> shardOrder;
+  // The shard being read, and the block of it last read.
+  unsigned nextShard;
+  const StreamingData::Shard *shard;
+  std::unique_ptr<gzip::Reader> file;
+  std::vector<uint8_t> shardLabels;
+  unsigned blockStart;    // Index in the shard of the first image in block.
+  unsigned blockPosition; // Index in block of the next image.
+  unsigned blockImages;
+  std::vector<uint8_t> block;
+  // The window of images drawn from.
+  unsigned windowImages;
+  std::vector<uint8_t> windowPixels;
+  std::vector<uint8_t> windowLabels;
+
+  /// Start reading the next shard, or return false at the end of the epoch.
+  bool openNextShard() {
+    if (nextShard == shardOrder.size()) {
+      return false;
+    }
+    shard = &shards[shardOrder[nextShard++]];
+    // Labels are read whole; they are a small fraction of a shard.
+    char header[idx::imagesHeaderSize];
+    shardLabels.resize(shard->numImages);
+    gzip::Reader labelsFile(shard->labelsFile);
+    file.reset(new gzip::Reader(shard->imagesFile));
+    if (!labelsFile.read(header, idx::labelsHeaderSize) ||
+        !labelsFile.read(shardLabels.data(), shard->numImages) ||
+        !file->read(header, idx::imagesHeaderSize)) {
+      std::cout << "Error reading shard " << shard->imagesFile << '\n';
+      std::exit(1);
+    }
+    blockStart = 0;
+    blockPosition = 0;
+    blockImages = 0;
+    return true;
+  }
+
+  /// Read the next image of the epoch into a slot of the window, or return
+  /// false if there are none left.
+  bool readImage(unsigned slot) {
+    while (blockPosition == blockImages) {
+      unsigned nextImage = shard ? blockStart + blockImages : 0;
+      if (!shard || nextImage == shard->numImages) {
+        if (!openNextShard()) {
+          return false;
+        }
+        continue;
+      }
+      blockStart = nextImage;
+      blockPosition = 0;
+      blockImages = std::min<unsigned>(block.size() / idx::imageSize,
+                                       shard->numImages - blockStart);
+      if (!file->read(block.data(), blockImages * idx::imageSize)) {
+        std::cout << "Error reading shard " << shard->imagesFile << '\n';
+        std::exit(1);
+      }
+    }
+    std::copy_n(&block[blockPosition * idx::imageSize], idx::imageSize,
+                &windowPixels[slot * idx::imageSize]);
+    windowLabels[slot] = shardLabels[blockStart + blockPosition];
+    ++blockPosition;
+    return true;
+  }
+
+  /// Draw an image at random from the window, writing its scaled pixels to
+  /// values if it is not null, and replace it with the next one read.
+  uint8_t draw(float *values) {
+    std::uniform_int_distribution<unsigned> distribution(0, windowImages - 1);
+    unsigned slot = distribution(engine);
+    if (values) {
+      Image(&windowPixels[slot * idx::imageSize], idx::imageSize)
+          .copyTo(values);
+    }
+    uint8_t label = windowLabels[slot];
+    if (!readImage(slot)) {
+      // Fill the gap with the last image as the window drains.
+      --windowImages;
+      std::copy_n(&windowPixels[windowImages * idx::imageSize],
+                  idx::imageSize, &windowPixels[slot * idx::imageSize]);
+      windowLabels[slot] = windowLabels[windowImages];
+    }
+    return label;
+  }
+
+public:
+  explicit StreamedSet(const StreamingData &data) :
+      shards(data.getShards()), numImages(data.getNumTrainingImages()),
+      seed(0), shardOrder(shards.size()), nextShard(0), shard(nullptr),
+      blockStart(0), blockPosition(0), blockImages(0),
+      block((blockSize / idx::imageSize) * idx::imageSize), windowImages(0),
+      windowPixels(std::min(data.getShuffleWindow(), numImages) *
+                   idx::imageSize),
+      windowLabels(std::min(data.getShuffleWindow(), numImages)) {}
+
+  unsigned size() const { return numImages; }
+
+  /// Start an epoch in a new order.
+  void shuffle(uint32_t seed_) { seed = seed_; }
+
+  /// Move to an image in the order of the epoch, reading the epoch from the
+  /// start up to it.
+  void seek(unsigned image) {
+    engine.seed(seed);
+    std::iota(shardOrder.begin(), shardOrder.end(), 0);
+    std::shuffle(shardOrder.begin(), shardOrder.end(), engine);
+    nextShard = 0;
+    shard = nullptr;
+    blockStart = blockPosition = blockImages = 0;
+    windowImages = 0;
+    while (windowImages < windowLabels.size() && readImage(windowImages)) {
+      ++windowImages;
+    }
+    for (unsigned i = 0; i < image; ++i) {
+      draw(nullptr);
+    }
+  }
+
+  /// Pass over the next numImages images, which are still read.
+  void skip(unsigned numImages) {
+    for (unsigned i = 0; i < numImages; ++i) {
+      draw(nullptr);
+    }
+  }
+
+  /// Gather the next minibatch.
+  void gather(Minibatch &batch) {
+    unsigned imageSize = batch.images.size() / batch.labels.size();
+    for (unsigned mb = 0; mb < batch.labels.size(); ++mb) {
+      batch.labels[mb] = draw(&batch.images[mb * imageSize]);
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef _TENSOR_H_
+#define _TENSOR_H_
+
+#include <boost/align/aligned_allocator.hpp>
+#include <vector>
+
+/// Contiguous, cache-line aligned storage for layer state and parameters.
+using Tensor =
+    std::vector<float, boost::alignment::aligned_allocator<float, 64>>;
+
+#endif
@@ -0,0 +1,312 @@
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "Params.hpp"
+#include "Simd.hpp"
+
+///===--------------------------------------------------------------------===///
+/// Transport between the processes of a data-parallel run.
+///
+/// Params::numProcesses processes, each started with its own
+/// Params::processRank, train copies of one network on their own slices of
+/// each step's images and combine their gradients with an all-reduce before
+/// each update. A Group is the transport between them; SocketGroup, the one
+/// backend so far, connects the processes of one machine in a ring of
+/// Unix-domain sockets. Its all-reduce is the ring algorithm: the data is
+/// cut into one chunk per process, each process sums a chunk as it passes
+/// around the ring and then passes the total around again, so each process
+/// sends and receives twice the data whatever their number. Each total is
+/// made by one process and copied to the others, so all see the same bits.
+///===--------------------------------------------------------------------===///
+namespace transport {
+
+/// The processes of a run, as seen from one of them.
+class Group {
+public:
+  virtual ~Group() {}
+  virtual unsigned getRank() const = 0;
+  virtual unsigned getSize() const = 0;
+  /// Sum the size floats at data across the processes, leaving the total in
+  /// each.
+  virtual void allReduce(float *data, size_t size) = 0;
+  /// Copy bytes at data from the process of rank 0 to the others.
+  virtual void broadcast(void *data, size_t bytes) = 0;
+};
+
+/// A ring of processes on one machine connected by Unix-domain sockets, each
+/// listening at a path of the given prefix followed by its rank.
+class SocketGroup : public Group {
+  unsigned rank;
+  unsigned size;
+  int next = -1; // Connected to the next process in the ring.
+  int prev = -1; // Accepted from the previous one.
+  std::vector<float> incoming;
+
+  [[noreturn]] static void fail(const std::string &what) {
+    std::cout << "Error: " << what << ": " << std::strerror(errno) << '\n';
+    std::exit(1);
+  }
+
+  static sockaddr_un getAddress(const std::string &path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+      std::cout << "Error: socket path " << path << " is too long\n";
+      std::exit(1);
+    }
+    std::strcpy(address.sun_path, path.c_str());
+    return address;
+  }
+
+  /// Send outBytes to the next process while receiving inBytes from the
+  /// previous one, so that the ring cannot stall with every process blocked
+  /// sending.
+  void exchange(const void *out, size_t outBytes, void *in, size_t inBytes) {
+    auto outPtr = static_cast<const char*>(out);
+    auto inPtr = static_cast<char*>(in);
+    while (outBytes || inBytes) {
+      pollfd fds[2] = {{next, short(outBytes ? POLLOUT : 0), 0},
+                       {prev, short(inBytes ? POLLIN : 0), 0}};
+      if (poll(fds, 2, -1) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        fail("poll failed");
+      }
+      if (outBytes && fds[0].revents) {
+        ssize_t sent = send(next, outPtr, outBytes, MSG_NOSIGNAL);
+        if (sent < 0 && errno != EAGAIN && errno != EINTR) {
+          fail("send to process " + std::to_string((rank + 1) % size) +
+               " failed");
+        }
+        if (sent > 0) {
+          outPtr += sent;
+          outBytes -= sent;
+        }
+      }
+      if (inBytes && fds[1].revents) {
+        ssize_t received = recv(prev, inPtr, inBytes, 0);
+        if (received == 0) {
+          std::cout << "Error: process " << (rank + size - 1) % size
+                    << " closed its connection\n";
+          std::exit(1);
+        }
+        if (received < 0 && errno != EAGAIN && errno != EINTR) {
+          fail("receive from process " +
+               std::to_string((rank + size - 1) % size) + " failed");
+        }
+        if (received > 0) {
+          inPtr += received;
+          inBytes -= received;
+        }
+      }
+    }
+  }
+
+public:
+  /// Join a ring of size processes as the given rank, waiting for the
+  /// others to start.
+  SocketGroup(const std::string &prefix, unsigned rank, unsigned size) :
+      rank(rank), size(size) {
+    std::string path = prefix + std::to_string(rank);
+    sockaddr_un address = getAddress(path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+    if (listener < 0 ||
+        bind(listener, reinterpret_cast<sockaddr*>(&address),
+             sizeof(address)) != 0 ||
+        listen(listener, 1) != 0) {
+      fail("listening at " + path);
+    }
+    // Connect to the next process, which may not have started listening.
+    const std::chrono::milliseconds connectTimeout(60000);
+    std::string nextPath = prefix + std::to_string((rank + 1) % size);
+    sockaddr_un nextAddress = getAddress(nextPath);
+    auto start = std::chrono::steady_clock::now();
+    while (true) {
+      next = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (next >= 0 &&
+          connect(next, reinterpret_cast<sockaddr*>(&nextAddress),
+                  sizeof(nextAddress)) == 0) {
+        break;
+      }
+      if (next >= 0) {
+        close(next);
+      }
+      if (std::chrono::steady_clock::now() - start > connectTimeout) {
+        fail("connecting to " + nextPath);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    prev = accept(listener, nullptr, nullptr);
+    if (prev < 0) {
+      fail("accepting at " + path);
+    }
+    close(listener);
+    unlink(path.c_str());
+    fcntl(next, F_SETFL, fcntl(next, F_GETFL) | O_NONBLOCK);
+    fcntl(prev, F_SETFL, fcntl(prev, F_GETFL) | O_NONBLOCK);
+  }
+
+  ~SocketGroup() {
+    close(next);
+    close(prev);
+  }
+
+  SocketGroup(const SocketGroup&) = delete;
+  SocketGroup &operator=(const SocketGroup&) = delete;
+
+  unsigned getRank() const override { return rank; }
+  unsigned getSize() const override { return size; }
+
+  void allReduce(float *data, size_t numFloats) override {
+    // Chunk c is [bounds[c], bounds[c + 1]).
+    std::vector<size_t> bounds(size + 1);
+    for (unsigned c = 0; c <= size; ++c) {
+      bounds[c] = (numFloats * c) / size;
+    }
+    incoming.resize((numFloats / size) + 1);
+    auto chunkSize = [&](unsigned c) { return bounds[c + 1] - bounds[c]; };
+    // Reduce-scatter: pass each chunk once around the ring, adding to it,
+    // leaving the total of chunk rank + 1 here.
+    for (unsigned step = 0; step + 1 < size; ++step) {
+      unsigned out = (rank + size - step) % size;
+      unsigned in = (rank + size - step - 1) % size;
+      exchange(&data[bounds[out]], chunkSize(out) * sizeof(float),
+               incoming.data(), chunkSize(in) * sizeof(float));
+      simd::kernels().axpy(1.0f, incoming.data(), &data[bounds[in]],
+                           chunkSize(in));
+    }
+    // All-gather: pass each total around the ring.
+    for (unsigned step = 0; step + 1 < size; ++step) {
+      unsigned out = (rank + 1 + size - step) % size;
+      unsigned in = (rank + size - step) % size;
+      exchange(&data[bounds[out]], chunkSize(out) * sizeof(float),
+               &data[bounds[in]], chunkSize(in) * sizeof(float));
+    }
+  }
+
+  void broadcast(void *data, size_t bytes) override {
+    // Pass the data around the ring from rank 0, stopping before it returns.
+    if (rank != 0) {
+      exchange(nullptr, 0, data, bytes);
+    }
+    if (rank + 1 != size) {
+      exchange(data, bytes, nullptr, 0);
+    }
+  }
+};
+
+/// Join the group of processes of a data-parallel run.
+inline std::unique_ptr<Group> connect(const Params &params) {
+  if (params.processRank >= params.numProcesses) {
+    std::cout << "Error: process rank " << params.processRank
+              << " is not below the number of processes\n";
+    std::exit(1);
+  }
+  if (params.socketPath.empty()) {
+    std::cout << "Error: processes of a data-parallel run need a socket "
+                 "path\n";
+    std::exit(1);
+  }
+  return std::unique_ptr<Group>(new SocketGroup(
+      params.socketPath, params.processRank, params.numProcesses));
+}
+
+/// All-reduces buffers on a thread of its own, in the order they are posted,
+/// so that their communication overlaps the computation that follows.
+/// Records how long training waits for them.
+class AsyncAllReduce {
+  Group &group;
+  std::deque<std::pair<float*, size_t>> queue; // Guarded by mutex.
+  unsigned numPending = 0;                     // Guarded by mutex.
+  bool stopping = false;                       // Guarded by mutex.
+  std::mutex mutex;
+  std::condition_variable posted;
+  std::condition_variable done;
+  double waitMs = 0.0;
+  std::thread thread;
+
+  void run() {
+    while (true) {
+      std::pair<float*, size_t> buffer;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        posted.wait(lock, [&] { return stopping || !queue.empty(); });
+        if (queue.empty()) {
+          return;
+        }
+        buffer = queue.front();
+        queue.pop_front();
+      }
+      group.allReduce(buffer.first, buffer.second);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        --numPending;
+      }
+      done.notify_one();
+    }
+  }
+
+public:
+  explicit AsyncAllReduce(Group &group) :
+      group(group), thread(&AsyncAllReduce::run, this) {}
+
+  ~AsyncAllReduce() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    posted.notify_one();
+    thread.join();
+  }
+
+  AsyncAllReduce(const AsyncAllReduce&) = delete;
+  AsyncAllReduce &operator=(const AsyncAllReduce&) = delete;
+
+  /// Start the all-reduce of a buffer, which is not to be touched until
+  /// wait() returns.
+  void post(float *data, size_t size) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.emplace_back(data, size);
+      ++numPending;
+    }
+    posted.notify_one();
+  }
+
+  /// Wait for the buffers posted to be reduced.
+  void wait() {
+    auto start = std::chrono::high_resolution_clock::now();
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return numPending == 0; });
+    auto end = std::chrono::high_resolution_clock::now();
+    waitMs += std::chrono::duration<double, std::milli>(end - start).count();
+  }
+
+  double getWaitMs() const { return waitMs; }
+};
+
+} // End namespace transport.
+
+#endif
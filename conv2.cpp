@@ -1,23 +1,28 @@
 #include <chrono>
 #include <iostream>
+#include <string>
 #include "tbb/tbb.h"
 #include "Data.hpp"
 #include "Params.hpp"
 #include "Network.hpp"
 
-int main(void) {
+int main(int argc, char **argv) {
   tbb::task_scheduler_init init;
-  constexpr unsigned mbSize = 10;
   Params params;
+  params.mbSize = 10;
   params.numEpochs = 60;
   params.learningRate = 0.03f;
-  params.lambda = 0.1f;
+  // Each update decays the weights by learningRate * lambda / 60000, the
+  // learningRate * 0.1 / mbSize of the results in the README.
+  params.lambda = 600.0f;
   params.seed = std::time(nullptr);
   params.numValidationImages = 0;
   params.numTrainingImages = 60000;
   params.numTestImages = 10000;
   params.monitorTrainingAccuracy = true;
-  params.dump(mbSize, init.default_num_threads());
+  params.checkpointFile = "conv2.checkpoint";
+  params.checkpointInterval = 10000;
+  params.dump(init.default_num_threads());
   // Read the MNIST data.
   Data data(params);
   // Create the network.
@@ -25,20 +30,24 @@ int main(void) {
   constexpr unsigned conv1FMs = 8;
   constexpr unsigned conv2FMs = 4;
   constexpr unsigned fcSize = 100;
-  Network<mbSize, 28, 28, 10, fcSize,
-          CrossEntropyCost::compute,
-          CrossEntropyCost::delta> network(params, {
-      new ConvLayer<mbSize, 5, 5, 1, 28, 28, 1, conv1FMs,
-                    ReLU::compute, ReLU::deriv>(params),
-      new MaxPoolLayer<mbSize, 2, 2, 24, 24, conv1FMs>(),
-      new ConvLayer<mbSize, 5, 5, conv1FMs, 12, 12, conv1FMs, conv2FMs,
-                    ReLU::compute, ReLU::deriv>(params),
-      new MaxPoolLayer<mbSize, 2, 2, 8, 8, conv2FMs>(),
-      new FullyConnectedLayer<mbSize, fcSize, 4*4*conv2FMs,
-                              Sigmoid::compute,
-                              Sigmoid::deriv>(params)});
-  // Run it.
+  StaticNetwork<28, 28, 10, fcSize,
+                CrossEntropyCost::compute,
+                CrossEntropyCost::delta,
+                ConvLayer<5, 5, 1, 28, 28, 1, conv1FMs,
+                          ReLU::compute, ReLU::deriv>,
+                MaxPoolLayer<2, 2, 24, 24, conv1FMs>,
+                ConvLayer<5, 5, conv1FMs, 12, 12, conv1FMs, conv2FMs,
+                          ReLU::compute, ReLU::deriv>,
+                MaxPoolLayer<2, 2, 8, 8, conv2FMs>,
+                FullyConnectedLayer<fcSize, 4*4*conv2FMs,
+                                    Sigmoid::compute,
+                                    Sigmoid::deriv>> network(params);
+  // Run it, or continue the run in the checkpoint file.
   std::cout << "Running...\n";
-  network.SGD(data);
+  if (argc > 1 && std::string(argv[1]) == "--resume") {
+    network.resume(data);
+  } else {
+    network.SGD(data);
+  }
   return 0;
 }
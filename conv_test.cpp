@@ -0,0 +1,174 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+#include "tbb/tbb.h"
+#include "Model.hpp"
+#include "Params.hpp"
+#include "Network.hpp"
+
+///===--------------------------------------------------------------------===///
+/// Check the convolution algorithms against the direct one.
+///
+/// Each ConvLayer below is run for one step of training, feedForward,
+/// backPropogate, calcBwdError and endBatch, once with each algorithm, from
+/// the same weights, inputs and errors. The outputs, the errors passed back
+/// to the inputs and the updated weights and biases must match those of
+/// ConvAlgorithm::Direct to within a tolerance relative to the largest
+/// magnitude of each: the algorithms sum the same products in other orders,
+/// and Winograd and FFT through transforms that round differently, so they
+/// cannot be expected to agree to the last bit.
+///===--------------------------------------------------------------------===///
+
+/// The largest difference allowed, relative to the largest magnitude of the
+/// direct result. The transforms of Winograd F(4x4, 3x3) have larger
+/// coefficients than those of F(2x2, 3x3), which amplify its rounding; it
+/// differs by up to 4e-6 on the layers below, the others by up to 8e-7.
+static float getTolerance(ConvAlgorithm algorithm) {
+  return algorithm == ConvAlgorithm::WinogradF4 ? 1e-5f : 1e-6f;
+}
+
+static constexpr unsigned batchSize = 3;
+static constexpr float learningRate = 0.1f;
+static constexpr float lambda = 5.0f;
+static constexpr unsigned numTrainingImages = 100;
+
+/// Supplies a ConvLayer with random activations, as its inputs, or random
+/// errors, as its outputs, and keeps the errors passed back to it.
+class StubLayer : public Layer {
+  Tensor bwdErrors;
+
+public:
+  StubLayer(unsigned x, unsigned y, unsigned z, unsigned seed) :
+      Layer(x, y, z) {
+    setBatchSize(batchSize);
+    std::default_random_engine gen(seed);
+    std::normal_distribution<float> distribution(0, 1.0f);
+    bwdErrors.resize(batchSize * size());
+    for (unsigned i = 0; i < batchSize * size(); ++i) {
+      activations[i] = distribution(gen);
+      bwdErrors[i] = distribution(gen);
+    }
+  }
+  void initialiseDefaultWeights(std::default_random_engine&) override {}
+  void feedForward() override { UNREACHABLE(); }
+  void calcBwdError() override { UNREACHABLE(); }
+  void backPropogate() override { UNREACHABLE(); }
+  void accumulateGradients() override { UNREACHABLE(); }
+  void applyGradients(float, unsigned, unsigned) override { UNREACHABLE(); }
+  void endBatch(float, unsigned, unsigned) override { UNREACHABLE(); }
+  void setInputs(Layer*) override { UNREACHABLE(); }
+  void setOutputs(Layer*) override { UNREACHABLE(); }
+  Layer *clone() const override { UNREACHABLE(); }
+  void save(model::Writer&) const override { UNREACHABLE(); }
+  void load(const float*, const float*) override { UNREACHABLE(); }
+  const float *getBwdErrors(unsigned mb) override {
+    return &bwdErrors[mb * size()];
+  }
+};
+
+/// The results of a step of training of a layer.
+struct Results {
+  std::vector<float> activations;
+  std::vector<float> bwdErrors;
+  std::vector<float> weights;
+  std::vector<float> bias;
+};
+
+template <typename LayerTy, unsigned inputX, unsigned inputY, unsigned inputZ>
+static Results trainStep(ConvAlgorithm algorithm) {
+  Params params = Params();
+  params.mbSize = batchSize;
+  params.lambda = lambda;
+  params.convAlgorithm = algorithm;
+  LayerTy layer(params);
+  layer.setBatchSize(batchSize);
+  std::default_random_engine gen(1);
+  layer.initialiseDefaultWeights(gen);
+  StubLayer inputs(inputX, inputY, inputZ, 2);
+  StubLayer outputs(layer.getDim(0), layer.getDim(1), layer.getDim(2), 3);
+  layer.setInputs(&inputs);
+  layer.setOutputs(&outputs);
+  layer.feedForward();
+  layer.backPropogate();
+  layer.calcBwdError();
+  layer.endBatch(learningRate, batchSize, numTrainingImages);
+  Results results;
+  const float *activations = layer.getActivations(0);
+  results.activations.assign(activations,
+                             activations + batchSize * layer.size());
+  results.bwdErrors.assign(layer.getBwdErrors(0),
+                           layer.getBwdErrors(0) + batchSize * inputs.size());
+  model::Writer writer(inputX, inputY);
+  layer.save(writer);
+  model::Buffer buffer = writer.getBuffer();
+  model::Reader reader(buffer.data(), buffer.size(), "conv_test");
+  const model::LayerDescriptor &descriptor = reader.getLayer(0);
+  results.weights.assign(reader.getWeights(0),
+                         reader.getWeights(0) + descriptor.numWeights);
+  results.bias.assign(reader.getBias(0),
+                      reader.getBias(0) + descriptor.numBias);
+  return results;
+}
+
+/// Whether values matches expected to within tolerance, reporting the largest
+/// relative difference.
+static bool check(const char *name, float tolerance,
+                  const std::vector<float> &expected,
+                  const std::vector<float> &values) {
+  if (values.size() != expected.size()) {
+    std::printf("  %-12s %zu values, expected %zu  FAILED\n", name,
+                values.size(), expected.size());
+    return false;
+  }
+  float magnitude = 0.0f;
+  float difference = 0.0f;
+  for (unsigned i = 0; i < expected.size(); ++i) {
+    magnitude = std::max(magnitude, std::fabs(expected[i]));
+    difference = std::max(difference, std::fabs(values[i] - expected[i]));
+  }
+  float relative = difference / std::max(magnitude, 1e-30f);
+  bool ok = relative <= tolerance;
+  std::printf("  %-12s %.2e%s\n", name, relative, ok ? "" : "  FAILED");
+  return ok;
+}
+
+/// Compare a step of training of the layer with each algorithm to one with
+/// the direct algorithm.
+template <typename LayerTy, unsigned inputX, unsigned inputY, unsigned inputZ>
+static bool test(const char *name,
+                 std::initializer_list<ConvAlgorithm> algorithms) {
+  Results expected =
+      trainStep<LayerTy, inputX, inputY, inputZ>(ConvAlgorithm::Direct);
+  bool ok = true;
+  for (ConvAlgorithm algorithm : algorithms) {
+    std::printf("%s %s\n", name, getConvAlgorithmName(algorithm));
+    Results results = trainStep<LayerTy, inputX, inputY, inputZ>(algorithm);
+    float tolerance = getTolerance(algorithm);
+    ok &= check("activations", tolerance, expected.activations,
+                results.activations);
+    ok &= check("bwdErrors", tolerance, expected.bwdErrors, results.bwdErrors);
+    ok &= check("weights", tolerance, expected.weights, results.weights);
+    ok &= check("bias", tolerance, expected.bias, results.bias);
+  }
+  return ok;
+}
+
+template <unsigned kernel, unsigned input, unsigned inputZ, unsigned numFMs>
+using Conv = ConvLayer<kernel, kernel, inputZ, input, input, inputZ, numFMs,
+                       ReLU::compute, ReLU::deriv>;
+
+int main(void) {
+  tbb::task_scheduler_init init;
+  auto all = {ConvAlgorithm::Im2Col, ConvAlgorithm::WinogradF2,
+              ConvAlgorithm::WinogradF4, ConvAlgorithm::FFT};
+  auto general = {ConvAlgorithm::Im2Col, ConvAlgorithm::FFT};
+  bool ok = true;
+  ok &= test<Conv<3, 13, 8, 8>, 13, 13, 8>("3x3 13x13x8 8", all);
+  ok &= test<Conv<3, 14, 8, 16>, 14, 14, 8>("3x3 14x14x8 16", all);
+  ok &= test<Conv<3, 28, 16, 8>, 28, 28, 16>("3x3 28x28x16 8", all);
+  ok &= test<Conv<5, 28, 8, 8>, 28, 28, 8>("5x5 28x28x8 8", general);
+  std::printf(ok ? "All passed\n" : "Failed\n");
+  return ok ? 0 : 1;
+}
@@ -3,7 +3,9 @@ wget http://yann.lecun.com/exdb/mnist/train-images-idx3-ubyte.gz
 wget http://yann.lecun.com/exdb/mnist/train-labels-idx1-ubyte.gz
 wget http://yann.lecun.com/exdb/mnist/t10k-images-idx3-ubyte.gz
 wget http://yann.lecun.com/exdb/mnist/t10k-labels-idx1-ubyte.gz
-gunzip train-images-idx3-ubyte.gz
-gunzip train-labels-idx1-ubyte.gz
-gunzip t10k-images-idx3-ubyte.gz
-gunzip t10k-labels-idx1-ubyte.gz
+# Keep the gzipped files, which Data can read, but unpack them too, so that
+# each run maps the files in place instead of inflating them.
+gunzip -k train-images-idx3-ubyte.gz
+gunzip -k train-labels-idx1-ubyte.gz
+gunzip -k t10k-images-idx3-ubyte.gz
+gunzip -k t10k-labels-idx1-ubyte.gz
@@ -0,0 +1,146 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "tbb/tbb.h"
+#include "Data.hpp"
+#include "Params.hpp"
+#include "Network.hpp"
+
+///===--------------------------------------------------------------------===///
+/// Check that data-parallel processes train as replicas do.
+///
+/// A network is trained with a scaled learning rate and a warm-up, once by
+/// two replicas in one process and once by two processes of one replica
+/// each. Both sum the gradients of the same images in the same order for
+/// each update, at the same rate, so they must save the same model, to the
+/// byte. The images are random, written as IDX files to a temporary
+/// directory.
+///===--------------------------------------------------------------------===///
+
+static constexpr unsigned numTrainingImages = 400;
+static constexpr unsigned numTestImages = 100;
+static constexpr unsigned parallelism = 2;
+
+/// Write big-endian header words.
+static void writeHeader(std::ofstream &file,
+                        std::initializer_list<uint32_t> fields) {
+  for (uint32_t field : fields) {
+    uint32_t bigEndian = __builtin_bswap32(field);
+    file.write(reinterpret_cast<const char*>(&bigEndian), 4);
+  }
+}
+
+/// Write an image and a label file of numImages random images.
+static void writeDataset(const std::string &images, const std::string &labels,
+                         unsigned numImages, unsigned seed) {
+  std::default_random_engine gen(seed);
+  std::uniform_int_distribution<unsigned> pixel(0, 255);
+  std::uniform_int_distribution<unsigned> digit(0, 9);
+  std::ofstream imageFile(images, std::ios::binary);
+  writeHeader(imageFile, {idx::imagesMagic, numImages, idx::imageHeight,
+                          idx::imageWidth});
+  for (unsigned i = 0; i < numImages * idx::imageSize; ++i) {
+    imageFile.put(char(pixel(gen)));
+  }
+  std::ofstream labelFile(labels, std::ios::binary);
+  writeHeader(labelFile, {idx::labelsMagic, numImages});
+  for (unsigned i = 0; i < numImages; ++i) {
+    labelFile.put(char(digit(gen)));
+  }
+}
+
+/// Train the network as one of numProcesses processes of numReplicas
+/// replicas, the first of which writes the model.
+static void train(unsigned numReplicas, unsigned numProcesses, unsigned rank,
+                  const std::string &modelFile) {
+  tbb::task_scheduler_init init;
+  Params params = Params();
+  params.mbSize = 10;
+  params.numEpochs = 2;
+  params.learningRate = 0.05f;
+  params.lambda = 0.1f;
+  params.seed = 1;
+  params.numValidationImages = 0;
+  params.numTrainingImages = numTrainingImages;
+  params.numTestImages = numTestImages;
+  params.scaleLearningRate = true;
+  params.warmupImages = numTrainingImages / 2;
+  params.numReplicas = numReplicas;
+  params.numProcesses = numProcesses;
+  params.processRank = rank;
+  params.socketPath = "socket.";
+  params.modelFile = modelFile;
+  Data data(params);
+  StaticNetwork<28, 28, 10, 30,
+                CrossEntropyCost::compute,
+                CrossEntropyCost::delta,
+                FullyConnectedLayer<30, 28 * 28,
+                                    Sigmoid::compute,
+                                    Sigmoid::deriv>> network(params);
+  network.SGD(data);
+}
+
+/// Run train() in numProcesses child processes, returning whether all
+/// succeeded. The parent does not start TBB's threads, so it can fork.
+static bool run(unsigned numReplicas, unsigned numProcesses,
+                const std::string &modelFile) {
+  std::vector<pid_t> children;
+  for (unsigned rank = 0; rank < numProcesses; ++rank) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      std::freopen("/dev/null", "w", stdout);
+      train(numReplicas, numProcesses, rank, modelFile);
+      std::exit(0);
+    }
+    children.push_back(pid);
+  }
+  bool ok = true;
+  for (pid_t child : children) {
+    int status;
+    ok &= waitpid(child, &status, 0) == child && WIFEXITED(status) &&
+          WEXITSTATUS(status) == 0;
+  }
+  return ok;
+}
+
+static std::vector<char> readFile(const std::string &filename) {
+  std::ifstream file(filename, std::ios::binary);
+  return std::vector<char>(std::istreambuf_iterator<char>(file),
+                           std::istreambuf_iterator<char>());
+}
+
+int main(void) {
+  char directory[] = "/tmp/parallel_test.XXXXXX";
+  if (!mkdtemp(directory) || chdir(directory) != 0) {
+    std::cout << "Error creating a temporary directory\n";
+    return 1;
+  }
+  writeDataset("train-images-idx3-ubyte", "train-labels-idx1-ubyte",
+               numTrainingImages, 1);
+  writeDataset("t10k-images-idx3-ubyte", "t10k-labels-idx1-ubyte",
+               numTestImages, 2);
+  bool ok = run(parallelism, 1, "replicas.bin") &&
+            run(1, parallelism, "processes.bin");
+  std::vector<char> replicas = readFile("replicas.bin");
+  std::vector<char> processes = readFile("processes.bin");
+  ok &= !replicas.empty() && replicas == processes;
+  for (const char *file : {"train-images-idx3-ubyte",
+                           "train-labels-idx1-ubyte",
+                           "t10k-images-idx3-ubyte",
+                           "t10k-labels-idx1-ubyte",
+                           "replicas.bin", "processes.bin"}) {
+    std::remove(file);
+  }
+  rmdir(directory);
+  std::cout << parallelism << " processes and " << parallelism
+            << " replicas with a scaled rate: "
+            << (ok ? "same model\n" : "FAILED\n");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "tbb/tbb.h"
+#include "Data.hpp"
+#include "Params.hpp"
+#include "Network.hpp"
+
+/// Train the conv2 network for an epoch as one of numProcesses processes,
+/// with an equal share of the threads, and return the images trained per
+/// second.
+static double train(unsigned numProcesses, unsigned rank,
+                    unsigned numTrainingImages, const std::string &socketPath) {
+  unsigned numThreads = std::thread::hardware_concurrency();
+  tbb::task_scheduler_init init(std::max(1u, numThreads / numProcesses));
+  Params params;
+  params.mbSize = 10;
+  params.numEpochs = 1;
+  params.learningRate = 0.03f;
+  // Decay the weights by learningRate * 0.1 / mbSize each update.
+  params.lambda = 0.1f * numTrainingImages / params.mbSize;
+  params.seed = 1;
+  params.numValidationImages = 0;
+  params.numTrainingImages = numTrainingImages;
+  params.numTestImages = 0;
+  params.numProcesses = numProcesses;
+  params.processRank = rank;
+  params.socketPath = socketPath;
+  Data data(params);
+  constexpr unsigned conv1FMs = 8;
+  constexpr unsigned conv2FMs = 4;
+  constexpr unsigned fcSize = 100;
+  StaticNetwork<28, 28, 10, fcSize,
+                CrossEntropyCost::compute,
+                CrossEntropyCost::delta,
+                ConvLayer<5, 5, 1, 28, 28, 1, conv1FMs,
+                          ReLU::compute, ReLU::deriv>,
+                MaxPoolLayer<2, 2, 24, 24, conv1FMs>,
+                ConvLayer<5, 5, conv1FMs, 12, 12, conv1FMs, conv2FMs,
+                          ReLU::compute, ReLU::deriv>,
+                MaxPoolLayer<2, 2, 8, 8, conv2FMs>,
+                FullyConnectedLayer<fcSize, 4*4*conv2FMs,
+                                    Sigmoid::compute,
+                                    Sigmoid::deriv>> network(params);
+  auto start = std::chrono::high_resolution_clock::now();
+  network.SGD(data);
+  auto end = std::chrono::high_resolution_clock::now();
+  double s = std::chrono::duration<double>(end - start).count();
+  unsigned updateSize = params.mbSize * numProcesses;
+  return (numTrainingImages - (numTrainingImages % updateSize)) / s;
+}
+
+/// Measure data-parallel training over 1, 2, 4 and 8 processes, or up to the
+/// number given, each started by this one and connected through sockets.
+int main(int argc, char **argv) {
+  unsigned maxProcesses = argc > 1 ? std::atoi(argv[1]) : 8;
+  unsigned numTrainingImages = argc > 2 ? std::atoi(argv[2]) : 60000;
+  std::string socketPath = "/tmp/scaling." + std::to_string(getpid()) + ".";
+  std::vector<double> imagesPerSec;
+  for (unsigned numProcesses = 1; numProcesses <= maxProcesses;
+       numProcesses *= 2) {
+    std::cout << "Training with " << numProcesses << " processes\n";
+    std::cout.flush();
+    // The process of rank 0 reports its throughput through a pipe.
+    int result[2];
+    if (pipe(result) != 0) {
+      std::cout << "Error creating a pipe\n";
+      return 1;
+    }
+    std::vector<pid_t> children;
+    for (unsigned rank = 0; rank < numProcesses; ++rank) {
+      pid_t pid = fork();
+      if (pid == 0) {
+        close(result[0]);
+        if (rank != 0) {
+          std::freopen("/dev/null", "w", stdout);
+        }
+        double rate = train(numProcesses, rank, numTrainingImages, socketPath);
+        if (rank == 0 && write(result[1], &rate, sizeof(rate)) !=
+                             ssize_t(sizeof(rate))) {
+          std::exit(1);
+        }
+        std::exit(0);
+      }
+      children.push_back(pid);
+    }
+    close(result[1]);
+    double rate = 0.0;
+    bool ok = read(result[0], &rate, sizeof(rate)) == ssize_t(sizeof(rate));
+    close(result[0]);
+    for (pid_t child : children) {
+      int status;
+      ok &= waitpid(child, &status, 0) == child && WIFEXITED(status) &&
+            WEXITSTATUS(status) == 0;
+    }
+    if (!ok) {
+      std::cout << "Error: training with " << numProcesses
+                << " processes failed\n";
+      return 1;
+    }
+    imagesPerSec.push_back(rate);
+  }
+  std::cout << "=============================\n";
+  std::cout << "Processes  Imgs/s   Speedup\n";
+  std::cout << "-----------------------------\n";
+  for (unsigned i = 0; i < imagesPerSec.size(); ++i) {
+    std::printf("%-10u %-8.0f %.2f\n", 1u << i, imagesPerSec[i],
+                imagesPerSec[i] / imagesPerSec[0]);
+  }
+  std::cout << "=============================\n";
+  return 0;
+}